@@ -47,8 +47,15 @@ enum USBH_SPEED {
 enum USBH_PACKET_CALLBACK_STATUS {
 	USBH_PACKET_CALLBACK_STATUS_OK = 0,
 	USBH_PACKET_CALLBACK_STATUS_ERRSIZ = 1,
-	USBH_PACKET_CALLBACK_STATUS_EAGAIN = 2, // -- TODO: automatic handling of transmit errors 3xTXERR->FATAL
-	USBH_PACKET_CALLBACK_STATUS_EFATAL = 3
+	/// NAK of OUT transfer or transmit error, reported after the retries of the core are exhausted (USBH_RETRY_*)
+	USBH_PACKET_CALLBACK_STATUS_EAGAIN = 2,
+	USBH_PACKET_CALLBACK_STATUS_EFATAL = 3,
+
+	/// transfer has not finished in time (USBH_TIMEOUT_*), its channel has been halted
+	USBH_PACKET_CALLBACK_STATUS_ETIMEOUT = 4,
+
+	/// IN transfer NAKed USBH_NAK_LIMIT_* times gave its channel back, queued again by the core
+	USBH_PACKET_CALLBACK_STATUS_ENAK = 5
 };
 
 enum USBH_POLL_STATUS {
@@ -96,20 +103,52 @@ struct _usbh_packet_callback_data {
 };
 typedef struct _usbh_packet_callback_data usbh_packet_callback_data_t;
 
-typedef void (*usbh_packet_callback_t)(usbh_device_t *dev, usbh_packet_callback_data_t status);
+/**
+ * @param callback_arg as passed in usbh_packet_t or device_control()
+ */
+typedef void (*usbh_packet_callback_t)(void *callback_arg, usbh_packet_callback_data_t status);
+
+/**
+ * @brief Control request waiting until the control endpoint is idle
+ */
+struct _usbh_control_request {
+	usbh_packet_callback_t callback;
+	void *callback_arg;
+	void *data;
+	struct usb_setup_data setup_data;
+};
+typedef struct _usbh_control_request usbh_control_request_t;
 
 struct _usbh_control {
 	enum USBH_CONTROL_STATE state;
 	usbh_packet_callback_t callback;
+	void *callback_arg;
 	union {
 		const void *out;
 		void *in;
 	} data;
 	uint16_t data_length;
 	struct usb_setup_data setup_data;
+
+	/// requests issued while the control endpoint was busy, oldest at queue_head
+	usbh_control_request_t queue[USBH_CONTROL_QUEUE_SIZE];
+	uint8_t queue_head;
+	uint8_t queue_count;
 };
 typedef struct _usbh_control usbh_control_t;
 
+/**
+ * @brief Device driver bound to one interface of the device
+ */
+struct _usbh_interface_driver {
+	/// device driver used for the interface, NULL when the slot is free
+	const usbh_dev_driver_t *drv;
+
+	/// device driver's private data
+	void *drvdata;
+};
+typedef struct _usbh_interface_driver usbh_interface_driver_t;
+
 /**
  * @brief The _usbh_device struct
  *
@@ -122,6 +161,9 @@ struct _usbh_device {
 	/// Device's address
 	int8_t address;
 
+	/// address reserved for the device until device_remove(), 0 when the slot is free
+	uint8_t address_allocated;
+
 	/// @see USBH_SPEED
 	enum USBH_SPEED speed;
 
@@ -133,14 +175,9 @@ struct _usbh_device {
 	uint8_t toggle0;
 
 	/**
-	 * @brief drv - device driver used for this connected device
-	 */
-
-	const usbh_dev_driver_t *drv;
-	/**
-	 * @brief drvdata - device driver's private data
+	 * @brief drivers - device drivers bound to the interfaces of this connected device
 	 */
-	void *drvdata;
+	usbh_interface_driver_t drivers[USBH_MAX_INTERFACE_DRIVERS];
 
 	/**
 	 * @brief lld - pointer to a low-level driver's instance
@@ -176,6 +213,9 @@ struct _usbh_packet {
 	/// Max packet size for an endpoint
 	uint16_t endpoint_size_max;
 
+	/// bInterval of the interrupt endpoint, transfers are started once per interval
+	uint8_t interval;
+
 	/// @see USBH_SPEED
 	enum USBH_SPEED speed;
 	uint8_t *toggle;
@@ -208,14 +248,55 @@ struct _usbh_low_level_driver {
 	/**
 	 * write - perform a write to a device
 	 * @see usbh_packet_t
+	 * @returns false when there is no free channel, packet is not started then
 	 */
-	void (*write)(void *drvdata, const usbh_packet_t *packet);
+	bool (*write)(void *drvdata, const usbh_packet_t *packet);
 
 	/**
 	 * @brief read - perform a read from a device
 	 * @see usbh_packet_t
+	 * @returns false when there is no free channel, packet is not started then
+	 */
+	bool (*read)(void *drvdata, usbh_packet_t *packet);
+
+	/**
+	 * @brief cancel - halt the channel of the transfer started by read or write
+	 * @param packet started packet, the transfer is found by its callback_arg
+	 * @returns false when no channel works on the transfer
+	 *
+	 * Callback of the transfer must not be called after this.
+	 * May be NULL, transfers do not time out then
+	 */
+	bool (*cancel)(void *drvdata, const usbh_packet_t *packet);
+
+	/**
+	 * @brief validate - check the packet can be transferred at all, before it is queued
+	 * @param in true for read, false for write
+	 * @returns false to fail the transfer at once by USBH_PACKET_CALLBACK_STATUS_EFATAL
+	 *
+	 * May be NULL, all packets are accepted then
+	 */
+	bool (*validate)(void *drvdata, const usbh_packet_t *packet, bool in);
+
+	/**
+	 * @brief park - give back the channel of one IN transfer waiting for its retry
+	 * @param priority priority of the transfer left without channel, @see usbh_channel_priority
+	 * @returns false when no transfer of the same or lower priority waits
+	 *
+	 * Parked transfer ends by USBH_PACKET_CALLBACK_STATUS_ENAK and the core queues it again.
+	 * May be NULL, transfers keep their channels until they finish then
 	 */
-	void (*read)(void *drvdata, usbh_packet_t *packet);
+	bool (*park)(void *drvdata, uint8_t priority);
+
+	/**
+	 * @brief endpoint - endpoint of the interface bound to a device driver is going to be used
+	 * @param in direction of the endpoint
+	 * @param max_packet_size wMaxPacketSize without the additional transactions
+	 *
+	 * Called during the enumeration, e.g. to size the hardware buffers.
+	 * May be NULL
+	 */
+	void (*endpoint)(void *drvdata, enum USBH_ENDPOINT_TYPE type, bool in, uint16_t max_packet_size);
 
 	/**
 	 * @brief this is called as a part of @ref usbh_poll() routine
@@ -236,9 +317,166 @@ struct _usbh_low_level_driver {
 };
 typedef struct _usbh_low_level_driver usbh_low_level_driver_t;
 
+typedef void (*usbh_timer_callback_t)(void *arg);
+
+/**
+ * @brief One-shot timer, owned by the driver and linked into the timer wheel of the core
+ *
+ * Must not be moved or reused for other data while it is armed, @see usbh_timer_stop()
+ */
+struct _usbh_timer {
+	usbh_timer_callback_t callback;
+	void *arg;
+
+	/// expiration on the 64-bit time base, @see usbh_time_us()
+	uint64_t expire_us;
+
+	/// next timer in the same slot of the wheel
+	struct _usbh_timer *next;
+	bool armed;
+};
+typedef struct _usbh_timer usbh_timer_t;
+
+enum USBH_URB_STATE {
+	USBH_URB_STATE_FREE,
+	USBH_URB_STATE_PENDING,
+	USBH_URB_STATE_ACTIVE,
+
+	/// pending, waits for retry_us before it is started again
+	USBH_URB_STATE_BACKOFF
+};
+
+/**
+ * @brief USB request block - transfer queued by usbh_read() or usbh_write()
+ *
+ * Transfers to the same endpoint are started one by one, in the order of submission
+ */
+struct _usbh_urb {
+	/// copy of the submitted packet, completion is reported to the core
+	usbh_packet_t packet;
+
+	/// callback and its argument of the submitted packet
+	usbh_packet_callback_t callback;
+	void *callback_arg;
+
+	const usbh_low_level_driver_t *lld;
+	enum USBH_URB_STATE state;
+	bool in;
+
+	/// count of retries after EAGAIN, @see USBH_RETRY_CONTROL
+	uint8_t retries;
+
+	/// length transferred by the previous attempts, the retry continues after it
+	uint16_t transferred_length;
+
+	/// time of the next attempt in USBH_URB_STATE_BACKOFF
+	uint32_t retry_us;
+
+	/// deadline of the active transfer, @see USBH_TIMEOUT_CONTROL_US
+	usbh_timer_t timer;
+
+	/// next pending urb, USBH_URB_NONE at the end of the queue
+	uint8_t next;
+};
+typedef struct _usbh_urb usbh_urb_t;
+
+#define USBH_URB_NONE	(0xff)
+
+/**
+ * @brief Counters of one endpoint, @see usbh_stats_get()
+ */
+struct _usbh_endpoint_stats {
+	/// -1 when the entry is free
+	int8_t address;
+	uint8_t endpoint_address;
+	usbh_transfer_stats_t stats;
+};
+typedef struct _usbh_endpoint_stats usbh_endpoint_stats_t;
+
+/**
+ * @brief Interface descriptor (one alternate setting) found in the configuration descriptor
+ *
+ * Slice of the interface starts with the interface descriptor and contains
+ * all class-specific and endpoint descriptors up to the next interface descriptor.
+ */
+struct _usbh_interface_index {
+	/// offset of the interface descriptor from the device descriptor in usbh_buffer
+	uint16_t offset;
+
+	/// length of the slice in bytes
+	uint16_t length;
+
+	/// endpoints of this interface are endpoints[endpoint_first .. endpoint_first + endpoint_count - 1]
+	uint8_t endpoint_first;
+	uint8_t endpoint_count;
+
+	/// count of the other descriptors in the slice
+	uint8_t class_specific_count;
+};
+typedef struct _usbh_interface_index usbh_interface_index_t;
+
+/**
+ * @brief Index of the configuration descriptor in usbh_buffer, built in one pass
+ */
+struct _usbh_descriptor_index {
+	uint8_t interface_count;
+	uint8_t endpoint_count;
+	usbh_interface_index_t interfaces[USBH_MAX_INDEXED_INTERFACES];
+
+	/// offsets of the endpoint descriptors from the device descriptor in usbh_buffer
+	uint16_t endpoints[USBH_MAX_INDEXED_ENDPOINTS];
+};
+typedef struct _usbh_descriptor_index usbh_descriptor_index_t;
+
+/// USB addresses 1..127, address 0 is never allocated
+#define USBH_ADDRESS_COUNT	(128)
+
+#define USBH_BITMAP_WORDS(bits)	(((bits) + 31) / 32)
+
+/**
+ * @brief The _usbh_generic_data struct
+ *
+ * State of the core kept per low-level driver instance,
+ * so devices on different controllers are enumerated independently.
+ * Must be the first member of the low-level driver's data.
+ */
 struct _usbh_generic_data {
 	usbh_device_t usbh_device[USBH_MAX_DEVICES];
-	uint8_t usbh_buffer[BUFFER_ONE_BYTES];
+	/// word aligned, the configuration descriptor is read into it by the DMA of the low-level driver
+	uint8_t usbh_buffer[BUFFER_ONE_BYTES] __attribute__((aligned(4)));
+
+	/// enumeration of a device is in progress on this controller
+	bool enumeration_run;
+
+	/// address assigned to the device being enumerated
+	int8_t address_temporary;
+
+	/// set bit for every free slot of usbh_device
+	uint32_t device_free[USBH_BITMAP_WORDS(USBH_MAX_DEVICES)];
+
+	/// set bit for every free USB address
+	uint32_t address_free[USBH_BITMAP_WORDS(USBH_ADDRESS_COUNT)];
+
+	/// allocation of addresses continues from here, so released addresses are not reused at once
+	uint8_t address_next;
+
+	/// timings of the last enumeration, @see usbh_enum_timing_get()
+	usbh_enum_timing_t enum_timing;
+	uint32_t enum_time_start_us;
+	uint32_t enum_time_step_us;
+
+	/// transfers of all devices on this controller
+	usbh_urb_t urbs[USBH_MAX_URBS];
+
+	/// first urb waiting for the channel, USBH_URB_NONE if none
+	uint8_t urb_pending;
+
+	/// index of the configuration descriptor of the device being registered
+	usbh_descriptor_index_t descriptor_index;
+
+#if USBH_STATS_ENDPOINTS > 0
+	usbh_endpoint_stats_t stats[USBH_STATS_ENDPOINTS];
+#endif
 };
 typedef struct _usbh_generic_data usbh_generic_data_t;
 
@@ -270,6 +508,9 @@ struct _usbh_dev_driver {
 	 * @param[in] descriptor is the pointer to the descriptor that should
 	 *		be parsed in order to prepare driver to be loaded
 	 *
+	 * Called with the device descriptor, the configuration descriptor, then
+	 * with the descriptors of the bound interface (alternate setting 0) only.
+	 *
 	 * @retval true when the enumeration is complete and the driver is ready to be used
 	 * @retval false when the device driver is not ready to be used
 	 *
@@ -310,15 +551,123 @@ typedef struct _usbh_dev_driver usbh_dev_driver_t;
 /* Hub related functions */
 
 usbh_device_t *usbh_get_free_device(const usbh_device_t *dev);
-bool usbh_enum_available(void);
+bool usbh_enum_available(const usbh_device_t *dev);
 void device_enumeration_start(usbh_device_t *dev);
 
 /* All devices functions */
+
+/**
+ * @brief usbh_read queue the read transfer
+ *
+ * Packet is copied, but the data pointed by the packet
+ * must stay valid until the callback is called.
+ * Several transfers may be queued, also to the same endpoint.
+ */
 void usbh_read(usbh_device_t *dev, usbh_packet_t *packet);
+
+/**
+ * @brief usbh_write queue the write transfer
+ * @see usbh_read()
+ */
 void usbh_write(usbh_device_t *dev, const usbh_packet_t *packet);
+void device_poll(usbh_device_t *dev, uint32_t time_curr_us);
+
+/**
+ * @brief usbh_poll_request ask the core to be polled again not later than at time_us
+ *
+ * Called by the device drivers and the low-level drivers from their poll
+ * routine, or when the transfer is started. The earliest requested time
+ * is returned by usbh_poll_next().
+ */
+void usbh_poll_request(uint32_t time_us);
+
+/**
+ * @brief usbh_time_us monotonic time of the current poll
+ * @returns microseconds on 64 bits, does not wrap around as time_curr_us of usbh_poll() does
+ */
+uint64_t usbh_time_us(void);
+
+/**
+ * @brief usbh_timer_start arm the timer, rearm when it is already armed
+ * @param delay_us time from the current poll to the expiration
+ * @param callback called from usbh_poll() after the expiration, before the drivers are polled.
+ * May be NULL when the owner only checks usbh_timer_pending().
+ * A callback rearming its timer with zero delay is called again by the same poll
+ *
+ * The core is polled at the expiration time, @see usbh_poll_next()
+ */
+void usbh_timer_start(usbh_timer_t *timer, uint32_t delay_us, usbh_timer_callback_t callback, void *arg);
+
+/**
+ * @brief usbh_timer_stop disarm the timer, nothing happens when it is not armed
+ */
+void usbh_timer_stop(usbh_timer_t *timer);
+
+/**
+ * @brief usbh_timer_pending
+ * @returns true when the timer is armed and has not expired yet
+ */
+bool usbh_timer_pending(const usbh_timer_t *timer);
+
+/**
+ * @brief NAK policy of IN transfers, applied by the low-level drivers
+ */
+struct _usbh_nak_policy {
+	/// frames (microframes on the high speed bus) to wait before the NAKed transaction is tried again, 0 for at once
+	uint8_t retry_frames;
+
+	/// count of NAKs after which the transfer ends with USBH_PACKET_CALLBACK_STATUS_ENAK, 0 for never
+	uint16_t limit;
+};
+typedef struct _usbh_nak_policy usbh_nak_policy_t;
+
+/// indexed by USBH_ENDPOINT_TYPE, @see USBH_NAK_RETRY_*_FRAMES and USBH_NAK_LIMIT_*
+extern const usbh_nak_policy_t usbh_nak_policy[];
+
+/// indexed by USBH_ENDPOINT_TYPE, @see USBH_PRIORITY_*
+extern const uint8_t usbh_channel_priority[];
+
+enum USBH_STATS_EVENT {
+	USBH_STATS_EVENT_NAK,
+	USBH_STATS_EVENT_TXERR,
+	USBH_STATS_EVENT_BBERR,
+	USBH_STATS_EVENT_STALL,
+	USBH_STATS_EVENT_DTERR,
+	USBH_STATS_EVENT_RETRY
+};
+
+/**
+ * @brief usbh_stats_event count the bus event of the transfer in progress
+ *
+ * Called by the low-level drivers
+ *
+ * @param lld_data low-level driver's data
+ * @param in direction of the transfer
+ */
+void usbh_stats_event(void *lld_data, const usbh_packet_t *packet, bool in, enum USBH_STATS_EVENT event);
+
+/**
+ * @brief usbh_stats_complete count the successfully completed transfer
+ *
+ * Called by the low-level drivers
+ *
+ * @param length transferred bytes
+ * @param latency_us time since the transfer has been started by the controller
+ */
+void usbh_stats_complete(void *lld_data, const usbh_packet_t *packet, bool in, uint16_t length, uint32_t latency_us);
 
 /* Helper functions used by device drivers */
-void device_control(usbh_device_t *dev, usbh_packet_callback_t callback, const struct usb_setup_data *setup_data, void *data);
+
+/**
+ * @brief device_control perform control transfer on endpoint 0 of the device
+ *
+ * When another control transfer is in progress, request is queued and started
+ * after all requests issued before it. setup_data is copied, data must stay
+ * valid until the callback is called.
+ *
+ * @returns false when the queue is full, request is dropped then
+ */
+bool device_control(usbh_device_t *dev, usbh_packet_callback_t callback, void *callback_arg, const struct usb_setup_data *setup_data, void *data);
 void device_remove(usbh_device_t *dev);
 
 END_DECLS
@@ -34,10 +34,111 @@
 // Max devices
 #define USBH_MAX_DEVICES		(15)
 
+// Max count of device drivers passed to usbh_init(), it fails with more of them
+#define USBH_MAX_DEVICE_DRIVERS	(16)
+
+// Max count of interfaces of one device bound to the device drivers
+#define USBH_MAX_INTERFACE_DRIVERS	(4)
+
+// Max count of transfers queued or in progress per low-level driver
+#define USBH_MAX_URBS	(16)
+
+// Retry policy: a transfer that ended with USBH_PACKET_CALLBACK_STATUS_EAGAIN
+// (NAK of OUT, transmit error) is started again by the core up to this count of times
+// before the error is reported to the driver. Set to 0 to report the error at once
+#define USBH_RETRY_CONTROL		(3)
+#define USBH_RETRY_ISOCHRONOUS	(0)
+#define USBH_RETRY_BULK			(3)
+#define USBH_RETRY_INTERRUPT	(1)
+
+// Frames (1 ms, 125 us microframes on the high speed bus) to wait before the first retry,
+// doubled by every next retry
+#define USBH_RETRY_BACKOFF_CONTROL_FRAMES		(1)
+#define USBH_RETRY_BACKOFF_ISOCHRONOUS_FRAMES	(1)
+#define USBH_RETRY_BACKOFF_BULK_FRAMES			(1)
+#define USBH_RETRY_BACKOFF_INTERRUPT_FRAMES		(1)
+
+// NAK policy of IN transfers: frames (125 us microframes on the high speed bus) to wait
+// before the NAKed transaction is tried again.
+// 0 retries at once, the endpoint is then asked back-to-back while it has nothing to send.
+// Interrupt endpoints are asked once per their bInterval
+#define USBH_NAK_RETRY_CONTROL_FRAMES	(0)
+#define USBH_NAK_RETRY_BULK_FRAMES		(1)
+
+// Count of NAKs after which the IN transfer gives its channel back to the core,
+// so the transfers of other endpoints can use it. The transfer is queued again
+// after USBH_NAK_RETRY_*_FRAMES (one frame at least). 0 keeps the channel
+#define USBH_NAK_LIMIT_CONTROL		(0)
+#define USBH_NAK_LIMIT_BULK			(8)
+#define USBH_NAK_LIMIT_INTERRUPT	(0)
+
+// With the DMA of OTG_HS (USE_STM32F4_HS_DMA) the core retries NAKed control and bulk
+// transactions by itself and reports only the halt of the channel. USBH_NAK_RETRY_* and
+// USBH_NAK_LIMIT_CONTROL/BULK do not apply there, such transfers keep their channel
+// until they finish and are not parked for the transfers of a higher priority
+
+// Priority of the transfers for the channels of the low-level driver, higher first.
+// Pending transfers are started by priority, then in the order of submission. When no
+// channel is left, IN transfer of the same or lower priority waiting for its retry
+// (or for the interval of interrupt endpoint) is parked and queued again
+#define USBH_PRIORITY_CONTROL		(3)
+#define USBH_PRIORITY_ISOCHRONOUS	(3)
+#define USBH_PRIORITY_INTERRUPT		(2)
+#define USBH_PRIORITY_BULK			(1)
+
+// Transfer timeouts: an active transfer not finished within this time is halted
+// and reported with USBH_PACKET_CALLBACK_STATUS_ETIMEOUT. Each stage of the control
+// request is timed separately. 0 disables the timeout: interrupt and bulk IN endpoints
+// are NAKed as long as the device has no data to send
+#define USBH_TIMEOUT_CONTROL_US		(500000)
+#define USBH_TIMEOUT_BULK_OUT_US	(5000000)
+#define USBH_TIMEOUT_BULK_IN_US		(0)
+#define USBH_TIMEOUT_INTERRUPT_US	(0)
+#define USBH_TIMEOUT_ISOCHRONOUS_US	(0)
+
+// Max count of control requests waiting for the control endpoint of one device
+#define USBH_CONTROL_QUEUE_SIZE	(4)
+
+// Max count of interface descriptors (alternate settings included) and endpoint
+// descriptors indexed in the configuration descriptor of the enumerated device
+#define USBH_MAX_INDEXED_INTERFACES	(16)
+#define USBH_MAX_INDEXED_ENDPOINTS	(32)
+
+// Longest time returned by usbh_poll_next() when no driver needs to be
+// polled sooner. Connection of a device is noticed after this time at worst,
+// unless the application wakes up on the USB interrupt
+#define USBH_POLL_IDLE_US	(100000)
+
+// Timer wheel of the core: count of slots (power of two) and time covered by one slot.
+// Timers are checked only in the slots of the elapsed ticks, later ones wait for the next revolution
+#define USBH_TIMER_WHEEL_SLOTS	(32)
+#define USBH_TIMER_TICK_US		(1000)
+
 // Min: 128
 // Set this wisely
 #define BUFFER_ONE_BYTES	(2048)
 
+// Descriptor cache: configuration descriptors of recently enumerated devices
+// are kept, so the re-plugged device skips reading of them.
+// Set entries to 0 to disable the cache
+#define USBH_DESCRIPTOR_CACHE_ENTRIES	(4)
+
+// Max length of the configuration descriptor held by one cache entry
+#define USBH_DESCRIPTOR_CACHE_BYTES	(256)
+
+// Read the configuration descriptor at once, requesting as many bytes
+// as the buffer can hold. The device answers with a short packet of
+// wTotalLength bytes. Set to 0 to read the header first, then wTotalLength
+#define USBH_ENUM_SPECULATIVE_CONFIGURATION_READ	(1)
+
+// Entries of the binary transfer trace ring (power of two),
+// used only when USBH_USE_TRACE is defined (cmake: USE_TRACE)
+#define USBH_TRACE_ENTRIES	(256)
+
+// Transfer statistics: count of endpoints per low-level driver with own counters,
+// @see usbh_stats_get(). Set to 0 to disable the statistics
+#define USBH_STATS_ENDPOINTS	(16)
+
 // HID class devices
 #define USBH_HID_MAX_DEVICES	(2)
 #define USBH_HID_BUFFER		(256)
@@ -59,4 +160,49 @@
 #error USBH_MAX_DEVICES > 127
 #endif
 
+#if (USBH_MAX_DEVICE_DRIVERS > 255)
+#error USBH_MAX_DEVICE_DRIVERS > 255
+#endif
+
+#if (USBH_MAX_URBS > 255)
+#error USBH_MAX_URBS > 255
+#endif
+
+#if (USBH_RETRY_CONTROL > 8) || (USBH_RETRY_ISOCHRONOUS > 8) || (USBH_RETRY_BULK > 8) || (USBH_RETRY_INTERRUPT > 8)
+#error USBH_RETRY_* must not exceed 8, the backoff is doubled by each retry
+#endif
+
+#if (USBH_NAK_RETRY_CONTROL_FRAMES > 255) || (USBH_NAK_RETRY_BULK_FRAMES > 255)
+#error USBH_NAK_RETRY_*_FRAMES must not exceed 255
+#endif
+
+#if (USBH_PRIORITY_CONTROL > 255) || (USBH_PRIORITY_ISOCHRONOUS > 255) || (USBH_PRIORITY_BULK > 255) || (USBH_PRIORITY_INTERRUPT > 255)
+#error USBH_PRIORITY_* must not exceed 255
+#endif
+
+#if (USBH_CONTROL_QUEUE_SIZE < 1) || (USBH_CONTROL_QUEUE_SIZE > 255)
+#error USBH_CONTROL_QUEUE_SIZE must be in range 1..255
+#endif
+
+#if (USBH_TRACE_ENTRIES & (USBH_TRACE_ENTRIES - 1)) || (USBH_TRACE_ENTRIES > 32768)
+#error USBH_TRACE_ENTRIES must be a power of two, at most 32768
+#endif
+
+#if (USBH_TIMER_WHEEL_SLOTS & (USBH_TIMER_WHEEL_SLOTS - 1)) || (USBH_TIMER_WHEEL_SLOTS < 1)
+#error USBH_TIMER_WHEEL_SLOTS must be a power of two
+#endif
+
+#if (USBH_STATS_ENDPOINTS > 255)
+#error USBH_STATS_ENDPOINTS > 255
+#endif
+
+#if (USBH_MAX_INDEXED_INTERFACES > 255) || (USBH_MAX_INDEXED_ENDPOINTS > 255)
+#error USBH_MAX_INDEXED_INTERFACES and USBH_MAX_INDEXED_ENDPOINTS must not exceed 255
+#endif
+
+// configuration descriptor is placed after the 18 bytes of the device descriptor, at a word boundary
+#if (USBH_DESCRIPTOR_CACHE_BYTES > BUFFER_ONE_BYTES - 20)
+#error USBH_DESCRIPTOR_CACHE_BYTES does not fit into BUFFER_ONE_BYTES
+#endif
+
 #endif
@@ -43,12 +43,66 @@ BEGIN_DECLS
 typedef struct _usbh_dev_driver usbh_dev_driver_t;
 typedef struct _usbh_low_level_driver usbh_low_level_driver_t;
 
+/// control requests performed during the enumeration
+enum USBH_ENUM_STEP {
+	USBH_ENUM_STEP_SET_ADDRESS,
+	USBH_ENUM_STEP_DEVICE_DT,
+	USBH_ENUM_STEP_CONFIGURATION_DT_HEADER,
+	USBH_ENUM_STEP_CONFIGURATION_DT,
+	USBH_ENUM_STEP_SET_CONFIGURATION,
+	USBH_ENUM_STEP_COUNT
+};
+
+struct _usbh_enum_timing {
+	/// time spent by the step, summed over the repeated requests
+	uint32_t step_us[USBH_ENUM_STEP_COUNT];
+
+	/// count of requests performed by the step, 0 for skipped steps
+	uint8_t step_requests[USBH_ENUM_STEP_COUNT];
+
+	/// time from the start of the enumeration to its end
+	uint32_t total_us;
+
+	/// false when the enumeration failed or is still in progress
+	bool complete;
+};
+typedef struct _usbh_enum_timing usbh_enum_timing_t;
+
+/// bucket i counts transfers completed within (125 << i) us, the last one all slower
+#define USBH_STATS_LATENCY_BUCKETS	(8)
+
+/// pass to usbh_stats_get() for the sum over all endpoints of the device
+#define USBH_STATS_DEVICE	(0xff)
+
+struct _usbh_transfer_stats {
+	/// successfully completed transfers and their bytes
+	uint32_t transfers;
+	uint32_t bytes;
+
+	/// bus events, counted per occurrence
+	uint32_t naks;
+	uint32_t txerr;
+	uint32_t bberr;
+	uint32_t stalls;
+	uint32_t dterr;
+
+	/// transfers started again by the core after a NAK of OUT or a transmit error,
+	/// @see USBH_RETRY_CONTROL. NAKed IN tokens are counted by naks only
+	uint32_t retries;
+
+	/// time from the start of the transfer by the controller to its completion
+	uint32_t latency[USBH_STATS_LATENCY_BUCKETS];
+};
+typedef struct _usbh_transfer_stats usbh_transfer_stats_t;
+
 /**
  * @brief usbh_init
  * @param low_level_drivers list of the low level drivers to be used by this library
  * @param device_drivers list of the device drivers that could be used with attached devices
+ * @returns false when no low-level drivers are passed or device_drivers holds more than
+ * USBH_MAX_DEVICE_DRIVERS entries, the library stays uninitialized then
  */
-void usbh_init(const usbh_low_level_driver_t * const low_level_drivers[], const usbh_dev_driver_t * const device_drivers[]);
+bool usbh_init(const usbh_low_level_driver_t * const low_level_drivers[], const usbh_dev_driver_t * const device_drivers[]);
 
 /**
  * @brief usbh_poll
@@ -60,6 +114,39 @@ void usbh_init(const usbh_low_level_driver_t * const low_level_drivers[], const
  */
 void usbh_poll(uint32_t time_curr_us);
 
+/**
+ * @brief usbh_poll_next the same as usbh_poll(), reporting when to poll next time
+ * @param time_curr_us - use monotically rising time
+ * @returns time in microseconds (same base as time_curr_us) of the next
+ *	poll needed by the drivers, at most USBH_POLL_IDLE_US after time_curr_us.
+ *	Application may sleep until then. Time in the past means poll again immediately.
+ *
+ * Transfers started by the application between polls (e.g. write to the midi device)
+ * are not covered by the returned time, poll immediately after starting them.
+ */
+uint32_t usbh_poll_next(uint32_t time_curr_us);
+
+/**
+ * @brief usbh_enum_timing_get timings of the last enumeration on the low-level driver
+ * @param lld low-level driver passed to usbh_init()
+ * @param[out] timing
+ */
+void usbh_enum_timing_get(const usbh_low_level_driver_t *lld, usbh_enum_timing_t *timing);
+
+/**
+ * @brief usbh_stats_get transfer statistics of the device or one of its endpoints
+ *
+ * Counters are cleared when the device is removed.
+ *
+ * @param lld low-level driver passed to usbh_init()
+ * @param address USB address of the device
+ * @param endpoint_address endpoint number ORed with 0x80 for IN endpoints, 0 for the control endpoint,
+ *	or USBH_STATS_DEVICE for the whole device
+ * @param[out] stats
+ * @returns false when nothing has been counted for the device or endpoint
+ */
+bool usbh_stats_get(const usbh_low_level_driver_t *lld, uint8_t address, uint8_t endpoint_address, usbh_transfer_stats_t *stats);
+
 END_DECLS
 
 #endif // USBH_CORE_
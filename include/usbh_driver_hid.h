@@ -52,6 +52,10 @@ void hid_driver_init(const hid_config_t *config);
 
 /**
  * @brief hid_set_report
+ *
+ * Report set while the previous one is in progress is sent after it,
+ * only the last of such values is kept.
+ *
  * @param device_id handle of HID device
  * @returns true on success, false otherwise
  */
@@ -0,0 +1,105 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_DWC2_MODEL_H_
+#define USBH_DWC2_MODEL_H_
+
+#include "usbh_lld_sim.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/*
+ * Behavioral model of the OTG_FS and OTG_HS cores (Synopsys DWC2) of STM32F4, for the host build
+ *
+ * usbh_lld_stm32f4 built with USBH_LLD_STM32F4_MODEL accesses its registers and FIFOs
+ * by the functions below instead of the memory mapped ones. The model covers what the driver
+ * uses: the root port (HPRT), the core interrupts (GINTSTS), the channels (HCCHAR, HCINT,
+ * HCTSIZ), the frame number and the receive and transmit FIFOs with their sizes in the slave
+ * mode, and the internal DMA (HCDMA) of the OTG_HS core. One core is modelled, the driver
+ * of either OTG_FS or OTG_HS (with the full speed PHY) is passed to usbh_init().
+ *
+ * The bus is instantaneous: non-periodic transactions take place as soon as the channel
+ * is enabled and its data are in the FIFO, periodic ones at the start of the frame
+ * selected by ODDFRM. NAKed non-periodic transfers of the DMA are asked again in the next
+ * frame. The attached device is described by usbh_lld_sim_device_t, its handlers
+ * of non-control endpoints are called for each packet.
+ */
+
+struct _usbh_dwc2_model_stats {
+	/// accesses of the registers by the driver
+	uint32_t reads;
+	uint32_t writes;
+
+	/// words moved through the FIFO windows
+	uint32_t fifo_words_in;
+	uint32_t fifo_words_out;
+
+	/// transactions on the bus
+	uint32_t packets;
+	uint32_t naks;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+
+	/// accesses the core would not accept, e.g. the FIFO overflow, and OUT packets
+	/// the device ignores for their wrong data PID
+	uint32_t errors;
+};
+typedef struct _usbh_dwc2_model_stats usbh_dwc2_model_stats_t;
+
+/**
+ * @brief usbh_dwc2_model_attach plug the device into the root port
+ */
+void usbh_dwc2_model_attach(const usbh_lld_sim_device_t *device);
+
+/**
+ * @brief usbh_dwc2_model_detach unplug the device from the root port
+ */
+void usbh_dwc2_model_detach(void);
+
+/**
+ * @brief usbh_dwc2_model_run advance the frames of the root port up to the time
+ *
+ * Channels disabled since the last run report their halt. Call before usbh_poll() with the same time.
+ */
+void usbh_dwc2_model_run(uint32_t time_curr_us);
+
+/**
+ * @brief usbh_dwc2_model_get_stats copy the counters, and reset them when reset is true
+ */
+void usbh_dwc2_model_get_stats(usbh_dwc2_model_stats_t *stats, bool reset);
+
+// register and FIFO accessors of usbh_lld_stm32f4.c
+uint32_t usbh_dwc2_model_read(uint32_t addr);
+void usbh_dwc2_model_write(uint32_t addr, uint32_t value);
+void usbh_dwc2_model_fifo_write(uint32_t addr, const void *data, uint32_t length);
+void usbh_dwc2_model_fifo_read(uint32_t addr, void *data, uint32_t length);
+
+/**
+ * @brief usbh_dwc2_model_dma_addr bus address of the data, to be written into HCDMA next
+ */
+uint32_t usbh_dwc2_model_dma_addr(const void *data);
+
+END_DECLS
+
+#endif
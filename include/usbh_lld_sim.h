@@ -0,0 +1,124 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_LLD_SIM_H_
+#define USBH_LLD_SIM_H_
+
+#include "usbh_core.h"
+#include "driver/usbh_device_driver.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/// return these from the handlers of the simulated device
+#define USBH_LLD_SIM_NAK	(-1)
+#define USBH_LLD_SIM_STALL	(-2)
+
+/**
+ * @brief Scriptable virtual device attached to the root port of the simulated controller
+ *
+ * Standard requests (SET_ADDRESS, GET_DESCRIPTOR of device and configuration
+ * descriptor, SET_CONFIGURATION) are answered by the simulator itself.
+ * Everything else is forwarded to the handlers. Handlers may be NULL.
+ */
+struct _usbh_lld_sim_device {
+	/// @see USBH_SPEED
+	enum USBH_SPEED speed;
+
+	/// 18 bytes of the device descriptor
+	const uint8_t *device_descriptor;
+
+	/// complete configuration descriptor (wTotalLength bytes)
+	const uint8_t *config_descriptor;
+
+	/// time in microseconds between submitting a transfer and its completion
+	uint32_t latency_us;
+
+	/// count of NAKs answered before each non-control transfer is accepted
+	uint32_t nak_count;
+
+	/**
+	 * @brief control - non-standard control request
+	 * @param data buffer for the data stage (both directions)
+	 * @returns length of the IN data stage, 0, or USBH_LLD_SIM_STALL
+	 */
+	int32_t (*control)(void *arg, const struct usb_setup_data *setup_data, uint8_t *data);
+
+	/**
+	 * @brief in - IN transfer on non-control endpoint
+	 * @returns count of bytes written to data, USBH_LLD_SIM_NAK or USBH_LLD_SIM_STALL
+	 */
+	int32_t (*in)(void *arg, uint8_t endpoint_address, uint8_t *data, uint16_t length);
+
+	/**
+	 * @brief out - OUT transfer on non-control endpoint
+	 * @returns count of bytes accepted, USBH_LLD_SIM_NAK or USBH_LLD_SIM_STALL
+	 */
+	int32_t (*out)(void *arg, uint8_t endpoint_address, const uint8_t *data, uint16_t length);
+
+	/// passed to the handlers
+	void *arg;
+};
+typedef struct _usbh_lld_sim_device usbh_lld_sim_device_t;
+
+struct _usbh_lld_sim_stats {
+	uint32_t polls;
+	uint32_t transfers;
+	uint32_t naks;
+	uint32_t txerrs;
+	uint32_t stalls;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+};
+typedef struct _usbh_lld_sim_stats usbh_lld_sim_stats_t;
+
+// pass this to usbh init
+extern const usbh_low_level_driver_t usbh_lld_sim_driver_0;
+extern const usbh_low_level_driver_t usbh_lld_sim_driver_1;
+
+/**
+ * @brief usbh_lld_sim_attach plug the device into the root port
+ *
+ * Connection is reported by the next poll after the simulated port reset
+ */
+void usbh_lld_sim_attach(const usbh_low_level_driver_t *lld, const usbh_lld_sim_device_t *device);
+
+/**
+ * @brief usbh_lld_sim_detach unplug the device from the root port
+ */
+void usbh_lld_sim_detach(const usbh_low_level_driver_t *lld);
+
+/**
+ * @brief usbh_lld_sim_inject_txerr answer the next transactions on non-control endpoints by transmit error
+ * @param count count of the failing transactions
+ */
+void usbh_lld_sim_inject_txerr(const usbh_low_level_driver_t *lld, uint32_t count);
+
+/**
+ * @brief usbh_lld_sim_get_stats copy the bus counters of the simulated controller
+ */
+void usbh_lld_sim_get_stats(const usbh_low_level_driver_t *lld, usbh_lld_sim_stats_t *stats);
+
+END_DECLS
+
+#endif
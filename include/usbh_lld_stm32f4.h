@@ -33,6 +33,23 @@ BEGIN_DECLS
 extern const usbh_low_level_driver_t usbh_lld_stm32f4_driver_fs;
 extern const usbh_low_level_driver_t usbh_lld_stm32f4_driver_hs;
 
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+/**
+ * @brief usbh_lld_stm32f4_irq_fs service the channels, call from otg_fs_isr()
+ *
+ * Callbacks of the completed transfers are still called by usbh_poll()
+ *
+ * @returns true if usbh_poll() should be called as soon as possible
+ */
+bool usbh_lld_stm32f4_irq_fs(void);
+
+/**
+ * @brief usbh_lld_stm32f4_irq_hs service the channels, call from otg_hs_isr()
+ * @see usbh_lld_stm32f4_irq_fs
+ */
+bool usbh_lld_stm32f4_irq_hs(void);
+#endif
+
 #ifdef USART_DEBUG
 void print_channels(const void *drvdata);
 #else
@@ -0,0 +1,132 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_TRACE_H_
+#define USBH_TRACE_H_
+
+#include "usbh_config.h"
+#include "usbh_core.h"
+
+#include <stdint.h>
+
+BEGIN_DECLS
+
+/**
+ * Binary trace of the transfers, kept in RAM
+ *
+ * Enabled by the USBH_USE_TRACE define (cmake: USE_TRACE). Recording an event
+ * takes a few instructions, so unlike LOG_PRINTF it does not change the timing
+ * being observed. Dump the memory returned by usbh_trace_get() and decode it
+ * by tools/usbh_trace_decode.py
+ */
+
+/// "UTRC", marks the beginning of the dump
+#define USBH_TRACE_MAGIC	(0x43525455)
+
+/// keep in sync with tools/usbh_trace_decode.py
+enum USBH_TRACE_EVENT {
+	USBH_TRACE_EVENT_SUBMIT = 1,
+	USBH_TRACE_EVENT_CHANNEL_ALLOC,
+	USBH_TRACE_EVENT_CHANNEL_FREE,
+	USBH_TRACE_EVENT_ACK,
+	USBH_TRACE_EVENT_NAK,
+	USBH_TRACE_EVENT_XFRC,
+	USBH_TRACE_EVENT_TXERR,
+	USBH_TRACE_EVENT_BBERR,
+	USBH_TRACE_EVENT_STALL,
+	USBH_TRACE_EVENT_DTERR,
+	USBH_TRACE_EVENT_FRMOR,
+	USBH_TRACE_EVENT_CHH,
+	USBH_TRACE_EVENT_CALLBACK
+};
+
+/// no channel is related to the event
+#define USBH_TRACE_CHANNEL_NONE	(0xff)
+
+struct _usbh_trace_entry {
+	uint32_t time_us;
+
+	/// @see USBH_TRACE_EVENT
+	uint8_t event;
+	uint8_t channel;
+	uint8_t address;
+
+	/// endpoint number ORed with 0x80 for IN transfers
+	uint8_t endpoint;
+
+	/// length of the transfer; status << 16 | transferred length for callback
+	uint32_t arg;
+};
+typedef struct _usbh_trace_entry usbh_trace_entry_t;
+
+/**
+ * @brief Ring of the trace entries, dumped as a whole
+ */
+struct _usbh_trace {
+	uint32_t magic;
+	uint16_t entry_size;
+	uint16_t entry_count;
+
+	/// count of the recorded events, the next one is written to entries[head % entry_count]
+	uint32_t head;
+
+	usbh_trace_entry_t entries[USBH_TRACE_ENTRIES];
+};
+typedef struct _usbh_trace usbh_trace_t;
+
+#ifdef USBH_USE_TRACE
+/**
+ * @brief usbh_trace_get
+ * @returns trace ring to be dumped, sizeof(usbh_trace_t) bytes
+ */
+const usbh_trace_t *usbh_trace_get(void);
+
+/**
+ * @brief usbh_trace_clear drop all recorded events
+ */
+void usbh_trace_clear(void);
+
+/**
+ * @brief usbh_trace_clock_set use finer timestamps than the time of the poll
+ * @param clock_us returns monotonically rising time in microseconds, NULL for the poll time
+ */
+void usbh_trace_clock_set(uint32_t (*clock_us)(void));
+
+void usbh_trace_time(uint32_t time_curr_us);
+void usbh_trace_record(enum USBH_TRACE_EVENT event, uint8_t channel, uint8_t address, uint8_t endpoint, uint32_t arg);
+
+#define USBH_TRACE_TIME(time_curr_us) usbh_trace_time(time_curr_us)
+#define USBH_TRACE(event, channel, address, endpoint, arg) \
+	usbh_trace_record(event, channel, address, endpoint, arg)
+#else
+#define USBH_TRACE_TIME(time_curr_us)
+#define USBH_TRACE(event, channel, address, endpoint, arg)
+#endif
+
+/// trace the event of the transfer described by usbh_packet_t
+#define USBH_TRACE_PACKET(event, channel, packet, in, arg) \
+	USBH_TRACE(event, channel, (packet)->address, \
+		(packet)->endpoint_address | ((in) ? 0x80 : 0), arg)
+
+END_DECLS
+
+#endif
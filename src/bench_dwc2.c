@@ -0,0 +1,355 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_core.h"				/// provides usbh_init() and usbh_poll()
+#include "usbh_lld_stm32f4.h"		/// provides low level usb host driver for stm32f4 platform
+#include "usbh_dwc2_model.h"		/// provides host-side model of the OTG_FS core
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Give up when the device is not ready after this amount of simulated time. */
+#define READY_TIMEOUT_US	(10000000)
+
+/* Bulk transfers measured for each length and direction. */
+#define BULK_TRANSFERS	(64)
+
+/* Largest bulk transfer measured. */
+#define BULK_LENGTH_MAX	(4096)
+
+/* Bytes after the data of the read, checked to be untouched. */
+#define BULK_GUARD	(4)
+#define BULK_GUARD_BYTE	(0xa5)
+
+/* Room for the unaligned data followed by the guard. */
+#define BULK_BUFFER_SIZE	(BULK_LENGTH_MAX + 4 + BULK_GUARD)
+
+/* The device NAKs one of this many OUT packets, the transfer goes on after the acknowledged ones. */
+#define OUT_NAK_INTERVAL	(50)
+
+/* Polls of the idle bus, one per frame. */
+#define IDLE_POLLS	(1000)
+
+/* Vendor specific device with one bulk IN (0x81) and one bulk OUT (0x02) endpoint. */
+static const uint8_t vendor_device_descriptor[] = {
+	0x12, 0x01, 0x00, 0x02, 0xff, 0x00, 0x00, 0x40,
+	0x83, 0x04, 0x40, 0x57, 0x00, 0x01, 0x00, 0x00,
+	0x00, 0x01,
+};
+
+static const uint8_t vendor_config_descriptor[] = {
+	0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+	0x09, 0x04, 0x00, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00,
+	0x07, 0x05, 0x02, 0x02, 0x40, 0x00, 0x00,
+};
+
+/* Data of the bulk transfers is a running byte counter, checked at the other side. */
+static uint32_t device_in_bytes;
+static uint32_t device_out_bytes;
+static uint32_t device_out_errors;
+static uint32_t device_out_packets;
+
+static int32_t vendor_in(void *arg, uint8_t endpoint_address, uint8_t *data, uint16_t length)
+{
+	(void)arg;
+	if (endpoint_address != 1) {
+		return USBH_LLD_SIM_STALL;
+	}
+	uint32_t i;
+	for (i = 0; i < length; i++) {
+		data[i] = device_in_bytes + i;
+	}
+	device_in_bytes += length;
+	return length;
+}
+
+static int32_t vendor_out(void *arg, uint8_t endpoint_address, const uint8_t *data, uint16_t length)
+{
+	(void)arg;
+	if (endpoint_address != 2) {
+		return USBH_LLD_SIM_STALL;
+	}
+	if (++device_out_packets % OUT_NAK_INTERVAL == 0) {
+		return USBH_LLD_SIM_NAK;
+	}
+	uint32_t i;
+	for (i = 0; i < length; i++) {
+		if (data[i] != (uint8_t)(device_out_bytes + i)) {
+			device_out_errors++;
+			break;
+		}
+	}
+	device_out_bytes += length;
+	return length;
+}
+
+static const usbh_lld_sim_device_t vendor = {
+	.speed = USBH_SPEED_FULL,
+	.device_descriptor = vendor_device_descriptor,
+	.config_descriptor = vendor_config_descriptor,
+	.in = vendor_in,
+	.out = vendor_out,
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	NULL
+};
+
+static const usbh_low_level_driver_t * const lld_drivers_fs[] = {
+	&usbh_lld_stm32f4_driver_fs,
+	NULL
+};
+
+/* OTG_HS moves the data by its internal DMA. */
+static const usbh_low_level_driver_t * const lld_drivers_hs[] = {
+	&usbh_lld_stm32f4_driver_hs,
+	NULL
+};
+
+static const usbh_low_level_driver_t *lld;
+
+static uint32_t time_curr_us;
+
+/**
+ * Timestamp counter of the CPU, wall time in nanoseconds where there is none
+ */
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Bring the model to the current time and poll at the time requested by the drivers
+ */
+static void step(void)
+{
+	usbh_dwc2_model_run(time_curr_us);
+	const uint32_t time_next_us = usbh_poll_next(time_curr_us);
+	if ((int32_t)(time_next_us - time_curr_us) > 0) {
+		time_curr_us = time_next_us;
+	} else {
+		time_curr_us++;
+	}
+}
+
+static bool vendor_ready(void)
+{
+	usbh_enum_timing_t timing;
+	usbh_enum_timing_get(lld, &timing);
+	return timing.complete;
+}
+
+static uint32_t transfers_done;
+static uint32_t transfers_failed;
+
+static void transfer_callback(void *callback_arg, usbh_packet_callback_data_t cb_data)
+{
+	const usbh_packet_t *packet = callback_arg;
+	transfers_done++;
+	if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK ||
+		cb_data.transferred_length != packet->datalen) {
+		transfers_failed++;
+	}
+}
+
+struct _bench_result {
+	usbh_dwc2_model_stats_t stats;
+	uint32_t polls;
+	uint64_t cycles;
+	uint32_t data_errors;
+};
+typedef struct _bench_result bench_result_t;
+
+/**
+ * Bulk transfers of the length to the vendor device, one after another
+ *
+ * @param offset of the data from the word aligned buffer
+ * @returns false on timeout
+ */
+static bool run_bulk(bool in, uint16_t length, uint8_t offset, bench_result_t *result)
+{
+	static uint32_t buffer[BULK_BUFFER_SIZE / 4];
+	static uint8_t toggle[2];
+	uint8_t *data = (uint8_t *)buffer + offset;
+	usbh_generic_data_t *lld_data = lld->driver_data;
+	usbh_device_t *dev = &lld_data->usbh_device[0];
+	usbh_packet_t packet;
+
+	packet.data.in = data;
+	packet.datalen = length;
+	packet.address = dev->address;
+	packet.endpoint_address = in ? 1 : 2;
+	packet.endpoint_size_max = 64;
+	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet.speed = dev->speed;
+	packet.callback = transfer_callback;
+	packet.callback_arg = &packet;
+	packet.toggle = &toggle[in];
+
+	memset(result, 0, sizeof(*result));
+	transfers_done = 0;
+	transfers_failed = 0;
+	usbh_dwc2_model_get_stats(&result->stats, true);
+	const uint32_t time_start_us = time_curr_us;
+	const uint64_t cycles_start = cycles();
+	uint32_t i;
+	for (i = 0; i < BULK_TRANSFERS; i++) {
+		const uint32_t counter = in ? device_in_bytes : device_out_bytes;
+		uint32_t j;
+		if (in) {
+			memset(data, 0, length);
+			memset(&data[length], BULK_GUARD_BYTE, BULK_GUARD);
+			usbh_read(dev, &packet);
+		} else {
+			for (j = 0; j < length; j++) {
+				data[j] = counter + j;
+			}
+			usbh_write(dev, &packet);
+		}
+		while (transfers_done <= i) {
+			if (time_curr_us - time_start_us > READY_TIMEOUT_US) {
+				return false;
+			}
+			step();
+			result->polls++;
+		}
+		for (j = 0; in && j < length + (uint32_t)BULK_GUARD; j++) {
+			const uint8_t expected = j < length ? counter + j : BULK_GUARD_BYTE;
+			if (data[j] != expected) {
+				result->data_errors++;
+				break;
+			}
+		}
+	}
+	result->cycles = cycles() - cycles_start;
+	usbh_dwc2_model_get_stats(&result->stats, false);
+	return true;
+}
+
+static void print_bulk(const char *name, uint16_t length, uint8_t offset, const bench_result_t *result)
+{
+	const usbh_dwc2_model_stats_t *stats = &result->stats;
+	const uint32_t accesses = stats->reads + stats->writes + stats->fifo_words_in + stats->fifo_words_out;
+	const uint32_t bytes = (uint32_t)length * BULK_TRANSFERS;
+
+	printf("  %-3s %6u %6u %7.1f %7.1f %7.1f %7.1f %9.2f %9.1f\n", name, length, offset,
+		(double)result->polls / BULK_TRANSFERS,
+		(double)stats->reads / BULK_TRANSFERS,
+		(double)stats->writes / BULK_TRANSFERS,
+		(double)(stats->fifo_words_in + stats->fifo_words_out) / BULK_TRANSFERS,
+		(double)accesses / bytes,
+		(double)result->cycles / bytes);
+}
+
+int main(int argc, char *argv[])
+{
+	const bool dma = argc > 1 && !strcmp(argv[1], "dma");
+
+	lld = dma ? &usbh_lld_stm32f4_driver_hs : &usbh_lld_stm32f4_driver_fs;
+	if (!usbh_init(dma ? lld_drivers_hs : lld_drivers_fs, device_drivers)) {
+		fprintf(stderr, "usbh_init failed\n");
+		return 1;
+	}
+
+	// Initialization of the core and enumeration through the register model
+	usbh_dwc2_model_attach(&vendor);
+	while (!vendor_ready()) {
+		if (time_curr_us > READY_TIMEOUT_US) {
+			fprintf(stderr, "enumeration failed\n");
+			return 1;
+		}
+		step();
+	}
+	usbh_dwc2_model_stats_t stats;
+	usbh_dwc2_model_get_stats(&stats, true);
+	usbh_enum_timing_t timing;
+	usbh_enum_timing_get(lld, &timing);
+	printf("init and enumeration on the %s model\n", dma ? "OTG_HS (DMA)" : "OTG_FS");
+	printf("  ready  %u us, enumeration %u us\n", time_curr_us, timing.total_us);
+	printf("  reads=%u writes=%u fifo_in=%u fifo_out=%u words packets=%u\n",
+		stats.reads, stats.writes, stats.fifo_words_in, stats.fifo_words_out, stats.packets);
+
+	// Bulk transfers, register and FIFO accesses of usbh_lld_stm32f4. Odd length
+	// and unaligned data pass through the bounce buffers in the DMA mode
+	static const struct {
+		uint16_t length;
+		uint8_t offset;
+	} bulks[] = {
+		{8, 0}, {64, 0}, {509, 0}, {512, 0}, {512, 1}, {BULK_LENGTH_MAX, 0},
+	};
+	uint32_t errors = 0;
+	uint32_t i;
+	printf("bulk transfers (per transfer, %u each, the bus is instantaneous;\n"
+		"  cycles include the core and the model%s)\n",
+		BULK_TRANSFERS,
+#if defined(__x86_64__) || defined(__i386__)
+		""
+#else
+		", cycle is a nanosecond here"
+#endif
+		);
+	printf("  %-3s %6s %6s %7s %7s %7s %7s %9s %9s\n", "dir", "length", "offset", "polls",
+		"reads", "writes", "fifo", "access/B", "cycles/B");
+	for (i = 0; i < sizeof(bulks) / sizeof(bulks[0]); i++) {
+		bench_result_t result;
+		uint32_t dir;
+		for (dir = 0; dir < 2; dir++) {
+			const bool in = !dir;
+			if (!run_bulk(in, bulks[i].length, bulks[i].offset, &result)) {
+				fprintf(stderr, "bulk %s of %u bytes did not complete: %u\n",
+					in ? "read" : "write", bulks[i].length, transfers_done);
+				return 1;
+			}
+			print_bulk(in ? "in" : "out", bulks[i].length, bulks[i].offset, &result);
+			errors += result.stats.errors + result.data_errors + transfers_failed;
+		}
+	}
+
+	// Poll of the idle bus
+	usbh_dwc2_model_get_stats(&stats, true);
+	for (i = 0; i < IDLE_POLLS; i++) {
+		time_curr_us += 1000;
+		usbh_dwc2_model_run(time_curr_us);
+		usbh_poll(time_curr_us);
+	}
+	usbh_dwc2_model_get_stats(&stats, true);
+	printf("idle poll (per usbh_poll())\n");
+	printf("  reads=%.1f writes=%.1f\n", (double)stats.reads / IDLE_POLLS,
+		(double)stats.writes / IDLE_POLLS);
+
+	errors += stats.errors + device_out_errors;
+	if (errors) {
+		fprintf(stderr, "%u errors of the transfers or of the register accesses\n", errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,863 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_core.h"				/// provides usbh_init() and usbh_poll()
+#include "usbh_lld_sim.h"			/// provides simulated low level usb host driver
+#include "usbh_driver_hid.h"		/// provides generic usb device driver for Human Interface Device (HID)
+#include "usbh_driver_hub.h"		/// provides usb full speed hub driver
+#include "usbh_driver_gp_xbox.h"	/// provides usb device driver for Gamepad: Microsoft XBOX compatible Controller
+#include "usbh_driver_ac_midi.h"	/// provides usb device driver for midi class devices
+#include "usbh_trace.h"				/// provides binary trace of the transfers
+#include "usbh_lld_fifo.h"			/// provides FIFO copy routines of the STM32F4 low level driver
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Give up when the device is not ready after this amount of simulated time. */
+#define READY_TIMEOUT_US	(10000000)
+
+/* Simulated time the throughput is measured for. */
+#define THROUGHPUT_TIME_US	(1000000)
+
+/* Count of polls used for measurement of the poll loop cost. */
+#define POLL_COST_ITERATIONS	(100000)
+
+/* HID class request, answered by the simulated mouse */
+#define USB_HID_SET_REPORT	(0x09)
+
+/* Copies of each size measured by the FIFO copy benchmark. */
+#define FIFO_COPY_ITERATIONS	(200000)
+
+/* Count of bulk writes queued at once to one endpoint, more than channels of the controller. */
+#define QUEUE_BURST_PACKETS	(12)
+
+/* Bulk reads of idle endpoints (2 and up) of the midi device, as many as channels of the controller. */
+#define IDLE_READS	(8)
+
+static const uint8_t mouse_device_descriptor[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x08,
+	0x6d, 0x04, 0x77, 0xc0, 0x00, 0x72, 0x01, 0x02,
+	0x00, 0x01
+};
+
+static const uint8_t mouse_config_descriptor[] = {
+	// configuration
+	0x09, 0x02, 0x22, 0x00, 0x01, 0x01, 0x00, 0xa0, 0x32,
+	// interface: HID, boot, mouse
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x02, 0x00,
+	// HID
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x34, 0x00,
+	// endpoint 1 IN, interrupt, 4 bytes, 10ms
+	0x07, 0x05, 0x81, 0x03, 0x04, 0x00, 0x0a
+};
+
+static const uint8_t midi_device_descriptor[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x82, 0x05, 0x12, 0x00, 0x00, 0x01, 0x01, 0x02,
+	0x00, 0x01
+};
+
+static const uint8_t midi_config_descriptor[] = {
+	// configuration
+	0x09, 0x02, 0x47, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
+	// interface: audio control
+	0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+	0x09, 0x24, 0x01, 0x00, 0x01, 0x09, 0x00, 0x01, 0x01,
+	// interface: midi streaming
+	0x09, 0x04, 0x01, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+	0x07, 0x24, 0x01, 0x00, 0x01, 0x41, 0x00,
+	// endpoint 1 OUT, bulk, 64 bytes
+	0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x25, 0x01, 0x01, 0x01,
+	// endpoint 1 IN, bulk, 64 bytes
+	0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x25, 0x01, 0x01, 0x03
+};
+
+static const uint8_t composite_device_descriptor[] = {
+	0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x40,
+	0x83, 0x05, 0x34, 0x00, 0x00, 0x01, 0x01, 0x02,
+	0x00, 0x01
+};
+
+static const uint8_t composite_config_descriptor[] = {
+	// configuration
+	0x09, 0x02, 0x69, 0x00, 0x03, 0x01, 0x00, 0x80, 0x32,
+	// interface 0: HID, boot, mouse
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x02, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x34, 0x00,
+	// endpoint 3 IN, interrupt, 4 bytes, 10ms
+	0x07, 0x05, 0x83, 0x03, 0x04, 0x00, 0x0a,
+	// interface 1: audio control
+	0x09, 0x04, 0x01, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+	0x09, 0x24, 0x01, 0x00, 0x01, 0x09, 0x00, 0x01, 0x02,
+	// interface 2: midi streaming
+	0x09, 0x04, 0x02, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+	0x07, 0x24, 0x01, 0x00, 0x01, 0x41, 0x00,
+	// endpoint 1 OUT, bulk, 64 bytes
+	0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x25, 0x01, 0x01, 0x01,
+	// endpoint 1 IN, bulk, 64 bytes
+	0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x25, 0x01, 0x01, 0x03,
+	// interface 2, alternate setting 1: left to the bound driver
+	0x09, 0x04, 0x02, 0x01, 0x00, 0x01, 0x03, 0x00, 0x00
+};
+
+static uint32_t mouse_reports_set;
+static uint8_t mouse_report_last;
+
+static int32_t mouse_control(void *arg, const struct usb_setup_data *setup_data, uint8_t *data)
+{
+	(void)arg;
+	if (setup_data->bRequest == USB_HID_SET_REPORT) {
+		mouse_reports_set++;
+		mouse_report_last = data[0];
+		return 0;
+	}
+	// report descriptor, content is not parsed by the driver
+	if (setup_data->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		memset(data, 0, 0x34);
+		return 0x34;
+	}
+	return 0;
+}
+
+static int32_t mouse_in(void *arg, uint8_t endpoint_address, uint8_t *data, uint16_t length)
+{
+	(void)arg;
+	(void)endpoint_address;
+	if (length < 4) {
+		return USBH_LLD_SIM_STALL;
+	}
+	data[0] = 0;
+	data[1] = 1;
+	data[2] = 0;
+	data[3] = 0;
+	return 4;
+}
+
+/// endpoints 2 and up have nothing to send, NAK every IN transfer
+static bool midi_in_idle;
+
+static int32_t midi_in(void *arg, uint8_t endpoint_address, uint8_t *data, uint16_t length)
+{
+	(void)arg;
+	if (midi_in_idle && endpoint_address >= 2) {
+		return USBH_LLD_SIM_NAK;
+	}
+	uint16_t i;
+	for (i = 0; i + 4 <= length; i += 4) {
+		// Note On, channel 0
+		data[i] = 0x09;
+		data[i + 1] = 0x90;
+		data[i + 2] = 0x40;
+		data[i + 3] = 0x7f;
+	}
+	return i;
+}
+
+static uint32_t midi_bytes_out;
+
+/// device stops accepting data, NAKs every OUT transfer
+static bool midi_out_hung;
+
+static int32_t midi_out(void *arg, uint8_t endpoint_address, const uint8_t *data, uint16_t length)
+{
+	(void)arg;
+	(void)endpoint_address;
+	(void)data;
+	if (midi_out_hung) {
+		return USBH_LLD_SIM_NAK;
+	}
+	midi_bytes_out += length;
+	return length;
+}
+
+static int32_t composite_in(void *arg, uint8_t endpoint_address, uint8_t *data, uint16_t length)
+{
+	if (endpoint_address == 3) {
+		return mouse_in(arg, endpoint_address, data, length);
+	}
+	return midi_in(arg, endpoint_address, data, length);
+}
+
+static const usbh_lld_sim_device_t mouse = {
+	.speed = USBH_SPEED_FULL,
+	.device_descriptor = mouse_device_descriptor,
+	.config_descriptor = mouse_config_descriptor,
+	.latency_us = 250,
+	.control = mouse_control,
+	.in = mouse_in,
+};
+
+static const usbh_lld_sim_device_t midi = {
+	.speed = USBH_SPEED_FULL,
+	.device_descriptor = midi_device_descriptor,
+	.config_descriptor = midi_config_descriptor,
+	.latency_us = 125,
+	.in = midi_in,
+	.out = midi_out,
+};
+
+static const usbh_lld_sim_device_t composite = {
+	.speed = USBH_SPEED_FULL,
+	.device_descriptor = composite_device_descriptor,
+	.config_descriptor = composite_config_descriptor,
+	.latency_us = 125,
+	.control = mouse_control,
+	.in = composite_in,
+};
+
+static const usbh_dev_driver_t *device_drivers[] = {
+	&usbh_hub_driver,
+	&usbh_hid_driver,
+	&usbh_gp_xbox_driver,
+	&usbh_midi_driver,
+	NULL
+};
+
+static const usbh_low_level_driver_t * const lld_drivers[] = {
+	&usbh_lld_sim_driver_0,
+	&usbh_lld_sim_driver_1,
+	NULL
+};
+
+static uint32_t hid_reports;
+static uint32_t midi_bytes;
+static uint32_t midi_bytes_device[USBH_AC_MIDI_MAX_DEVICES];
+static bool midi_connected;
+static int midi_connected_id;
+
+static void hid_in_message_handler(uint8_t device_id, const uint8_t *data, uint32_t length)
+{
+	(void)device_id;
+	(void)data;
+	(void)length;
+	hid_reports++;
+}
+
+static const hid_config_t hid_config = {
+	.hid_in_message_handler = &hid_in_message_handler
+};
+
+static void midi_in_message_handler(int device_id, uint8_t *data)
+{
+	(void)data;
+	midi_bytes += 4;
+	midi_bytes_device[device_id] += 4;
+}
+
+static void midi_notify_connected(int device_id)
+{
+	midi_connected = true;
+	midi_connected_id = device_id;
+}
+
+static const midi_config_t midi_config = {
+	.read_callback = &midi_in_message_handler,
+	.notify_connected = &midi_notify_connected
+};
+
+static const gp_xbox_config_t gp_xbox_config = {
+	.update = NULL
+};
+
+static uint32_t time_curr_us;
+static uint32_t time_step_us = 1000;
+
+static uint64_t wall_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Timestamp counter of the CPU, wall time in nanoseconds where there is none
+ */
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return wall_time_ns();
+#endif
+}
+
+static void step(void)
+{
+	usbh_poll(time_curr_us);
+	time_curr_us += time_step_us;
+}
+
+/**
+ * Poll only at the times requested by the drivers
+ *
+ * @returns count of polls during duration_us of simulated time
+ */
+static uint32_t run_tickless(uint32_t duration_us)
+{
+	const uint32_t time_start_us = time_curr_us;
+	uint32_t polls = 0;
+	while (time_curr_us - time_start_us < duration_us) {
+		const uint32_t time_next_us = usbh_poll_next(time_curr_us);
+		polls++;
+		if ((int32_t)(time_next_us - time_curr_us) > 0) {
+			time_curr_us = time_next_us;
+		} else {
+			time_curr_us++;
+		}
+	}
+	return polls;
+}
+
+static bool mouse_ready(void)
+{
+	return hid_get_type(0) != HID_TYPE_NONE;
+}
+
+static bool midi_ready(void)
+{
+	return midi_connected;
+}
+
+/**
+ * Attach both devices at once, each to its own controller
+ *
+ * @returns false on timeout
+ */
+static bool run_attach(uint32_t *mouse_us, uint32_t *midi_us)
+{
+	const uint32_t time_start_us = time_curr_us;
+
+	*mouse_us = 0;
+	*midi_us = 0;
+	usbh_lld_sim_attach(&usbh_lld_sim_driver_0, &mouse);
+	usbh_lld_sim_attach(&usbh_lld_sim_driver_1, &midi);
+	while (!*mouse_us || !*midi_us) {
+		if (time_curr_us - time_start_us > READY_TIMEOUT_US) {
+			return false;
+		}
+		step();
+		if (!*mouse_us && mouse_ready()) {
+			*mouse_us = time_curr_us - time_start_us;
+		}
+		if (!*midi_us && midi_ready()) {
+			*midi_us = time_curr_us - time_start_us;
+		}
+	}
+	return true;
+}
+
+static uint32_t queue_done;
+static uint32_t queue_failed;
+static enum USBH_PACKET_CALLBACK_STATUS queue_status_last;
+
+static void queue_callback(void *callback_arg, usbh_packet_callback_data_t cb_data)
+{
+	(void)callback_arg;
+	queue_done++;
+	queue_status_last = cb_data.status;
+	if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
+		queue_failed++;
+	}
+}
+
+/**
+ * Bulk OUT packet of 64 bytes to the midi device
+ */
+static usbh_device_t *queue_packet_init(usbh_packet_t *packet)
+{
+	static const uint8_t data[64];
+	static uint8_t toggle;
+	usbh_generic_data_t *lld_data = usbh_lld_sim_driver_1.driver_data;
+	usbh_device_t *dev = &lld_data->usbh_device[0];
+
+	packet->data.out = data;
+	packet->datalen = sizeof(data);
+	packet->address = dev->address;
+	packet->endpoint_address = 1;
+	packet->endpoint_size_max = 64;
+	packet->endpoint_type = USBH_ENDPOINT_TYPE_BULK;
+	packet->speed = dev->speed;
+	packet->callback = queue_callback;
+	packet->callback_arg = NULL;
+	packet->toggle = &toggle;
+	return dev;
+}
+
+/**
+ * Queue more bulk writes to the midi device than there are channels
+ *
+ * @returns simulated time until all of them completed, 0 on timeout
+ */
+static uint32_t run_queue_burst(void)
+{
+	usbh_packet_t packet;
+	usbh_device_t *dev = queue_packet_init(&packet);
+
+	queue_done = 0;
+	queue_failed = 0;
+	midi_bytes_out = 0;
+	const uint32_t time_start_us = time_curr_us;
+	uint32_t i;
+	for (i = 0; i < QUEUE_BURST_PACKETS; i++) {
+		usbh_write(dev, &packet);
+	}
+	while (queue_done < QUEUE_BURST_PACKETS) {
+		if (time_curr_us - time_start_us > READY_TIMEOUT_US) {
+			return 0;
+		}
+		step();
+	}
+	return time_curr_us - time_start_us;
+}
+
+/**
+ * Write to the midi device, that stopped accepting data
+ *
+ * @returns simulated time until the transfer has been reported, 0 when it has not
+ */
+static uint32_t run_hung_write(void)
+{
+	usbh_packet_t packet;
+	usbh_device_t *dev = queue_packet_init(&packet);
+
+	queue_done = 0;
+	queue_failed = 0;
+	midi_out_hung = true;
+	const uint32_t time_start_us = time_curr_us;
+	usbh_write(dev, &packet);
+	while (!queue_done) {
+		if (time_curr_us - time_start_us > READY_TIMEOUT_US) {
+			break;
+		}
+		step();
+	}
+	midi_out_hung = false;
+	return queue_done ? time_curr_us - time_start_us : 0;
+}
+
+static uint32_t idle_done;
+
+static void idle_callback(void *callback_arg, usbh_packet_callback_data_t cb_data)
+{
+	(void)callback_arg;
+	(void)cb_data;
+	idle_done++;
+}
+
+/**
+ * Write to the midi device while the reads of its idle endpoints hold all channels
+ *
+ * @returns simulated time until the write has completed, 0 when it has not
+ */
+static uint32_t run_idle_reads_write(void)
+{
+	static uint8_t data[IDLE_READS][64];
+	static uint8_t toggle[IDLE_READS];
+	usbh_packet_t packet;
+	usbh_device_t *dev = queue_packet_init(&packet);
+
+	idle_done = 0;
+	midi_in_idle = true;
+	uint32_t i;
+	for (i = 0; i < IDLE_READS; i++) {
+		usbh_packet_t read = packet;
+		read.data.in = data[i];
+		read.endpoint_address = 2 + i;
+		read.callback = idle_callback;
+		read.toggle = &toggle[i];
+		usbh_read(dev, &read);
+	}
+	for (i = 0; i < 4; i++) {
+		step();
+	}
+
+	queue_done = 0;
+	queue_failed = 0;
+	const uint32_t time_start_us = time_curr_us;
+	usbh_write(dev, &packet);
+	while (!queue_done) {
+		if (time_curr_us - time_start_us > READY_TIMEOUT_US) {
+			break;
+		}
+		step();
+	}
+	const uint32_t time_write_us = time_curr_us - time_start_us;
+
+	// reads complete once the endpoints have data
+	midi_in_idle = false;
+	while (idle_done < IDLE_READS && time_curr_us - time_start_us < READY_TIMEOUT_US) {
+		step();
+	}
+	return queue_done && idle_done == IDLE_READS ? time_write_us : 0;
+}
+
+/* FIFO window of one channel, every word accesses the same FIFO on the OTG core. */
+static volatile uint32_t fifo_window[1024];
+static uint32_t fifo_buffer[(512 + 4) / 4];
+static uint32_t fifo_readback[(512 + 4) / 4];
+
+/**
+ * Word loop used by the low-level driver before, casts the buffer to uint32_t*
+ */
+static void fifo_write_words(volatile uint32_t *fifo, const void *data, uint32_t length)
+{
+	const uint32_t *buf32 = data;
+	int32_t i;
+	for (i = length; i > 0; i -= 4) {
+		*fifo++ = *buf32++;
+	}
+}
+
+/**
+ * @returns copied bytes per cycle of usbh_fifo_write(), or of the word loop
+ */
+static double fifo_copy_rate(uint32_t offset, uint32_t length, bool word_loop)
+{
+	const uint8_t *data = (const uint8_t *)fifo_buffer + offset;
+	uint32_t i;
+
+	const uint64_t cycles_start = cycles();
+	for (i = 0; i < FIFO_COPY_ITERATIONS; i++) {
+		if (word_loop) {
+			fifo_write_words(fifo_window, data, length);
+		} else {
+			usbh_fifo_write(fifo_window, data, length);
+		}
+	}
+	const uint64_t cycles_total = cycles() - cycles_start;
+	return (double)length * FIFO_COPY_ITERATIONS / cycles_total;
+}
+
+/**
+ * Round trip through the FIFO, @returns false if the data differ
+ */
+static bool fifo_copy_check(uint32_t offset, uint32_t length)
+{
+	uint8_t *readback = (uint8_t *)fifo_readback + offset;
+
+	memset(fifo_readback, 0xff, sizeof(fifo_readback));
+	usbh_fifo_write(fifo_window, (const uint8_t *)fifo_buffer + offset, length);
+	usbh_fifo_read(fifo_window, readback, length);
+	return !memcmp(readback, (const uint8_t *)fifo_buffer + offset, length) &&
+		readback[length] == 0xff;
+}
+
+static void print_stats(const char *name, const usbh_low_level_driver_t *lld)
+{
+	usbh_lld_sim_stats_t stats;
+	usbh_lld_sim_get_stats(lld, &stats);
+	printf("  %-6s polls=%u transfers=%u naks=%u stalls=%u in=%uB out=%uB\n",
+		name, stats.polls, stats.transfers, stats.naks, stats.stalls,
+		stats.bytes_in, stats.bytes_out);
+}
+
+static void print_timing(const char *name, const usbh_low_level_driver_t *lld)
+{
+	static const char * const step_names[USBH_ENUM_STEP_COUNT] = {
+		"set_address",
+		"device_dt",
+		"config_dt_header",
+		"config_dt",
+		"set_configuration",
+	};
+	usbh_enum_timing_t timing;
+	usbh_enum_timing_get(lld, &timing);
+	printf("  %-6s total=%uus%s\n", name, timing.total_us, timing.complete ? "" : " (incomplete)");
+	uint32_t i;
+	for (i = 0; i < USBH_ENUM_STEP_COUNT; i++) {
+		if (timing.step_requests[i]) {
+			printf("    %-18s %ux %uus\n", step_names[i], timing.step_requests[i], timing.step_us[i]);
+		}
+	}
+}
+
+/**
+ * Transfer statistics of the device attached to the root port (address 1)
+ */
+static void print_device_stats(const char *name, const usbh_low_level_driver_t *lld)
+{
+	usbh_transfer_stats_t stats;
+	if (!usbh_stats_get(lld, 1, USBH_STATS_DEVICE, &stats)) {
+		printf("  %-6s no statistics\n", name);
+		return;
+	}
+	printf("  %-6s transfers=%u bytes=%u naks=%u stalls=%u retries=%u\n", name,
+		stats.transfers, stats.bytes, stats.naks, stats.stalls, stats.retries);
+	printf("         latency");
+	uint32_t i;
+	for (i = 0; i < USBH_STATS_LATENCY_BUCKETS; i++) {
+		if (i == USBH_STATS_LATENCY_BUCKETS - 1) {
+			printf(" >=%uus:%u", 125U << (i - 1), stats.latency[i]);
+		} else {
+			printf(" <%uus:%u", 125U << i, stats.latency[i]);
+		}
+	}
+	printf("\n");
+}
+
+/**
+ * Write the trace ring, to be decoded by tools/usbh_trace_decode.py
+ */
+static void write_trace(const char *path)
+{
+#ifdef USBH_USE_TRACE
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return;
+	}
+	fwrite(usbh_trace_get(), sizeof(usbh_trace_t), 1, f);
+	fclose(f);
+	printf("trace written to %s\n", path);
+#else
+	fprintf(stderr, "%s not written, build with USE_TRACE\n", path);
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		time_step_us = strtoul(argv[1], NULL, 0);
+		if (!time_step_us) {
+			fprintf(stderr, "usage: %s [poll interval in us] [trace file]\n", argv[0]);
+			return 1;
+		}
+	}
+	const char *trace_path = argc > 2 ? argv[2] : NULL;
+
+	hid_driver_init(&hid_config);
+	hub_driver_init();
+	gp_xbox_driver_init(&gp_xbox_config);
+	midi_driver_init(&midi_config);
+
+	if (!usbh_init(lld_drivers, device_drivers)) {
+		fprintf(stderr, "usbh_init failed\n");
+		return 1;
+	}
+
+	printf("poll interval: %u us\n", time_step_us);
+
+	// Enumeration
+	uint32_t mouse_us;
+	uint32_t midi_us;
+	if (!run_attach(&mouse_us, &midi_us)) {
+		fprintf(stderr, "enumeration failed: mouse=%u midi=%u\n", mouse_us, midi_us);
+		return 1;
+	}
+	printf("enumeration (simultaneous attach to ready, simulated time)\n");
+	printf("  mouse  %u us\n", mouse_us);
+	printf("  midi   %u us\n", midi_us);
+	print_stats("sim0", &usbh_lld_sim_driver_0);
+	print_stats("sim1", &usbh_lld_sim_driver_1);
+	print_timing("mouse", &usbh_lld_sim_driver_0);
+	print_timing("midi", &usbh_lld_sim_driver_1);
+	if (trace_path) {
+		write_trace(trace_path);
+	}
+
+	// Throughput
+	const uint32_t time_start_us = time_curr_us;
+	hid_reports = 0;
+	midi_bytes = 0;
+	while (time_curr_us - time_start_us < THROUGHPUT_TIME_US) {
+		step();
+	}
+	printf("throughput (per simulated second)\n");
+	printf("  mouse  %u reports\n", hid_reports);
+	printf("  midi   %u bytes\n", midi_bytes);
+
+	// Throughput, polling at the requested times only
+	hid_reports = 0;
+	midi_bytes = 0;
+	uint32_t polls = run_tickless(THROUGHPUT_TIME_US);
+	printf("tickless throughput (per simulated second)\n");
+	printf("  mouse  %u reports\n", hid_reports);
+	printf("  midi   %u bytes\n", midi_bytes);
+	printf("  polls  %u\n", polls);
+	printf("transfer statistics since attach\n");
+	print_device_stats("mouse", &usbh_lld_sim_driver_0);
+	print_device_stats("midi", &usbh_lld_sim_driver_1);
+
+	// Poll loop cost with both devices active
+	uint32_t i;
+	const uint64_t wall_start_ns = wall_time_ns();
+	for (i = 0; i < POLL_COST_ITERATIONS; i++) {
+		step();
+	}
+	const uint64_t wall_ns = wall_time_ns() - wall_start_ns;
+	printf("poll loop cost\n");
+	printf("  %.1f ns per usbh_poll()\n", (double)wall_ns / POLL_COST_ITERATIONS);
+
+	// Re-plug of the already known devices
+	usbh_lld_sim_detach(&usbh_lld_sim_driver_0);
+	usbh_lld_sim_detach(&usbh_lld_sim_driver_1);
+	step();
+	midi_connected = false;
+	if (!run_attach(&mouse_us, &midi_us)) {
+		fprintf(stderr, "re-enumeration failed: mouse=%u midi=%u\n", mouse_us, midi_us);
+		return 1;
+	}
+	printf("re-enumeration (re-plug of known devices, simulated time)\n");
+	printf("  mouse  %u us\n", mouse_us);
+	printf("  midi   %u us\n", midi_us);
+	print_timing("mouse", &usbh_lld_sim_driver_0);
+	print_timing("midi", &usbh_lld_sim_driver_1);
+
+	// Burst of queued transfers to one endpoint
+	const uint32_t burst_us = run_queue_burst();
+	if (!burst_us) {
+		fprintf(stderr, "queued transfers did not complete: %u\n", queue_done);
+		return 1;
+	}
+	printf("queued bulk writes (%u x 64 bytes to one endpoint)\n", QUEUE_BURST_PACKETS);
+	printf("  done   %u us\n", burst_us);
+	printf("  failed %u\n", queue_failed);
+	printf("  out    %u bytes\n", midi_bytes_out);
+
+	// Same burst, the first transfer hits transmit errors and is retried by the core
+	usbh_transfer_stats_t retry_stats;
+	uint32_t retries_before = 0;
+	if (usbh_stats_get(&usbh_lld_sim_driver_1, 1, USBH_STATS_DEVICE, &retry_stats)) {
+		retries_before = retry_stats.retries;
+	}
+	usbh_lld_sim_inject_txerr(&usbh_lld_sim_driver_1, USBH_RETRY_BULK);
+	const uint32_t retry_burst_us = run_queue_burst();
+	if (!retry_burst_us) {
+		fprintf(stderr, "queued transfers with errors did not complete: %u\n", queue_done);
+		return 1;
+	}
+	printf("queued bulk writes, %u transmit errors\n", USBH_RETRY_BULK);
+	printf("  done   %u us\n", retry_burst_us);
+	printf("  failed %u\n", queue_failed);
+	printf("  out    %u bytes\n", midi_bytes_out);
+	if (usbh_stats_get(&usbh_lld_sim_driver_1, 1, USBH_STATS_DEVICE, &retry_stats)) {
+		printf("  retry  %u\n", retry_stats.retries - retries_before);
+	}
+
+	// Device stops answering, the channel is taken back after the timeout
+	const uint32_t hung_us = run_hung_write();
+	if (!hung_us) {
+		fprintf(stderr, "hung transfer has not timed out\n");
+		return 1;
+	}
+	printf("hung bulk write (device NAKs forever)\n");
+	printf("  done   %u us, status %u\n", hung_us, queue_status_last);
+	const uint32_t after_us = run_queue_burst();
+	if (!after_us || queue_failed) {
+		fprintf(stderr, "transfers after the timeout did not complete: %u\n", queue_done);
+		return 1;
+	}
+	printf("  after  %u x 64 bytes in %u us\n", QUEUE_BURST_PACKETS, after_us);
+
+	// Channels are held by NAKed reads, one of them is parked for the write
+	const uint32_t idle_us = run_idle_reads_write();
+	if (!idle_us || queue_failed) {
+		fprintf(stderr, "write along the idle reads did not complete: %u/%u\n", queue_done, idle_done);
+		return 1;
+	}
+	printf("bulk write along %u NAKed bulk reads\n", IDLE_READS);
+	printf("  done   %u us\n", idle_us);
+
+	// Output reports set faster than they are delivered
+	mouse_reports_set = 0;
+	for (i = 1; i <= 10; i++) {
+		if (!hid_set_report(0, i)) {
+			fprintf(stderr, "set report %u rejected\n", i);
+			return 1;
+		}
+	}
+	const uint32_t time_report_us = time_curr_us;
+	while (time_curr_us - time_report_us < 20000) {
+		step();
+	}
+	printf("hid set report (10 values at once)\n");
+	printf("  sent   %u\n", mouse_reports_set);
+	printf("  last   %u\n", mouse_report_last);
+
+	// Composite device: both functions are serviced
+	usbh_lld_sim_detach(&usbh_lld_sim_driver_0);
+	step();
+	midi_connected = false;
+	usbh_lld_sim_attach(&usbh_lld_sim_driver_0, &composite);
+	const uint32_t time_attach_us = time_curr_us;
+	while (!mouse_ready() || !midi_ready()) {
+		if (time_curr_us - time_attach_us > READY_TIMEOUT_US) {
+			fprintf(stderr, "composite enumeration failed: hid=%d midi=%d\n", mouse_ready(), midi_ready());
+			return 1;
+		}
+		step();
+	}
+	const uint32_t composite_us = time_curr_us - time_attach_us;
+	hid_reports = 0;
+	midi_bytes_device[midi_connected_id] = 0;
+	while (time_curr_us - time_attach_us - composite_us < THROUGHPUT_TIME_US) {
+		step();
+	}
+	printf("composite device (mouse + midi on one device)\n");
+	printf("  ready  %u us\n", composite_us);
+	printf("  mouse  %u reports\n", hid_reports);
+	printf("  midi   %u bytes\n", midi_bytes_device[midi_connected_id]);
+	print_timing("comp", &usbh_lld_sim_driver_0);
+
+	usbh_lld_sim_detach(&usbh_lld_sim_driver_0);
+	usbh_lld_sim_detach(&usbh_lld_sim_driver_1);
+	step();
+
+	polls = run_tickless(THROUGHPUT_TIME_US);
+	printf("tickless idle, nothing attached (per simulated second)\n");
+	printf("  polls  %u\n", polls);
+
+	// FIFO copy routines of the STM32F4 driver, on the host CPU
+	static const uint32_t fifo_lengths[] = {8, 13, 64, 512};
+	for (i = 0; i < sizeof(fifo_buffer); i++) {
+		((uint8_t *)fifo_buffer)[i] = i * 7;
+	}
+	printf("fifo write (bytes per cycle%s)\n",
+#if defined(__x86_64__) || defined(__i386__)
+		""
+#else
+		", cycle is a nanosecond here"
+#endif
+		);
+	printf("  %6s %10s %10s %10s\n", "length", "words", "aligned", "unaligned");
+	for (i = 0; i < sizeof(fifo_lengths) / sizeof(fifo_lengths[0]); i++) {
+		const uint32_t length = fifo_lengths[i];
+		if (!fifo_copy_check(0, length) || !fifo_copy_check(1, length) ||
+			!fifo_copy_check(3, length)) {
+			fprintf(stderr, "fifo copy of %u bytes corrupts the data\n", length);
+			return 1;
+		}
+		printf("  %6u %10.2f %10.2f %10.2f\n", length,
+			fifo_copy_rate(0, length, true),
+			fifo_copy_rate(0, length, false),
+			fifo_copy_rate(1, length, false));
+	}
+
+	return 0;
+}
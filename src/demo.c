@@ -21,7 +21,7 @@
  */
 
 #include "usart_helpers.h"			/// provides LOG_PRINTF macros used for debugging
-#include "usbh_core.h"				/// provides usbh_init() and usbh_poll()
+#include "usbh_core.h"				/// provides usbh_init() and usbh_poll_next()
 #include "usbh_lld_stm32f4.h"		/// provides low level usb host driver for stm32f4 platform
 #include "usbh_driver_hid.h"		/// provides generic usb device driver for Human Interface Device (HID)
 #include "usbh_driver_hub.h"		/// provides usb full speed hub driver (Low speed devices on hub are not supported)
@@ -35,6 +35,9 @@
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/otg_hs.h>
 #include <libopencm3/stm32/otg_fs.h>
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+#include <libopencm3/cm3/nvic.h>
+#endif
 
 #include <stdint.h>
 #include <string.h>
@@ -133,6 +136,29 @@ static const usbh_low_level_driver_t * const lld_drivers[] = {
 	NULL
 	};
 
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+/// set by the interrupt when a transfer has completed
+static volatile bool usbh_irq_pending;
+
+#ifdef USE_STM32F4_USBH_DRIVER_FS
+void otg_fs_isr(void)
+{
+	if (usbh_lld_stm32f4_irq_fs()) {
+		usbh_irq_pending = true;
+	}
+}
+#endif
+
+#ifdef USE_STM32F4_USBH_DRIVER_HS
+void otg_hs_isr(void)
+{
+	if (usbh_lld_stm32f4_irq_hs()) {
+		usbh_irq_pending = true;
+	}
+}
+#endif
+#endif
+
 static void gp_xbox_update(uint8_t device_id, gp_xbox_packet_t packet)
 {
 	(void)device_id;
@@ -236,7 +262,23 @@ int main(void)
 	 *
 	 * Pass array of supported device drivers
 	 */
-	usbh_init(lld_drivers, device_drivers);
+	if (!usbh_init(lld_drivers, device_drivers)) {
+		// too many device drivers for USBH_MAX_DEVICE_DRIVERS, report it by the red led
+		gpio_clear(GPIOD,  GPIO13);
+		gpio_set(GPIOD,  GPIO14);
+		LOG_PRINTF("USB init failed, check USBH_MAX_DEVICE_DRIVERS in usbh_config.h\n");
+		while (1) {
+			LOG_FLUSH();
+		}
+	}
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+#ifdef USE_STM32F4_USBH_DRIVER_FS
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
+#endif
+#ifdef USE_STM32F4_USBH_DRIVER_HS
+	nvic_enable_irq(NVIC_OTG_HS_IRQ);
+#endif
+#endif
 	gpio_clear(GPIOD,  GPIO13);
 
 	LOG_PRINTF("USB init complete\n");
@@ -249,15 +291,25 @@ int main(void)
 
 		uint32_t time_curr_us = tim6_get_time_us();
 
-		usbh_poll(time_curr_us);
+		const uint32_t time_next_us = usbh_poll_next(time_curr_us);
 
 		// clear busy led
 		gpio_clear(GPIOD,  GPIO14);
 
 		LOG_FLUSH();
 
-		// approx 1ms interval between usbh_poll()
-		delay_ms_busy_loop(1);
+		// idle until the next poll needed by the drivers
+		// this time can be used for sleep or other work instead
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		// completed transfers wake the poll up early
+		while (!usbh_irq_pending && (int32_t)(time_next_us - tim6_get_time_us()) > 0);
+		usbh_irq_pending = false;
+#else
+		const int32_t time_idle_us = time_next_us - time_curr_us;
+		if (time_idle_us >= 1000) {
+			delay_ms_busy_loop(time_idle_us / 1000);
+		}
+#endif
 	}
 
 	return 0;
@@ -24,185 +24,1282 @@
 #include "usbh_lld_stm32f4.h"
 #include "driver/usbh_device_driver.h"
 #include "usart_helpers.h"
+#include "usbh_trace.h"
 
-#include <libopencm3/stm32/gpio.h>
 #include <libopencm3/usb/usbstd.h>
 
 #include <stddef.h>
+#include <string.h>
+
+/* Configuration descriptor in usbh_buffer starts at a word boundary right after the device
+ * descriptor, so the DMA of the low-level driver reads it in place. Its room is whole words */
+#define CONFIGURATION_DT_OFFSET	((USB_DT_DEVICE_SIZE + 3) & ~3)
+#define DEVICE_DT_OFFSET	(CONFIGURATION_DT_OFFSET - USB_DT_DEVICE_SIZE)
+#define CONFIGURATION_DT_BUFFER_SIZE	((BUFFER_ONE_BYTES - CONFIGURATION_DT_OFFSET) & ~3)
 
 static struct {
-	bool enumeration_run;
 	const usbh_low_level_driver_t * const *lld_drivers;
 	const usbh_dev_driver_t * const *dev_drivers;
-	int8_t address_temporary;
+
+	/// time of the current usbh_poll(), used for the timings
+	uint32_t time_curr_us;
+
+	/// earliest time of the next poll requested by the drivers
+	uint32_t time_deadline_us;
+
+	/// time_curr_us extended to 64 bits, @see usbh_time_us()
+	uint64_t time_us;
+
+	/// timers linked by the slot of their expiration tick
+	usbh_timer_t *timer_wheel[USBH_TIMER_WHEEL_SLOTS];
+
+	/// first tick not serviced completely yet
+	uint64_t timer_tick;
+
+	/// count of armed timers
+	uint32_t timer_count;
 } usbh_data = {};
 
-static void set_enumeration(void)
+/**
+ * Index of the device drivers built by usbh_init(), @see find_driver()
+ */
+static struct {
+	/// indices into usbh_data.dev_drivers
+	uint8_t drivers[USBH_MAX_DEVICE_DRIVERS];
+
+	/// count of vendor specific drivers at the beginning of drivers
+	uint8_t count_vendor;
+
+	/// count of drivers of the interface class following them, sorted by class
+	uint8_t count_class;
+
+	/// count of all indexed drivers, the rest accepts any interface class
+	uint8_t count;
+} driver_index = {};
+
+#if (USBH_DESCRIPTOR_CACHE_ENTRIES > 0)
+struct _descriptor_cache_entry {
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+
+	/// checksum of the complete device descriptor
+	uint16_t checksum;
+
+	/// length of the cached configuration descriptor, 0 when the entry is free
+	uint16_t config_length;
+	uint8_t config[USBH_DESCRIPTOR_CACHE_BYTES];
+};
+typedef struct _descriptor_cache_entry descriptor_cache_entry_t;
+
+static struct {
+	descriptor_cache_entry_t entries[USBH_DESCRIPTOR_CACHE_ENTRIES];
+
+	/// entry to be replaced next when the cache is full
+	uint8_t replace;
+} descriptor_cache = {};
+
+/**
+ * Fletcher-16 over the device descriptor. It tells apart devices sharing
+ * VID/PID/bcdDevice, but differing in class or in the count of configurations
+ */
+static uint16_t descriptor_checksum(const struct usb_device_descriptor *ddt)
+{
+	const uint8_t *buf = (const uint8_t *)ddt;
+	uint16_t sum1 = 0;
+	uint16_t sum2 = 0;
+	uint32_t i;
+	for (i = 0; i < USB_DT_DEVICE_SIZE; i++) {
+		sum1 = (sum1 + buf[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (sum2 << 8) | sum1;
+}
+
+static descriptor_cache_entry_t *descriptor_cache_find(const struct usb_device_descriptor *ddt)
+{
+	const uint16_t checksum = descriptor_checksum(ddt);
+	uint32_t i;
+	for (i = 0; i < USBH_DESCRIPTOR_CACHE_ENTRIES; i++) {
+		descriptor_cache_entry_t *entry = &descriptor_cache.entries[i];
+		if (entry->config_length
+			&& entry->idVendor == ddt->idVendor
+			&& entry->idProduct == ddt->idProduct
+			&& entry->bcdDevice == ddt->bcdDevice
+			&& entry->checksum == checksum) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Copy the cached configuration descriptor of the device to config
+ *
+ * @returns false if the device is not known
+ */
+static bool descriptor_cache_load(const struct usb_device_descriptor *ddt, void *config)
+{
+	const descriptor_cache_entry_t *entry = descriptor_cache_find(ddt);
+	if (!entry) {
+		return false;
+	}
+	memcpy(config, entry->config, entry->config_length);
+	return true;
+}
+
+static void descriptor_cache_store(const struct usb_device_descriptor *ddt, const struct usb_config_descriptor *cdt)
+{
+	if (cdt->wTotalLength > USBH_DESCRIPTOR_CACHE_BYTES) {
+		return;
+	}
+
+	descriptor_cache_entry_t *entry = descriptor_cache_find(ddt);
+	if (!entry) {
+		entry = &descriptor_cache.entries[descriptor_cache.replace];
+		descriptor_cache.replace = (descriptor_cache.replace + 1) % USBH_DESCRIPTOR_CACHE_ENTRIES;
+	}
+
+	entry->idVendor = ddt->idVendor;
+	entry->idProduct = ddt->idProduct;
+	entry->bcdDevice = ddt->bcdDevice;
+	entry->checksum = descriptor_checksum(ddt);
+	entry->config_length = cdt->wTotalLength;
+	memcpy(entry->config, cdt, cdt->wTotalLength);
+}
+
+static void descriptor_cache_remove(const struct usb_device_descriptor *ddt)
+{
+	descriptor_cache_entry_t *entry = descriptor_cache_find(ddt);
+	if (entry) {
+		entry->config_length = 0;
+	}
+}
+#else
+static bool descriptor_cache_load(const struct usb_device_descriptor *ddt, void *config)
+{
+	(void)ddt;
+	(void)config;
+	return false;
+}
+
+static void descriptor_cache_store(const struct usb_device_descriptor *ddt, const struct usb_config_descriptor *cdt)
+{
+	(void)ddt;
+	(void)cdt;
+}
+
+static void descriptor_cache_remove(const struct usb_device_descriptor *ddt)
+{
+	(void)ddt;
+}
+#endif
+
+static usbh_generic_data_t *lld_data_of(const usbh_device_t *dev)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	return lld->driver_data;
+}
+
+/**
+ * @returns position of the lowest set bit at position from or above, -1 if there is none
+ */
+static int32_t bitmap_find(const uint32_t *bitmap, uint32_t words, uint32_t from)
+{
+	uint32_t w = from / 32;
+	if (w >= words) {
+		return -1;
+	}
+
+	uint32_t bits = bitmap[w] & (~0UL << (from % 32));
+	while (!bits) {
+		if (++w == words) {
+			return -1;
+		}
+		bits = bitmap[w];
+	}
+	return w * 32 + __builtin_ctz(bits);
+}
+
+static void bitmap_set(uint32_t *bitmap, uint32_t bit)
+{
+	bitmap[bit / 32] |= 1UL << (bit % 32);
+}
+
+static void bitmap_clear(uint32_t *bitmap, uint32_t bit)
+{
+	bitmap[bit / 32] &= ~(1UL << (bit % 32));
+}
+
+/**
+ * Mark all device slots and addresses of the controller free
+ */
+static void device_alloc_reset(usbh_generic_data_t *lld_data)
+{
+	uint32_t i;
+	memset(lld_data->device_free, 0, sizeof(lld_data->device_free));
+	for (i = 0; i < USBH_MAX_DEVICES; i++) {
+		bitmap_set(lld_data->device_free, i);
+		lld_data->usbh_device[i].address_allocated = 0;
+	}
+	memset(lld_data->address_free, 0xff, sizeof(lld_data->address_free));
+	bitmap_clear(lld_data->address_free, 0);
+	lld_data->address_next = 1;
+}
+
+/**
+ * Reserve a device slot and an USB address
+ *
+ * @returns device with the address set, NULL when there is no free slot or address
+ */
+static usbh_device_t *device_alloc(usbh_generic_data_t *lld_data)
+{
+	const int32_t slot = bitmap_find(lld_data->device_free,
+		USBH_BITMAP_WORDS(USBH_MAX_DEVICES), 0);
+	if (slot < 0) {
+		return NULL;
+	}
+
+	int32_t address = bitmap_find(lld_data->address_free,
+		USBH_BITMAP_WORDS(USBH_ADDRESS_COUNT), lld_data->address_next);
+	if (address < 0) {
+		address = bitmap_find(lld_data->address_free, USBH_BITMAP_WORDS(USBH_ADDRESS_COUNT), 1);
+		if (address < 0) {
+			return NULL;
+		}
+	}
+
+	bitmap_clear(lld_data->device_free, slot);
+	bitmap_clear(lld_data->address_free, address);
+	lld_data->address_next = (address + 1) % USBH_ADDRESS_COUNT;
+
+	usbh_device_t *dev = &lld_data->usbh_device[slot];
+	dev->address = address;
+	dev->address_allocated = address;
+	return dev;
+}
+
+#if USBH_STATS_ENDPOINTS > 0
+static void stats_reset(usbh_generic_data_t *lld_data)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_STATS_ENDPOINTS; i++) {
+		lld_data->stats[i].address = -1;
+	}
+}
+
+/**
+ * Free the counters of all endpoints of the device
+ */
+static void stats_remove(usbh_generic_data_t *lld_data, uint8_t address)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_STATS_ENDPOINTS; i++) {
+		if (lld_data->stats[i].address == address) {
+			lld_data->stats[i].address = -1;
+		}
+	}
+}
+
+/**
+ * @returns counters of the endpoint used by the packet, allocated on the first use;
+ * NULL when the table is full or the device has no address yet
+ */
+static usbh_transfer_stats_t *stats_find(usbh_generic_data_t *lld_data, const usbh_packet_t *packet, bool in)
+{
+	if (packet->address <= 0) {
+		return NULL;
+	}
+
+	// control endpoint is used in both directions
+	uint8_t endpoint_address = packet->endpoint_address;
+	if (packet->endpoint_type != USBH_ENDPOINT_TYPE_CONTROL && in) {
+		endpoint_address |= USB_ENDPOINT_ADDR_IN(0);
+	}
+
+	usbh_endpoint_stats_t *free_entry = NULL;
+	uint32_t i;
+	for (i = 0; i < USBH_STATS_ENDPOINTS; i++) {
+		usbh_endpoint_stats_t *entry = &lld_data->stats[i];
+		if (entry->address == packet->address && entry->endpoint_address == endpoint_address) {
+			return &entry->stats;
+		}
+		if (!free_entry && entry->address < 0) {
+			free_entry = entry;
+		}
+	}
+
+	if (!free_entry) {
+		return NULL;
+	}
+	free_entry->address = packet->address;
+	free_entry->endpoint_address = endpoint_address;
+	memset(&free_entry->stats, 0, sizeof(free_entry->stats));
+	return &free_entry->stats;
+}
+#else
+static void stats_reset(usbh_generic_data_t *lld_data)
+{
+	(void)lld_data;
+}
+
+static void stats_remove(usbh_generic_data_t *lld_data, uint8_t address)
+{
+	(void)lld_data;
+	(void)address;
+}
+#endif
+
+/**
+ * Release the slot and the address of the device, does nothing when the slot is free
+ */
+static void device_free(usbh_generic_data_t *lld_data, usbh_device_t *dev)
+{
+	if (!dev->address_allocated) {
+		return;
+	}
+
+	stats_remove(lld_data, dev->address_allocated);
+	bitmap_set(lld_data->address_free, dev->address_allocated);
+	bitmap_set(lld_data->device_free, dev - lld_data->usbh_device);
+	dev->address_allocated = 0;
+}
+
+static void set_enumeration(usbh_device_t *dev)
+{
+	lld_data_of(dev)->enumeration_run = true;
+}
+
+static void reset_enumeration(usbh_device_t *dev)
+{
+	lld_data_of(dev)->enumeration_run = false;
+}
+
+static bool enumeration(const usbh_device_t *dev)
+{
+	return lld_data_of(dev)->enumeration_run;
+}
+
+static void enum_step_begin(usbh_device_t *dev)
+{
+	lld_data_of(dev)->enum_time_step_us = usbh_data.time_curr_us;
+}
+
+static void enum_step_end(usbh_device_t *dev, enum USBH_ENUM_STEP step)
+{
+	usbh_generic_data_t *lld_data = lld_data_of(dev);
+	lld_data->enum_timing.step_us[step] += usbh_data.time_curr_us - lld_data->enum_time_step_us;
+	lld_data->enum_timing.step_requests[step]++;
+}
+
+static void interface_driver_remove(usbh_interface_driver_t *interface_driver)
+{
+	if (interface_driver->drv && interface_driver->drvdata) {
+		interface_driver->drv->remove(interface_driver->drvdata);
+	}
+	interface_driver->drv = NULL;
+	interface_driver->drvdata = NULL;
+}
+
+static void control_reset(usbh_device_t *dev)
+{
+	dev->control.state = USBH_CONTROL_STATE_NONE;
+	dev->control.queue_head = 0;
+	dev->control.queue_count = 0;
+}
+
+static void urb_purge(const usbh_device_t *dev);
+
+void device_remove(usbh_device_t *dev)
+{
+	uint32_t i;
+	if (dev->lld && dev->address >= 0) {
+		// no callback reaches the drivers removed below
+		urb_purge(dev);
+	}
+	for (i = 0; i < USBH_MAX_INTERFACE_DRIVERS; i++) {
+		interface_driver_remove(&dev->drivers[i]);
+	}
+	control_reset(dev);
+	if (dev->lld) {
+		device_free(lld_data_of(dev), dev);
+	}
+	dev->address = -1;
+}
+
+/**
+ * Poll all device drivers bound to the interfaces of the device
+ */
+void device_poll(usbh_device_t *dev, uint32_t time_curr_us)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_MAX_INTERFACE_DRIVERS; i++) {
+		usbh_interface_driver_t *interface_driver = &dev->drivers[i];
+		if (interface_driver->drv && interface_driver->drvdata) {
+			interface_driver->drv->poll(interface_driver->drvdata, time_curr_us);
+		}
+	}
+}
+
+static bool driver_compatible(const usbh_dev_driver_info_t *driver_info, const usbh_dev_driver_info_t *device_info)
+{
+
+#define CHECK_PARTIAL_COMPATIBILITY(what) \
+	if (driver_info->what != -1\
+	&& device_info->what != driver_info->what) {\
+		return false;\
+	}
+
+	CHECK_PARTIAL_COMPATIBILITY(ifaceClass);
+	CHECK_PARTIAL_COMPATIBILITY(ifaceSubClass);
+	CHECK_PARTIAL_COMPATIBILITY(ifaceProtocol);
+	CHECK_PARTIAL_COMPATIBILITY(deviceClass);
+	CHECK_PARTIAL_COMPATIBILITY(deviceSubClass);
+	CHECK_PARTIAL_COMPATIBILITY(deviceProtocol);
+	CHECK_PARTIAL_COMPATIBILITY(idVendor);
+	CHECK_PARTIAL_COMPATIBILITY(idProduct);
+	return true;
+#undef CHECK_PARTIAL_COMPATIBILITY
+}
+
+static bool driver_is_vendor_specific(const usbh_dev_driver_t *drv)
+{
+	return drv->info->idVendor != -1;
+}
+
+/**
+ * Sort key of the class section of the driver index
+ */
+static int32_t driver_index_class(uint8_t i)
+{
+	return usbh_data.dev_drivers[driver_index.drivers[i]]->info->ifaceClass;
+}
+
+/**
+ * Build the index of device drivers
+ *
+ * Drivers bound to the vendor id come first, then drivers bound to
+ * the interface class, sorted by the class, then drivers accepting any
+ * interface class. Registration order is kept within each group.
+ */
+static bool driver_index_build(void)
+{
+	uint8_t count = 0;
+	uint8_t count_vendor = 0;
+	uint8_t count_any_class = 0;
+	uint8_t i;
+
+	driver_index.count_vendor = 0;
+	driver_index.count_class = 0;
+
+	while (usbh_data.dev_drivers[count]) {
+		if (count == USBH_MAX_DEVICE_DRIVERS) {
+			LOG_PRINTF("Too many device drivers, at most %d are supported\n", USBH_MAX_DEVICE_DRIVERS);
+			return false;
+		}
+		count++;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (driver_is_vendor_specific(usbh_data.dev_drivers[i])) {
+			count_vendor++;
+		} else if (usbh_data.dev_drivers[i]->info->ifaceClass == -1) {
+			count_any_class++;
+		}
+	}
+
+	uint8_t pos_vendor = 0;
+	uint8_t pos_class = count_vendor;
+	uint8_t pos_any_class = count - count_any_class;
+	for (i = 0; i < count; i++) {
+		const usbh_dev_driver_t *drv = usbh_data.dev_drivers[i];
+		if (driver_is_vendor_specific(drv)) {
+			driver_index.drivers[pos_vendor++] = i;
+		} else if (drv->info->ifaceClass == -1) {
+			driver_index.drivers[pos_any_class++] = i;
+		} else {
+			// stable insertion sort by the interface class
+			uint8_t k = pos_class++;
+			while (k > count_vendor && drv->info->ifaceClass < driver_index_class(k - 1)) {
+				driver_index.drivers[k] = driver_index.drivers[k - 1];
+				k--;
+			}
+			driver_index.drivers[k] = i;
+		}
+	}
+
+	driver_index.count_vendor = count_vendor;
+	driver_index.count_class = count - count_vendor - count_any_class;
+	driver_index.count = count;
+	return true;
+}
+
+/**
+ * @returns position of the first driver of the class section with interface class not lower than iface_class
+ */
+static uint8_t driver_index_class_lower_bound(int32_t iface_class)
+{
+	uint8_t lo = driver_index.count_vendor;
+	uint8_t hi = driver_index.count_vendor + driver_index.count_class;
+	while (lo < hi) {
+		const uint8_t mid = (lo + hi) / 2;
+		if (driver_index_class(mid) < iface_class) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static bool driver_try(usbh_device_t *dev, const usbh_dev_driver_info_t *device_info,
+	usbh_interface_driver_t *interface_driver, uint8_t i)
+{
+	const usbh_dev_driver_t *drv = usbh_data.dev_drivers[i];
+	if (!driver_compatible(drv->info, device_info)) {
+		return false;
+	}
+
+	interface_driver->drv = drv;
+	interface_driver->drvdata = drv->init(dev);
+	if (!interface_driver->drvdata) {
+		LOG_PRINTF("Unable to initialize device driver at index %d\n", i);
+		interface_driver->drv = NULL;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Find the driver for the interface and initialize it
+ *
+ * Vendor specific drivers are tried first. Then drivers of the interface
+ * class and drivers accepting any class are tried in the order
+ * of registration.
+ */
+static bool find_driver(usbh_device_t *dev, const usbh_dev_driver_info_t * device_info,
+	usbh_interface_driver_t *interface_driver)
+{
+	uint8_t i;
+	for (i = 0; i < driver_index.count_vendor; i++) {
+		if (driver_try(dev, device_info, interface_driver, driver_index.drivers[i])) {
+			return true;
+		}
+	}
+
+	// merge the interface class bucket with the drivers accepting any class
+	uint8_t pos_class = driver_index_class_lower_bound(device_info->ifaceClass);
+	uint8_t pos_any_class = driver_index.count_vendor + driver_index.count_class;
+	const uint8_t end_class = pos_any_class;
+
+	while (true) {
+		const bool class_left = pos_class < end_class
+			&& driver_index_class(pos_class) == device_info->ifaceClass;
+		const bool any_class_left = pos_any_class < driver_index.count;
+		uint8_t pos;
+
+		if (class_left && (!any_class_left
+			|| driver_index.drivers[pos_class] < driver_index.drivers[pos_any_class])) {
+			pos = pos_class++;
+		} else if (any_class_left) {
+			pos = pos_any_class++;
+		} else {
+			break;
+		}
+
+		if (driver_try(dev, device_info, interface_driver, driver_index.drivers[pos])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Build the index of interfaces and endpoints of the configuration descriptor
+ * in one pass. Descriptors start at offset begin of buf and end at descriptors_len.
+ */
+static void descriptor_index_build(usbh_descriptor_index_t *index, const uint8_t *buf,
+	uint16_t begin, uint16_t descriptors_len)
+{
+	usbh_interface_index_t *iface = NULL;
+	uint32_t i = begin;
+
+	index->interface_count = 0;
+	index->endpoint_count = 0;
+
+	while (i + 2 <= descriptors_len) {
+		const uint8_t desc_len = buf[i];
+		const uint8_t desc_type = buf[i + 1];
+
+		if (desc_len < 2 || i + desc_len > descriptors_len) {
+			LOG_PRINTF("PROBLEM WITH PARSE %d\n", i);
+			break;
+		}
+
+		if (desc_type == USB_DT_INTERFACE) {
+			if (index->interface_count == USBH_MAX_INDEXED_INTERFACES) {
+				LOG_PRINTF("Too many interfaces, only %d are indexed\n", USBH_MAX_INDEXED_INTERFACES);
+				break;
+			}
+			iface = &index->interfaces[index->interface_count++];
+			iface->offset = i;
+			iface->endpoint_first = index->endpoint_count;
+			iface->endpoint_count = 0;
+			iface->class_specific_count = 0;
+		} else if (!iface) {
+			// descriptors preceding the first interface, e.g. interface association
+		} else if (desc_type == USB_DT_ENDPOINT) {
+			if (index->endpoint_count < USBH_MAX_INDEXED_ENDPOINTS) {
+				index->endpoints[index->endpoint_count++] = i;
+				iface->endpoint_count++;
+			}
+		} else {
+			iface->class_specific_count++;
+		}
+
+		i += desc_len;
+		if (iface) {
+			iface->length = i - iface->offset;
+		}
+	}
+}
+
+/**
+ * Pass the device descriptor, the configuration descriptor and the slice
+ * of one interface to the device driver
+ *
+ * @returns true when the driver has all needed data
+ */
+static bool interface_analyze(usbh_interface_driver_t *interface_driver, uint8_t *buf,
+	const usbh_interface_index_t *iface)
+{
+	void *drvdata = interface_driver->drvdata;
+	const usbh_dev_driver_t *drv = interface_driver->drv;
+
+	if (drv->analyze_descriptor(drvdata, &buf[0])
+		|| drv->analyze_descriptor(drvdata, &buf[USB_DT_DEVICE_SIZE])) {
+		return true;
+	}
+
+	uint32_t k = iface->offset;
+	const uint32_t iface_end = iface->offset + iface->length;
+	while (k < iface_end) {
+		LOG_PRINTF("[%d]", buf[k+1]);
+		if (drv->analyze_descriptor(drvdata, &buf[k])) {
+			return true;
+		}
+		k += buf[k];
+	}
+	return false;
+}
+
+/**
+ * Report the endpoints of the interface bound to a driver to the low-level driver
+ */
+static void interface_endpoints_report(const usbh_device_t *dev, const uint8_t *buf,
+	const usbh_interface_index_t *iface)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	const usbh_descriptor_index_t *index = &lld_data_of(dev)->descriptor_index;
+	uint32_t i;
+
+	if (!lld->endpoint) {
+		return;
+	}
+	for (i = 0; i < iface->endpoint_count; i++) {
+		const struct usb_endpoint_descriptor *ep = (const void *)&buf[index->endpoints[iface->endpoint_first + i]];
+		lld->endpoint(lld->driver_data, ep->bmAttributes & USB_ENDPOINT_ATTR_TYPE,
+			ep->bEndpointAddress & 0x80, ep->wMaxPacketSize & 0x7ff);
+	}
+}
+
+/**
+ * Bind device drivers to the interfaces of the device
+ *
+ * Every interface (alternate setting 0) gets its own driver, so all functions
+ * of the composite device are serviced
+ */
+static void device_register(void *descriptors, uint16_t descriptors_len, usbh_device_t *dev)
+{
+	uint32_t i = 0;
+	uint8_t *buf = (uint8_t *)descriptors;
+	uint8_t bound = 0;
+
+	for (i = 0; i < USBH_MAX_INTERFACE_DRIVERS; i++) {
+		dev->drivers[i].drv = NULL;
+		dev->drivers[i].drvdata = NULL;
+	}
+
+	usbh_dev_driver_info_t device_info;
+	if (buf[1] == USB_DT_DEVICE) {
+		struct usb_device_descriptor *device_desc = (void*)&buf[0];
+		LOG_PRINTF("DEVICE DESCRIPTOR\n");
+		device_info.deviceClass = device_desc->bDeviceClass;
+		device_info.deviceSubClass = device_desc->bDeviceSubClass;
+		device_info.deviceProtocol = device_desc->bDeviceProtocol;
+		device_info.idVendor = device_desc->idVendor;
+		device_info.idProduct = device_desc->idProduct;
+	} else {
+		LOG_PRINTF("INVALID descriptors pointer - fatal error");
+		return;
+	}
+
+	usbh_descriptor_index_t *index = &lld_data_of(dev)->descriptor_index;
+	descriptor_index_build(index, buf, USB_DT_DEVICE_SIZE + buf[USB_DT_DEVICE_SIZE], descriptors_len);
+
+	for (i = 0; i < index->interface_count; i++) {
+		const usbh_interface_index_t *iface_index = &index->interfaces[i];
+		const struct usb_interface_descriptor *iface = (void*)&buf[iface_index->offset];
+
+		LOG_PRINTF("INTERFACE_DESCRIPTOR\n");
+		if (iface->bAlternateSetting != 0) {
+			// alternate settings are left to the driver of the interface
+		} else if (bound == USBH_MAX_INTERFACE_DRIVERS) {
+			LOG_PRINTF("No driver slot left for interface #%d\n", iface->bInterfaceNumber);
+		} else {
+			usbh_interface_driver_t *interface_driver = &dev->drivers[bound];
+			device_info.ifaceClass = iface->bInterfaceClass;
+			device_info.ifaceSubClass = iface->bInterfaceSubClass;
+			device_info.ifaceProtocol = iface->bInterfaceProtocol;
+			if (find_driver(dev, &device_info, interface_driver)) {
+				if (interface_analyze(interface_driver, buf, iface_index)) {
+					LOG_PRINTF("Interface #%d Initialized\n", iface->bInterfaceNumber);
+					interface_endpoints_report(dev, buf, iface_index);
+					bound++;
+				} else {
+					LOG_PRINTF("Device driver isn't compatible with this device\n");
+					interface_driver_remove(interface_driver);
+				}
+			} else {
+				LOG_PRINTF("No compatible driver has been found for interface #%d\n", iface->bInterfaceNumber);
+			}
+		}
+	}
+
+	if (!bound) {
+		LOG_PRINTF("Device NOT Initialized\n");
+	}
+}
+
+/**
+ * Drop all transfers of the low-level driver without calling their callbacks,
+ * channels of the low-level driver are released by itself
+ */
+static void urb_reset(usbh_generic_data_t *lld_data)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_MAX_URBS; i++) {
+		usbh_timer_stop(&lld_data->urbs[i].timer);
+		lld_data->urbs[i].state = USBH_URB_STATE_FREE;
+	}
+	lld_data->urb_pending = USBH_URB_NONE;
+}
+
+/**
+ * Drop all transfers of the removed device without calling their callbacks,
+ * active ones are cancelled in the low-level driver first
+ */
+static void urb_purge(const usbh_device_t *dev)
+{
+	const usbh_low_level_driver_t *lld = dev->lld;
+	usbh_generic_data_t *lld_data = lld->driver_data;
+	uint32_t i;
+
+	for (i = 0; i < USBH_MAX_URBS; i++) {
+		usbh_urb_t *urb = &lld_data->urbs[i];
+		if (urb->state == USBH_URB_STATE_FREE || urb->packet.address != dev->address) {
+			continue;
+		}
+		if (urb->state == USBH_URB_STATE_ACTIVE && lld->cancel) {
+			lld->cancel(lld->driver_data, &urb->packet);
+		}
+		usbh_timer_stop(&urb->timer);
+		urb->state = USBH_URB_STATE_FREE;
+	}
+
+	// pending and backoff transfers are linked, active ones are not
+	uint8_t *link = &lld_data->urb_pending;
+	while (*link != USBH_URB_NONE) {
+		usbh_urb_t *urb = &lld_data->urbs[*link];
+		if (urb->state == USBH_URB_STATE_FREE) {
+			*link = urb->next;
+		} else {
+			link = &urb->next;
+		}
+	}
+}
+
+static bool urb_same_endpoint(const usbh_urb_t *a, const usbh_urb_t *b)
+{
+	if (a->packet.address != b->packet.address ||
+		a->packet.endpoint_address != b->packet.endpoint_address) {
+		return false;
+	}
+
+	// control endpoint is used in both directions
+	return a->packet.endpoint_type == USBH_ENDPOINT_TYPE_CONTROL || a->in == b->in;
+}
+
+static bool urb_endpoint_busy(const usbh_generic_data_t *lld_data, const usbh_urb_t *urb)
+{
+	uint32_t i;
+	for (i = 0; i < USBH_MAX_URBS; i++) {
+		const usbh_urb_t *active = &lld_data->urbs[i];
+		if (active == urb) {
+			continue;
+		}
+		// transfer waiting for the retry keeps its place on the endpoint
+		if ((active->state == USBH_URB_STATE_ACTIVE || active->state == USBH_URB_STATE_BACKOFF) &&
+			urb_same_endpoint(active, urb)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/// retry count and backoff of the first retry in frames, indexed by USBH_ENDPOINT_TYPE
+static const struct {
+	uint8_t count;
+	uint8_t backoff_frames;
+} urb_retry_policy[] = {
+	[USBH_ENDPOINT_TYPE_CONTROL] = {USBH_RETRY_CONTROL, USBH_RETRY_BACKOFF_CONTROL_FRAMES},
+	[USBH_ENDPOINT_TYPE_ISOCHRONOUS] = {USBH_RETRY_ISOCHRONOUS, USBH_RETRY_BACKOFF_ISOCHRONOUS_FRAMES},
+	[USBH_ENDPOINT_TYPE_BULK] = {USBH_RETRY_BULK, USBH_RETRY_BACKOFF_BULK_FRAMES},
+	[USBH_ENDPOINT_TYPE_INTERRUPT] = {USBH_RETRY_INTERRUPT, USBH_RETRY_BACKOFF_INTERRUPT_FRAMES},
+};
+
+const usbh_nak_policy_t usbh_nak_policy[] = {
+	[USBH_ENDPOINT_TYPE_CONTROL] = {USBH_NAK_RETRY_CONTROL_FRAMES, USBH_NAK_LIMIT_CONTROL},
+	[USBH_ENDPOINT_TYPE_ISOCHRONOUS] = {0, 0},
+	[USBH_ENDPOINT_TYPE_BULK] = {USBH_NAK_RETRY_BULK_FRAMES, USBH_NAK_LIMIT_BULK},
+	[USBH_ENDPOINT_TYPE_INTERRUPT] = {0, USBH_NAK_LIMIT_INTERRUPT},
+};
+
+const uint8_t usbh_channel_priority[] = {
+	[USBH_ENDPOINT_TYPE_CONTROL] = USBH_PRIORITY_CONTROL,
+	[USBH_ENDPOINT_TYPE_ISOCHRONOUS] = USBH_PRIORITY_ISOCHRONOUS,
+	[USBH_ENDPOINT_TYPE_BULK] = USBH_PRIORITY_BULK,
+	[USBH_ENDPOINT_TYPE_INTERRUPT] = USBH_PRIORITY_INTERRUPT,
+};
+
+/**
+ * Put the unfinished transfer back to the head of the queue, started again after delay_us
+ *
+ * Data transferred before are not sent (read) twice, the transfer continues after them.
+ */
+static void urb_requeue(usbh_urb_t *urb, uint16_t transferred_length, uint32_t delay_us)
+{
+	usbh_generic_data_t *lld_data = urb->lld->driver_data;
+
+	if (transferred_length > urb->packet.datalen) {
+		transferred_length = urb->packet.datalen;
+	}
+	if (urb->in) {
+		urb->packet.data.in = (uint8_t *)urb->packet.data.in + transferred_length;
+	} else {
+		urb->packet.data.out = (const uint8_t *)urb->packet.data.out + transferred_length;
+	}
+	urb->packet.datalen -= transferred_length;
+	urb->transferred_length += transferred_length;
+
+	urb->retry_us = usbh_data.time_curr_us + delay_us;
+	urb->state = USBH_URB_STATE_BACKOFF;
+	usbh_poll_request(urb->retry_us);
+
+	// goes before the transfers submitted later
+	uint8_t i = urb - lld_data->urbs;
+	urb->next = lld_data->urb_pending;
+	lld_data->urb_pending = i;
+}
+
+/**
+ * @returns duration of the frame on the bus of the transfer, microframe on the high speed bus
+ */
+static uint32_t urb_frame_us(const usbh_urb_t *urb)
+{
+	if (urb->lld->root_speed(urb->lld->driver_data) == USBH_SPEED_HIGH) {
+		return 125;
+	}
+	return 1000;
+}
+
+/**
+ * Schedule the failed transfer again, when the retry policy allows it.
+ *
+ * @returns false when the retries are exhausted
+ */
+static bool urb_retry(usbh_urb_t *urb, uint16_t transferred_length)
+{
+	uint8_t type = urb->packet.endpoint_type;
+	if (urb->retries >= urb_retry_policy[type].count) {
+		return false;
+	}
+
+	usbh_generic_data_t *lld_data = urb->lld->driver_data;
+	usbh_stats_event(lld_data, &urb->packet, urb->in, USBH_STATS_EVENT_RETRY);
+
+	urb_requeue(urb, transferred_length,
+		urb_retry_policy[type].backoff_frames * urb_frame_us(urb) << urb->retries);
+	urb->retries++;
+	return true;
+}
+
+static uint32_t urb_timeout_us(const usbh_urb_t *urb)
+{
+	switch (urb->packet.endpoint_type) {
+	case USBH_ENDPOINT_TYPE_CONTROL:
+		return USBH_TIMEOUT_CONTROL_US;
+
+	case USBH_ENDPOINT_TYPE_BULK:
+		return urb->in ? USBH_TIMEOUT_BULK_IN_US : USBH_TIMEOUT_BULK_OUT_US;
+
+	case USBH_ENDPOINT_TYPE_INTERRUPT:
+		return USBH_TIMEOUT_INTERRUPT_US;
+
+	default:
+		return USBH_TIMEOUT_ISOCHRONOUS_US;
+	}
+}
+
+static void urb_complete(void *callback_arg, usbh_packet_callback_data_t cb_data);
+
+/**
+ * Active transfer has not finished in time, take its channel back
+ */
+static void urb_timeout(void *callback_arg)
+{
+	usbh_urb_t *urb = callback_arg;
+	const usbh_low_level_driver_t *lld = urb->lld;
+
+	LOG_PRINTF("TIMEOUT of transfer to %d/EP%d\n", urb->packet.address, urb->packet.endpoint_address);
+	lld->cancel(lld->driver_data, &urb->packet);
+
+	usbh_packet_callback_data_t cb_data;
+	cb_data.status = USBH_PACKET_CALLBACK_STATUS_ETIMEOUT;
+	cb_data.transferred_length = 0;
+	urb_complete(urb, cb_data);
+}
+
+/**
+ * Start pending transfers by priority, then in the order of submission.
+ *
+ * Transfer waits while the previous one on the same endpoint is in progress
+ * (data toggle and ordering), or until low-level driver has a free channel.
+ */
+static void urb_dispatch(const usbh_low_level_driver_t *lld)
+{
+	usbh_generic_data_t *lld_data = lld->driver_data;
+
+	while (true) {
+		uint8_t *link = NULL;
+		uint8_t *next = &lld_data->urb_pending;
+		while (*next != USBH_URB_NONE) {
+			const usbh_urb_t *urb = &lld_data->urbs[*next];
+			const bool ready = (urb->state != USBH_URB_STATE_BACKOFF ||
+				(int32_t)(usbh_data.time_curr_us - urb->retry_us) >= 0) &&
+				!urb_endpoint_busy(lld_data, urb);
+			if (ready && (!link || usbh_channel_priority[urb->packet.endpoint_type] >
+				usbh_channel_priority[lld_data->urbs[*link].packet.endpoint_type])) {
+				link = next;
+			}
+			next = &lld_data->urbs[*next].next;
+		}
+		if (!link) {
+			return;
+		}
+
+		usbh_urb_t *urb = &lld_data->urbs[*link];
+		bool started;
+		if (urb->in) {
+			started = lld->read(lld->driver_data, &urb->packet);
+		} else {
+			started = lld->write(lld->driver_data, &urb->packet);
+		}
+		if (!started) {
+			// no channel left, completion of other transfer dispatches again.
+			// Parked transfer completes by ENAK, which may happen right in park()
+			if (lld->park) {
+				lld->park(lld->driver_data, usbh_channel_priority[urb->packet.endpoint_type]);
+			}
+			return;
+		}
+
+		urb->state = USBH_URB_STATE_ACTIVE;
+		*link = urb->next;
+
+		const uint32_t timeout_us = urb_timeout_us(urb);
+		if (timeout_us && lld->cancel) {
+			usbh_timer_start(&urb->timer, timeout_us, urb_timeout, urb);
+		}
+	}
+}
+
+static void urb_complete(void *callback_arg, usbh_packet_callback_data_t cb_data)
+{
+	usbh_urb_t *urb = callback_arg;
+	const usbh_low_level_driver_t *lld = urb->lld;
+	usbh_packet_callback_t callback = urb->callback;
+
+	if (urb->state != USBH_URB_STATE_ACTIVE) {
+		// late completion of the transfer already ended by the core (timeout, removed device),
+		// the URB is free or serves another transfer
+		LOG_PRINTF("Completion of inactive transfer to %d/EP%d dropped\n",
+			urb->packet.address, urb->packet.endpoint_address);
+		return;
+	}
+
+	usbh_timer_stop(&urb->timer);
+	if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_ENAK) {
+		// channel given back by the NAK policy, other transfers may take it meanwhile
+		const uint8_t frames = usbh_nak_policy[urb->packet.endpoint_type].retry_frames;
+		urb_requeue(urb, cb_data.transferred_length, (frames ? frames : 1) * urb_frame_us(urb));
+		urb_dispatch(lld);
+		return;
+	}
+	if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_EAGAIN &&
+		urb_retry(urb, cb_data.transferred_length)) {
+		return;
+	}
+	cb_data.transferred_length += urb->transferred_length;
+
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CALLBACK, USBH_TRACE_CHANNEL_NONE, &urb->packet, urb->in,
+		((uint32_t)cb_data.status << 16) | cb_data.transferred_length);
+
+	urb->state = USBH_URB_STATE_FREE;
+	callback(urb->callback_arg, cb_data);
+
+	urb_dispatch(lld);
+}
+
+static void urb_submit(usbh_device_t *dev, const usbh_packet_t *packet, bool in)
 {
-	usbh_data.enumeration_run = true;
+	const usbh_low_level_driver_t *lld = dev->lld;
+	usbh_generic_data_t *lld_data = lld->driver_data;
+
+	usbh_packet_callback_data_t cb_data;
+	cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+	cb_data.transferred_length = 0;
+
+	if (lld->validate && !lld->validate(lld->driver_data, packet, in)) {
+		LOG_PRINTF("FATAL ERROR, PACKET REJECTED BY LOW-LEVEL DRIVER \n");
+		packet->callback(packet->callback_arg, cb_data);
+		return;
+	}
+
+	uint8_t i;
+	for (i = 0; i < USBH_MAX_URBS; i++) {
+		if (lld_data->urbs[i].state == USBH_URB_STATE_FREE) {
+			break;
+		}
+	}
+	if (i == USBH_MAX_URBS) {
+		LOG_PRINTF("FATAL ERROR, NO URB LEFT \n");
+		packet->callback(packet->callback_arg, cb_data);
+		return;
+	}
+
+	usbh_urb_t *urb = &lld_data->urbs[i];
+	urb->packet = *packet;
+	urb->packet.callback = urb_complete;
+	urb->packet.callback_arg = urb;
+	urb->callback = packet->callback;
+	urb->callback_arg = packet->callback_arg;
+	urb->lld = lld;
+	urb->in = in;
+	urb->retries = 0;
+	urb->transferred_length = 0;
+	urb->state = USBH_URB_STATE_PENDING;
+	urb->next = USBH_URB_NONE;
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_SUBMIT, USBH_TRACE_CHANNEL_NONE, packet, in, packet->datalen);
+
+	uint8_t *link = &lld_data->urb_pending;
+	while (*link != USBH_URB_NONE) {
+		link = &lld_data->urbs[*link].next;
+	}
+	*link = i;
+
+	urb_dispatch(lld);
 }
 
-static void reset_enumeration(void)
+static usbh_timer_t **timer_slot(uint64_t time_us)
 {
-	usbh_data.enumeration_run = false;
+	return &usbh_data.timer_wheel[(time_us / USBH_TIMER_TICK_US) & (USBH_TIMER_WHEEL_SLOTS - 1)];
 }
 
-static bool enumeration(void)
+uint64_t usbh_time_us(void)
 {
-	return usbh_data.enumeration_run;
+	return usbh_data.time_us;
 }
 
-void device_remove(usbh_device_t *dev)
+void usbh_timer_start(usbh_timer_t *timer, uint32_t delay_us, usbh_timer_callback_t callback, void *arg)
+{
+	usbh_timer_stop(timer);
+
+	timer->callback = callback;
+	timer->arg = arg;
+	timer->expire_us = usbh_data.time_us + delay_us;
+
+	usbh_timer_t **slot = timer_slot(timer->expire_us);
+	timer->next = *slot;
+	*slot = timer;
+	timer->armed = true;
+	usbh_data.timer_count++;
+
+	usbh_poll_request(usbh_data.time_curr_us + delay_us);
+}
+
+void usbh_timer_stop(usbh_timer_t *timer)
 {
-	if (dev->drv && dev->drvdata) {
-		dev->drv->remove(dev->drvdata);
+	if (!timer->armed) {
+		return;
 	}
-	dev->address = -1;
-	dev->drv = NULL;
-	dev->drvdata = NULL;
+
+	usbh_timer_t **link = timer_slot(timer->expire_us);
+	while (*link && *link != timer) {
+		link = &(*link)->next;
+	}
+	timer->armed = false;
+	if (!*link) {
+		// dropped by timer_reset() of another usbh_init()
+		return;
+	}
+	*link = timer->next;
+	usbh_data.timer_count--;
+}
+
+bool usbh_timer_pending(const usbh_timer_t *timer)
+{
+	return timer->armed;
 }
 
 /**
- *
+ * Disarm all timers and empty the wheel
  */
-static bool find_driver(usbh_device_t *dev, const usbh_dev_driver_info_t * device_info)
+static void timer_reset(void)
 {
-
-#define CHECK_PARTIAL_COMPATIBILITY(what) \
-	if (usbh_data.dev_drivers[i]->info->what != -1\
-	&& device_info->what != usbh_data.dev_drivers[i]->info->what) {\
-		i++;\
-		continue;\
-	}
-
-	int i = 0;
-
-	while (usbh_data.dev_drivers[i]) {
-
-		CHECK_PARTIAL_COMPATIBILITY(ifaceClass);
-		CHECK_PARTIAL_COMPATIBILITY(ifaceSubClass);
-		CHECK_PARTIAL_COMPATIBILITY(ifaceProtocol);
-		CHECK_PARTIAL_COMPATIBILITY(deviceClass);
-		CHECK_PARTIAL_COMPATIBILITY(deviceSubClass);
-		CHECK_PARTIAL_COMPATIBILITY(deviceProtocol);
-		CHECK_PARTIAL_COMPATIBILITY(idVendor);
-		CHECK_PARTIAL_COMPATIBILITY(idProduct);
-
-		dev->drv = usbh_data.dev_drivers[i];
-		dev->drvdata = dev->drv->init(dev);
-		if (!dev->drvdata) {
-			LOG_PRINTF("Unable to initialize device driver at index %d\n", i);
-			i++;
-			continue;
+	uint32_t i;
+	for (i = 0; i < USBH_TIMER_WHEEL_SLOTS; i++) {
+		usbh_timer_t *timer = usbh_data.timer_wheel[i];
+		for (; timer; timer = timer->next) {
+			timer->armed = false;
 		}
-		return true;
+		usbh_data.timer_wheel[i] = NULL;
 	}
-	return false;
-#undef CHECK_PARTIAL_COMPATIBILITY
+	usbh_data.timer_tick = 0;
+	usbh_data.timer_count = 0;
 }
 
-
-static void device_register(void *descriptors, uint16_t descriptors_len, usbh_device_t *dev)
+/**
+ * Fire the expired timers. Only the slots of the ticks elapsed since
+ * the previous poll are walked, at most one revolution of the wheel.
+ */
+static void timer_service(void)
 {
-	uint32_t i = 0;
-	uint8_t *buf = (uint8_t *)descriptors;
+	const uint64_t tick_curr = usbh_data.time_us / USBH_TIMER_TICK_US;
+	uint64_t tick = usbh_data.timer_tick;
 
-	dev->drv = NULL;
-	dev->drvdata = NULL;
+	if (tick_curr - tick >= USBH_TIMER_WHEEL_SLOTS) {
+		tick = tick_curr - USBH_TIMER_WHEEL_SLOTS + 1;
+	}
 
-	uint8_t desc_len = buf[i];
-	uint8_t desc_type = buf[i + 1];
+	for (; tick <= tick_curr && usbh_data.timer_count; tick++) {
+		usbh_timer_t **slot = &usbh_data.timer_wheel[tick & (USBH_TIMER_WHEEL_SLOTS - 1)];
+		usbh_timer_t **link = slot;
+		while (*link) {
+			usbh_timer_t *timer = *link;
+			if (timer->expire_us > usbh_data.time_us) {
+				link = &timer->next;
+				continue;
+			}
 
-	usbh_dev_driver_info_t device_info;
-	if (desc_type == USB_DT_DEVICE) {
-		struct usb_device_descriptor *device_desc = (void*)&buf[i];
-		LOG_PRINTF("DEVICE DESCRIPTOR\n");
-		device_info.deviceClass = device_desc->bDeviceClass;
-		device_info.deviceSubClass = device_desc->bDeviceSubClass;
-		device_info.deviceProtocol = device_desc->bDeviceProtocol;
-		device_info.idVendor = device_desc->idVendor;
-		device_info.idProduct = device_desc->idProduct;
-	} else {
-		LOG_PRINTF("INVALID descriptors pointer - fatal error");
-		return;
+			// unlinked before the callback, so it may arm the timer again
+			*link = timer->next;
+			timer->armed = false;
+			usbh_data.timer_count--;
+			if (timer->callback) {
+				timer->callback(timer->arg);
+
+				// the callback may have stopped or rearmed the timer the link points into
+				link = slot;
+			}
+		}
 	}
 
+	// timers of the current tick, that have not expired yet, are checked by the next poll
+	usbh_data.timer_tick = tick_curr;
+}
 
-	while (i < descriptors_len) {
-		desc_len = buf[i];
-		desc_type = buf[i + 1];
-		switch (desc_type) {
-		case USB_DT_INTERFACE:
-		{
-			LOG_PRINTF("INTERFACE_DESCRIPTOR\n");
-			struct usb_interface_descriptor *iface = (void*)&buf[i];
-			device_info.ifaceClass = iface->bInterfaceClass;
-			device_info.ifaceSubClass = iface->bInterfaceSubClass;
-			device_info.ifaceProtocol = iface->bInterfaceProtocol;
-			if (find_driver(dev, &device_info)) {
-				int k = 0;
-				while (k < descriptors_len) {
-					desc_len = buf[k];
-					void *drvdata = dev->drvdata;
-					LOG_PRINTF("[%d]", buf[k+1]);
-					if (dev->drv->analyze_descriptor(drvdata, &buf[k])) {
-						LOG_PRINTF("Device Initialized\n");
-						return;
-					}
+/**
+ * Request the poll at the earliest expiration within one revolution of the wheel
+ */
+static void timer_deadline(void)
+{
+	if (!usbh_data.timer_count) {
+		return;
+	}
 
-					if (desc_len == 0) {
-						LOG_PRINTF("Problem occured while parsing complete configuration descriptor");
-						return;
-					}
-					k += desc_len;
-				}
-				LOG_PRINTF("Device driver isn't compatible with this device\n");
-				device_remove(dev);
-			} else {
-				LOG_PRINTF("No compatible driver has been found for interface #%d\n", iface->bInterfaceNumber);
+	const uint64_t tick_curr = usbh_data.time_us / USBH_TIMER_TICK_US;
+	uint32_t i;
+	for (i = 0; i < USBH_TIMER_WHEEL_SLOTS; i++) {
+		const usbh_timer_t *timer = usbh_data.timer_wheel[(tick_curr + i) & (USBH_TIMER_WHEEL_SLOTS - 1)];
+		uint64_t expire_us = UINT64_MAX;
+		for (; timer; timer = timer->next) {
+			if (timer->expire_us / USBH_TIMER_TICK_US == tick_curr + i && timer->expire_us < expire_us) {
+				expire_us = timer->expire_us;
 			}
 		}
-			break;
-		default:
-			break;
-		}
-
-		if (desc_len == 0) {
-			LOG_PRINTF("PROBLEM WITH PARSE %d\n",i);
+		if (expire_us != UINT64_MAX) {
+			usbh_poll_request(usbh_data.time_curr_us + (uint32_t)(expire_us - usbh_data.time_us));
 			return;
 		}
-		i += desc_len;
 	}
-	LOG_PRINTF("Device NOT Initialized\n");
+
+	// nothing expires within this revolution, look again at its end
+	usbh_poll_request(usbh_data.time_curr_us + USBH_TIMER_WHEEL_SLOTS * USBH_TIMER_TICK_US);
 }
 
-void usbh_init(const usbh_low_level_driver_t * const low_level_drivers[], const usbh_dev_driver_t * const device_drivers[])
+bool usbh_init(const usbh_low_level_driver_t * const low_level_drivers[], const usbh_dev_driver_t * const device_drivers[])
 {
 	if (!low_level_drivers) {
-		return;
+		return false;
 	}
 
-	usbh_data.lld_drivers = (const usbh_low_level_driver_t **)low_level_drivers;
 	usbh_data.dev_drivers = device_drivers;
+	if (!driver_index_build()) {
+		usbh_data.dev_drivers = NULL;
+		return false;
+	}
+	usbh_data.lld_drivers = (const usbh_low_level_driver_t **)low_level_drivers;
+	timer_reset();
 
 	uint32_t k = 0;
 	while (usbh_data.lld_drivers[k]) {
 		LOG_PRINTF("Initialization low-level driver with index=%d\n", k);
 
-		usbh_device_t * usbh_device =
-			((usbh_generic_data_t *)(usbh_data.lld_drivers[k])->driver_data)->usbh_device;
+		usbh_generic_data_t *lld_data = usbh_data.lld_drivers[k]->driver_data;
+		usbh_device_t *usbh_device = lld_data->usbh_device;
 		uint32_t i;
 		for (i = 0; i < USBH_MAX_DEVICES; i++) {
 			//~ LOG_PRINTF("%p ", &usbh_device[i]);
 			usbh_device[i].address = -1;
-			usbh_device[i].drv = 0;
-			usbh_device[i].drvdata = 0;
+			usbh_device[i].lld = NULL;
+			control_reset(&usbh_device[i]);
+			uint32_t j;
+			for (j = 0; j < USBH_MAX_INTERFACE_DRIVERS; j++) {
+				usbh_device[i].drivers[j].drv = NULL;
+				usbh_device[i].drivers[j].drvdata = NULL;
+			}
 		}
+		lld_data->enumeration_run = false;
+		urb_reset(lld_data);
+		device_alloc_reset(lld_data);
+		stats_reset(lld_data);
 		usbh_data.lld_drivers[k]->init(usbh_data.lld_drivers[k]->driver_data);
 
 		k++;
 	}
-
+	return true;
 }
 
 static void device_xfer_control_write_setup(const void *data, uint16_t datalen, usbh_packet_callback_t callback, usbh_device_t *dev)
@@ -265,17 +1362,52 @@ static void device_xfer_control_read(void *data, uint16_t datalen, usbh_packet_c
 }
 
 
-static void control_state_machine(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+static void control_start(usbh_device_t *dev, usbh_packet_callback_t callback, void *callback_arg, const struct usb_setup_data *setup_data, void *data);
+
+/**
+ * Report the result of the control request and start the next queued one
+ */
+static void control_finish(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+{
+	usbh_control_t *control = &dev->control;
+
+	control->state = USBH_CONTROL_STATE_NONE;
+	control->callback(control->callback_arg, cb_data);
+
+	// callback might have removed the device, which drops the queue
+	if (control->state != USBH_CONTROL_STATE_NONE || !control->queue_count) {
+		return;
+	}
+
+	usbh_control_request_t request = control->queue[control->queue_head];
+	control->queue_head = (control->queue_head + 1) % USBH_CONTROL_QUEUE_SIZE;
+	control->queue_count--;
+	control_start(dev, request.callback, request.callback_arg, &request.setup_data, request.data);
+}
+
+/**
+ * Failed stage of the control request is reported as fatal, unless it has timed out
+ */
+static enum USBH_PACKET_CALLBACK_STATUS control_error(enum USBH_PACKET_CALLBACK_STATUS status)
+{
+	if (status == USBH_PACKET_CALLBACK_STATUS_ETIMEOUT) {
+		return status;
+	}
+	return USBH_PACKET_CALLBACK_STATUS_EFATAL;
+}
+
+static void control_state_machine(void *callback_arg, usbh_packet_callback_data_t cb_data)
 {
+	usbh_device_t *dev = callback_arg;
+
 	switch (dev->control.state) {
 	case USBH_CONTROL_STATE_SETUP:
 		if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
-			dev->control.state = USBH_CONTROL_STATE_NONE;
 			// Unable to deliver setup control packet - this is a fatal error
 			usbh_packet_callback_data_t ret_data;
-			ret_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+			ret_data.status = control_error(cb_data.status);
 			ret_data.transferred_length = 0;
-			dev->control.callback(dev, ret_data);
+			control_finish(dev, ret_data);
 			break;
 		}
 		if (dev->control.setup_data.bmRequestType & USB_REQ_TYPE_IN) {
@@ -294,24 +1426,21 @@ static void control_state_machine(usbh_device_t *dev, usbh_packet_callback_data_
 
 	case USBH_CONTROL_STATE_DATA:
 		if (dev->control.setup_data.bmRequestType & USB_REQ_TYPE_IN) {
-			dev->control.state = USBH_CONTROL_STATE_NONE;
-			dev->control.callback(dev, cb_data);
+			control_finish(dev, cb_data);
 		} else {
 			if (cb_data.status != USBH_PACKET_CALLBACK_STATUS_OK) {
-				dev->control.state = USBH_CONTROL_STATE_NONE;
 				// Unable to deliver data control packet - this is a fatal error
 				usbh_packet_callback_data_t ret_data;
-				ret_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+				ret_data.status = control_error(cb_data.status);
 				ret_data.transferred_length = 0;
-				dev->control.callback(dev, ret_data);
+				control_finish(dev, ret_data);
 				break;
 			}
 
 			if (dev->control.data_length == 0) {
 				// we should be in status state when the length of data is zero
 				LOG_PRINTF("Control logic error\n");
-				dev->control.state = USBH_CONTROL_STATE_NONE;
-				dev->control.callback(dev, cb_data);
+				control_finish(dev, cb_data);
 			} else {
 				dev->control.state = USBH_CONTROL_STATE_STATUS;
 				device_xfer_control_read(NULL, 0, control_state_machine, dev);
@@ -320,8 +1449,7 @@ static void control_state_machine(usbh_device_t *dev, usbh_packet_callback_data_
 		break;
 
 	case USBH_CONTROL_STATE_STATUS:
-		dev->control.state = USBH_CONTROL_STATE_NONE;
-		dev->control.callback(dev, cb_data);
+		control_finish(dev, cb_data);
 		break;
 
 	default:
@@ -329,60 +1457,79 @@ static void control_state_machine(usbh_device_t *dev, usbh_packet_callback_data_
 	}
 }
 
-void device_control(usbh_device_t *dev, usbh_packet_callback_t callback, const struct usb_setup_data *setup_data, void *data)
+static void control_start(usbh_device_t *dev, usbh_packet_callback_t callback, void *callback_arg, const struct usb_setup_data *setup_data, void *data)
 {
-	if (dev->control.state != USBH_CONTROL_STATE_NONE) {
-		LOG_PRINTF("ERROR: Use of control state machine while not idle\n");
-		return;
-	}
-
 	dev->control.state = USBH_CONTROL_STATE_SETUP;
 	dev->control.callback = callback;
+	dev->control.callback_arg = callback_arg;
 	dev->control.data.out = data;
 	dev->control.data_length = setup_data->wLength;
 	dev->control.setup_data = *setup_data;
 	device_xfer_control_write_setup(&dev->control.setup_data, sizeof(dev->control.setup_data), control_state_machine, dev);
 }
 
+bool device_control(usbh_device_t *dev, usbh_packet_callback_t callback, void *callback_arg, const struct usb_setup_data *setup_data, void *data)
+{
+	usbh_control_t *control = &dev->control;
+
+	// keep the order of requests, queued ones go first
+	if (control->state == USBH_CONTROL_STATE_NONE && !control->queue_count) {
+		control_start(dev, callback, callback_arg, setup_data, data);
+		return true;
+	}
+
+	if (control->queue_count == USBH_CONTROL_QUEUE_SIZE) {
+		LOG_PRINTF("ERROR: Control queue of device %d is full\n", dev->address);
+		return false;
+	}
+
+	uint8_t i = (control->queue_head + control->queue_count) % USBH_CONTROL_QUEUE_SIZE;
+	usbh_control_request_t *request = &control->queue[i];
+	request->callback = callback;
+	request->callback_arg = callback_arg;
+	request->data = data;
+	request->setup_data = *setup_data;
+	control->queue_count++;
+	return true;
+}
+
 
-bool usbh_enum_available(void)
+bool usbh_enum_available(const usbh_device_t *dev)
 {
-	return !enumeration();
+	return !enumeration(dev);
 }
 
 /**
+ * Reserve a device slot and a free USB address on the controller of dev
+ *
  * Returns 0 on error
  * device otherwise
  */
 usbh_device_t *usbh_get_free_device(const usbh_device_t *dev)
 {
-	const usbh_low_level_driver_t *lld = dev->lld;
-	usbh_generic_data_t *lld_data = lld->driver_data;
-	usbh_device_t *usbh_device = lld_data->usbh_device;
-
-	uint8_t i;
-	LOG_PRINTF("DEV ADDRESS%d\n", dev->address);
-	for (i = 0; i < USBH_MAX_DEVICES; i++) {
-		if (usbh_device[i].address < 0) {
-			LOG_PRINTF("\t\t\t\t\tFOUND: %d", i);
-			usbh_device[i].address = i+1;
-			return &usbh_device[i];
-		} else {
-			LOG_PRINTF("address: %d\n\n\n", usbh_device[i].address);
-		}
+	usbh_device_t *new_dev = device_alloc(lld_data_of(dev));
+	if (new_dev) {
+		new_dev->lld = dev->lld;
+		LOG_PRINTF("FREE DEVICE: address %d\n", new_dev->address);
 	}
-
-	return 0;
+	return new_dev;
 }
 
 static void device_enumeration_finish(usbh_device_t *dev)
 {
-	reset_enumeration();
+	usbh_generic_data_t *lld_data = lld_data_of(dev);
+	lld_data->enum_timing.total_us = usbh_data.time_curr_us - lld_data->enum_time_start_us;
+	reset_enumeration(dev);
 	dev->state = USBH_ENUM_STATE_FIRST;
 }
 
+/**
+ * Give up the device, its slot and address are released for the next one
+ */
 static void device_enumeration_terminate(usbh_device_t *dev)
 {
+	control_reset(dev);
+	device_free(lld_data_of(dev), dev);
 	dev->address = -1;
 	device_enumeration_finish(dev);
 }
@@ -391,18 +1538,36 @@ static void device_enumeration_terminate(usbh_device_t *dev)
 	dev->state = en;\
 	device_enumerate(dev, cb_data);
 
-static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+/**
+ * Length of the configuration descriptor request
+ *
+ * Whole buffer is requested in the speculative mode, because the length
+ * of the descriptor is not known yet.
+ */
+static uint16_t configuration_dt_read_length(const uint8_t *usbh_buffer)
+{
+	if (USBH_ENUM_SPECULATIVE_CONFIGURATION_READ) {
+		return CONFIGURATION_DT_BUFFER_SIZE;
+	}
+	const struct usb_config_descriptor *cdt =
+		(const struct usb_config_descriptor *)&usbh_buffer[CONFIGURATION_DT_OFFSET];
+	return cdt->wTotalLength;
+}
+
+static void device_enumerate(void *callback_arg, usbh_packet_callback_data_t cb_data)
 {
+	usbh_device_t *dev = callback_arg;
 	const usbh_low_level_driver_t *lld = dev->lld;
 	usbh_generic_data_t *lld_data = lld->driver_data;
 	uint8_t *usbh_buffer = lld_data->usbh_buffer;
 //	LOG_PRINTF("\nSTATE: %d\n", state);
 	switch (dev->state) {
 	case USBH_ENUM_STATE_SET_ADDRESS:
+		enum_step_end(dev, USBH_ENUM_STEP_SET_ADDRESS);
 		switch (cb_data.status) {
 		case USBH_PACKET_CALLBACK_STATUS_OK:
 			if (dev->address == 0) {
-				dev->address = usbh_data.address_temporary;
+				dev->address = lld_data->address_temporary;
 				LOG_PRINTF("Assigned address: %d\n", dev->address);
 			}
 			CONTINUE_WITH(USBH_ENUM_STATE_DEVICE_DT_READ_SETUP);
@@ -425,29 +1590,38 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 			setup_data.wIndex = 0;
 			setup_data.wLength = USB_DT_DEVICE_SIZE;
 
+			enum_step_begin(dev);
 			dev->state = USBH_ENUM_STATE_DEVICE_DT_READ_COMPLETE;
-			device_control(dev, device_enumerate, &setup_data, &usbh_buffer[0]);
+			device_control(dev, device_enumerate, dev, &setup_data, &usbh_buffer[DEVICE_DT_OFFSET]);
 		}
 		break;
 
 	case USBH_ENUM_STATE_DEVICE_DT_READ_COMPLETE:
 		{
+			enum_step_end(dev, USBH_ENUM_STEP_DEVICE_DT);
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				{
 					struct usb_device_descriptor *ddt =
-							(struct usb_device_descriptor *)&usbh_buffer[0];
+							(struct usb_device_descriptor *)&usbh_buffer[DEVICE_DT_OFFSET];
 					dev->packet_size_max0 = ddt->bMaxPacketSize0;
 					LOG_PRINTF("Found device with vid=0x%04x pid=0x%04x\n", ddt->idVendor, ddt->idProduct);
 					LOG_PRINTF("class=0x%02x subclass=0x%02x protocol=0x%02x\n", ddt->bDeviceClass, ddt->bDeviceSubClass, ddt->bDeviceProtocol);
-					CONTINUE_WITH(USBH_ENUM_STATE_CONFIGURATION_DT_HEADER_READ_SETUP)
+					if (descriptor_cache_load(ddt, &usbh_buffer[CONFIGURATION_DT_OFFSET])) {
+						LOG_PRINTF("Configuration descriptor found in cache\n");
+						CONTINUE_WITH(USBH_ENUM_STATE_SET_CONFIGURATION_SETUP);
+					} else if (USBH_ENUM_SPECULATIVE_CONFIGURATION_READ) {
+						CONTINUE_WITH(USBH_ENUM_STATE_CONFIGURATION_DT_READ_SETUP);
+					} else {
+						CONTINUE_WITH(USBH_ENUM_STATE_CONFIGURATION_DT_HEADER_READ_SETUP);
+					}
 				}
 				break;
 
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				if (cb_data.transferred_length >= 8) {
 					struct usb_device_descriptor *ddt =
-						(struct usb_device_descriptor *)&usbh_buffer[0];
+						(struct usb_device_descriptor *)&usbh_buffer[DEVICE_DT_OFFSET];
 					dev->packet_size_max0 = ddt->bMaxPacketSize0;
 					CONTINUE_WITH(USBH_ENUM_STATE_DEVICE_DT_READ_SETUP);
 				} else {
@@ -466,16 +1640,18 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 
 	case USBH_ENUM_STATE_CONFIGURATION_DT_HEADER_READ_SETUP:
 		{
-			struct usb_setup_data setup_data;
+			// setup packet may wait in the queue, so it must not live on stack
+			struct usb_setup_data *setup_data = &dev->control.setup_data;
 
-			setup_data.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_DEVICE;
-			setup_data.bRequest = USB_REQ_GET_DESCRIPTOR;
-			setup_data.wValue = USB_DT_CONFIGURATION << 8;
-			setup_data.wIndex = 0;
-			setup_data.wLength = dev->packet_size_max0;
+			setup_data->bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_DEVICE;
+			setup_data->bRequest = USB_REQ_GET_DESCRIPTOR;
+			setup_data->wValue = USB_DT_CONFIGURATION << 8;
+			setup_data->wIndex = 0;
+			setup_data->wLength = dev->packet_size_max0;
 
+			enum_step_begin(dev);
 			dev->state = USBH_ENUM_STATE_CONFIGURATION_DT_HEADER_READ;
-			device_xfer_control_write_setup(&setup_data, sizeof(setup_data),
+			device_xfer_control_write_setup(setup_data, sizeof(*setup_data),
 				device_enumerate, dev);
 		}
 		break;
@@ -485,7 +1661,7 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				dev->state = USBH_ENUM_STATE_CONFIGURATION_DT_HEADER_READ_COMPLETE;
-				device_xfer_control_read(&usbh_buffer[USB_DT_DEVICE_SIZE],
+				device_xfer_control_read(&usbh_buffer[CONFIGURATION_DT_OFFSET],
 					dev->packet_size_max0, device_enumerate, dev);
 				break;
 
@@ -499,6 +1675,7 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 
 	case USBH_ENUM_STATE_CONFIGURATION_DT_HEADER_READ_COMPLETE:
 		{
+			enum_step_end(dev, USBH_ENUM_STEP_CONFIGURATION_DT_HEADER);
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				CONTINUE_WITH(USBH_ENUM_STATE_CONFIGURATION_DT_READ_SETUP);
@@ -507,12 +1684,16 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				if (cb_data.transferred_length >= USB_DT_CONFIGURATION_SIZE) {
 					struct usb_config_descriptor *cdt =
-						(struct usb_config_descriptor *)&usbh_buffer[USB_DT_DEVICE_SIZE];
+						(struct usb_config_descriptor *)&usbh_buffer[CONFIGURATION_DT_OFFSET];
 					if (cb_data.transferred_length == cdt->wTotalLength) {
 						LOG_PRINTF("Configuration descriptor read complete. length: %d\n", cdt->wTotalLength);
+						descriptor_cache_store((struct usb_device_descriptor *)&usbh_buffer[DEVICE_DT_OFFSET], cdt);
 						CONTINUE_WITH(USBH_ENUM_STATE_SET_CONFIGURATION_SETUP);
+						break;
 					}
 				}
+				device_enumeration_terminate(dev);
+				ERROR(cb_data.status);
 				break;
 
 			default:
@@ -525,18 +1706,24 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 
 	case USBH_ENUM_STATE_CONFIGURATION_DT_READ_SETUP:
 		{
-			struct usb_config_descriptor *cdt =
-				(struct usb_config_descriptor *)&usbh_buffer[USB_DT_DEVICE_SIZE];
-			struct usb_setup_data setup_data;
-			LOG_PRINTF("Getting complete configuration descriptor of length: %d bytes\n", cdt->wTotalLength);
-			setup_data.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_DEVICE;
-			setup_data.bRequest = USB_REQ_GET_DESCRIPTOR;
-			setup_data.wValue = USB_DT_CONFIGURATION << 8;
-			setup_data.wIndex = 0;
-			setup_data.wLength = cdt->wTotalLength;
+			const uint16_t length = configuration_dt_read_length(usbh_buffer);
+			if (length > CONFIGURATION_DT_BUFFER_SIZE) {
+				LOG_PRINTF("Configuration descriptor of length %d does not fit into the buffer\n", length);
+				device_enumeration_terminate(dev);
+				break;
+			}
+
+			struct usb_setup_data *setup_data = &dev->control.setup_data;
+			LOG_PRINTF("Getting complete configuration descriptor of length: %d bytes\n", length);
+			setup_data->bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_DEVICE;
+			setup_data->bRequest = USB_REQ_GET_DESCRIPTOR;
+			setup_data->wValue = USB_DT_CONFIGURATION << 8;
+			setup_data->wIndex = 0;
+			setup_data->wLength = length;
 
+			enum_step_begin(dev);
 			dev->state = USBH_ENUM_STATE_CONFIGURATION_DT_READ;
-			device_xfer_control_write_setup(&setup_data, sizeof(setup_data),
+			device_xfer_control_write_setup(setup_data, sizeof(*setup_data),
 				device_enumerate, dev);
 		}
 		break;
@@ -545,13 +1732,9 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 		{
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
-				{
-					struct usb_config_descriptor *cdt =
-						(struct usb_config_descriptor *)&usbh_buffer[USB_DT_DEVICE_SIZE];
-					dev->state = USBH_ENUM_STATE_CONFIGURATION_DT_READ_COMPLETE;
-					device_xfer_control_read(&usbh_buffer[USB_DT_DEVICE_SIZE],
-						cdt->wTotalLength, device_enumerate, dev);
-				}
+				dev->state = USBH_ENUM_STATE_CONFIGURATION_DT_READ_COMPLETE;
+				device_xfer_control_read(&usbh_buffer[CONFIGURATION_DT_OFFSET],
+					configuration_dt_read_length(usbh_buffer), device_enumerate, dev);
 				break;
 
 			default:
@@ -564,12 +1747,23 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 
 	case USBH_ENUM_STATE_CONFIGURATION_DT_READ_COMPLETE:
 		{
+			enum_step_end(dev, USBH_ENUM_STEP_CONFIGURATION_DT);
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
+			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				{
 					struct usb_config_descriptor *cdt =
-						(struct usb_config_descriptor *)&usbh_buffer[USB_DT_DEVICE_SIZE];
+						(struct usb_config_descriptor *)&usbh_buffer[CONFIGURATION_DT_OFFSET];
+					// short packet ends the transfer when less than requested is available
+					if (cb_data.transferred_length < USB_DT_CONFIGURATION_SIZE
+						|| cb_data.transferred_length < cdt->wTotalLength) {
+						LOG_PRINTF("Configuration descriptor incomplete. length: %d\n", cb_data.transferred_length);
+						device_enumeration_terminate(dev);
+						ERROR(cb_data.status);
+						break;
+					}
 					LOG_PRINTF("Configuration descriptor read complete. length: %d\n", cdt->wTotalLength);
+					descriptor_cache_store((struct usb_device_descriptor *)&usbh_buffer[DEVICE_DT_OFFSET], cdt);
 					CONTINUE_WITH(USBH_ENUM_STATE_SET_CONFIGURATION_SETUP);
 
 				}
@@ -587,7 +1781,7 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 	case USBH_ENUM_STATE_SET_CONFIGURATION_SETUP:
 		{
 			struct usb_config_descriptor *cdt =
-				(struct usb_config_descriptor *)&usbh_buffer[USB_DT_DEVICE_SIZE];
+				(struct usb_config_descriptor *)&usbh_buffer[CONFIGURATION_DT_OFFSET];
 
 			struct usb_setup_data setup_data;
 
@@ -597,19 +1791,23 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 			setup_data.wIndex = 0;
 			setup_data.wLength = 0;
 
+			enum_step_begin(dev);
 			dev->state = USBH_ENUM_STATE_SET_CONFIGURATION_COMPLETE;
-			device_control(dev, device_enumerate, &setup_data, 0);
+			device_control(dev, device_enumerate, dev, &setup_data, 0);
 		}
 		break;
 
 	case USBH_ENUM_STATE_SET_CONFIGURATION_COMPLETE:
 		{
+			enum_step_end(dev, USBH_ENUM_STEP_SET_CONFIGURATION);
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
 				CONTINUE_WITH(USBH_ENUM_STATE_FIND_DRIVER);
 				break;
 
 			default:
+				// do not rely on the cached descriptors of the misbehaving device
+				descriptor_cache_remove((struct usb_device_descriptor *)&usbh_buffer[DEVICE_DT_OFFSET]);
 				device_enumeration_terminate(dev);
 				ERROR(cb_data.status);
 				break;
@@ -620,9 +1818,10 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 	case USBH_ENUM_STATE_FIND_DRIVER:
 		{
 			struct usb_config_descriptor *cdt =
-				(struct usb_config_descriptor *)&usbh_buffer[USB_DT_DEVICE_SIZE];
-			device_register(usbh_buffer, cdt->wTotalLength + USB_DT_DEVICE_SIZE, dev);
+				(struct usb_config_descriptor *)&usbh_buffer[CONFIGURATION_DT_OFFSET];
+			device_register(&usbh_buffer[DEVICE_DT_OFFSET], cdt->wTotalLength + USB_DT_DEVICE_SIZE, dev);
 
+			lld_data->enum_timing.complete = true;
 			device_enumeration_finish(dev);
 		}
 		break;
@@ -635,7 +1834,7 @@ static void device_enumerate(usbh_device_t *dev, usbh_packet_callback_data_t cb_
 
 void device_enumeration_start(usbh_device_t *dev)
 {
-	set_enumeration();
+	set_enumeration(dev);
 
 	// save address
 	uint8_t address = dev->address;
@@ -647,7 +1846,11 @@ void device_enumeration_start(usbh_device_t *dev)
 		dev->packet_size_max0 = 64;
 	}
 
-	usbh_data.address_temporary = address;
+	usbh_generic_data_t *lld_data = lld_data_of(dev);
+	lld_data->address_temporary = address;
+	memset(&lld_data->enum_timing, 0, sizeof(lld_data->enum_timing));
+	lld_data->enum_time_start_us = usbh_data.time_curr_us;
+	enum_step_begin(dev);
 
 	LOG_PRINTF("\n\n\n ENUMERATION OF DEVICE@%d STARTED \n\n", address);
 
@@ -660,7 +1863,7 @@ void device_enumeration_start(usbh_device_t *dev)
 	setup_data.wIndex = 0;
 	setup_data.wLength = 0;
 
-	device_control(dev, device_enumerate, &setup_data, 0);
+	device_control(dev, device_enumerate, dev, &setup_data, 0);
 }
 
 /**
@@ -669,6 +1872,17 @@ void device_enumeration_start(usbh_device_t *dev)
  */
 void usbh_poll(uint32_t time_curr_us)
 {
+	if (!usbh_data.lld_drivers) {
+		return;
+	}
+
+	usbh_data.time_us += time_curr_us - usbh_data.time_curr_us;
+	usbh_data.time_curr_us = time_curr_us;
+	usbh_data.time_deadline_us = time_curr_us + USBH_POLL_IDLE_US;
+	USBH_TRACE_TIME(time_curr_us);
+
+	timer_service();
+
 	uint32_t k = 0;
 	while (usbh_data.lld_drivers[k]) {
 		usbh_device_t *usbh_device =
@@ -682,21 +1896,27 @@ void usbh_poll(uint32_t time_curr_us)
 		case USBH_POLL_STATUS_DEVICE_CONNECTED:
 			// New device found
 			LOG_PRINTF("\nDEVICE FOUND\n");
-			usbh_device[0].lld = usbh_data.lld_drivers[k];
-			usbh_device[0].speed = usbh_data.lld_drivers[k]->root_speed(lld_data);
-			usbh_device[0].address = 1;
-			usbh_device[0].control.state = USBH_CONTROL_STATE_NONE;
-
-			device_enumeration_start(&usbh_device[0]);
+			{
+				// root device always takes the first slot
+				device_alloc_reset(lld_data);
+				usbh_device_t *root = device_alloc(lld_data);
+				root->lld = usbh_data.lld_drivers[k];
+				root->speed = usbh_data.lld_drivers[k]->root_speed(lld_data);
+				control_reset(root);
+
+				device_enumeration_start(root);
+			}
 			break;
 
 		case USBH_POLL_STATUS_DEVICE_DISCONNECTED:
 			{
-				usbh_device[0].control.state = USBH_CONTROL_STATE_NONE;
 				uint32_t i;
 				for (i = 0; i < USBH_MAX_DEVICES; i++) {
 					device_remove(&usbh_device[i]);
 				}
+				// enumeration may have been interrupted by the disconnection
+				lld_data->enumeration_run = false;
+				urb_reset(lld_data);
 			}
 			break;
 
@@ -704,23 +1924,154 @@ void usbh_poll(uint32_t time_curr_us)
 			break;
 		}
 
-		if (lld_data->usbh_device[0].drv && usbh_device[0].drvdata) {
-			usbh_device[0].drv->poll(usbh_device[0].drvdata, time_curr_us);
-		}
+		urb_dispatch(usbh_data.lld_drivers[k]);
+
+		device_poll(&usbh_device[0], time_curr_us);
 
 		k++;
 	}
+
+	timer_deadline();
 }
 
 void usbh_read(usbh_device_t *dev, usbh_packet_t *packet)
 {
-	const usbh_low_level_driver_t *lld = dev->lld;
-	lld->read(lld->driver_data, packet);
+	urb_submit(dev, packet, true);
 }
 
 void usbh_write(usbh_device_t *dev, const usbh_packet_t *packet)
 {
-	const usbh_low_level_driver_t *lld = dev->lld;
-	lld->write(lld->driver_data, packet);
+	urb_submit(dev, packet, false);
+}
+
+uint32_t usbh_poll_next(uint32_t time_curr_us)
+{
+	usbh_poll(time_curr_us);
+	return usbh_data.time_deadline_us;
+}
+
+void usbh_poll_request(uint32_t time_us)
+{
+	if ((int32_t)(time_us - usbh_data.time_deadline_us) < 0) {
+		usbh_data.time_deadline_us = time_us;
+	}
+}
+
+void usbh_enum_timing_get(const usbh_low_level_driver_t *lld, usbh_enum_timing_t *timing)
+{
+	const usbh_generic_data_t *lld_data = lld->driver_data;
+	*timing = lld_data->enum_timing;
+}
+
+#if USBH_STATS_ENDPOINTS > 0
+void usbh_stats_event(void *lld_data, const usbh_packet_t *packet, bool in, enum USBH_STATS_EVENT event)
+{
+	usbh_transfer_stats_t *stats = stats_find(lld_data, packet, in);
+	if (!stats) {
+		return;
+	}
+
+	switch (event) {
+	case USBH_STATS_EVENT_NAK:
+		stats->naks++;
+		break;
+	case USBH_STATS_EVENT_TXERR:
+		stats->txerr++;
+		break;
+	case USBH_STATS_EVENT_BBERR:
+		stats->bberr++;
+		break;
+	case USBH_STATS_EVENT_STALL:
+		stats->stalls++;
+		break;
+	case USBH_STATS_EVENT_DTERR:
+		stats->dterr++;
+		break;
+	case USBH_STATS_EVENT_RETRY:
+		stats->retries++;
+		break;
+	default:
+		break;
+	}
+}
+
+void usbh_stats_complete(void *lld_data, const usbh_packet_t *packet, bool in, uint16_t length, uint32_t latency_us)
+{
+	usbh_transfer_stats_t *stats = stats_find(lld_data, packet, in);
+	if (!stats) {
+		return;
+	}
+
+	stats->transfers++;
+	stats->bytes += length;
+
+	uint32_t bucket = 0;
+	while (bucket < USBH_STATS_LATENCY_BUCKETS - 1 && latency_us >= (125UL << bucket)) {
+		bucket++;
+	}
+	stats->latency[bucket]++;
+}
+
+static void stats_add(usbh_transfer_stats_t *sum, const usbh_transfer_stats_t *stats)
+{
+	sum->transfers += stats->transfers;
+	sum->bytes += stats->bytes;
+	sum->naks += stats->naks;
+	sum->txerr += stats->txerr;
+	sum->bberr += stats->bberr;
+	sum->stalls += stats->stalls;
+	sum->dterr += stats->dterr;
+	sum->retries += stats->retries;
+
+	uint32_t i;
+	for (i = 0; i < USBH_STATS_LATENCY_BUCKETS; i++) {
+		sum->latency[i] += stats->latency[i];
+	}
+}
+
+bool usbh_stats_get(const usbh_low_level_driver_t *lld, uint8_t address, uint8_t endpoint_address, usbh_transfer_stats_t *stats)
+{
+	const usbh_generic_data_t *lld_data = lld->driver_data;
+	bool found = false;
+
+	memset(stats, 0, sizeof(*stats));
+	uint32_t i;
+	for (i = 0; i < USBH_STATS_ENDPOINTS; i++) {
+		const usbh_endpoint_stats_t *entry = &lld_data->stats[i];
+		if (entry->address != address) {
+			continue;
+		}
+		if (endpoint_address == USBH_STATS_DEVICE || entry->endpoint_address == endpoint_address) {
+			stats_add(stats, &entry->stats);
+			found = true;
+		}
+	}
+	return found;
+}
+#else
+void usbh_stats_event(void *lld_data, const usbh_packet_t *packet, bool in, enum USBH_STATS_EVENT event)
+{
+	(void)lld_data;
+	(void)packet;
+	(void)in;
+	(void)event;
+}
+
+void usbh_stats_complete(void *lld_data, const usbh_packet_t *packet, bool in, uint16_t length, uint32_t latency_us)
+{
+	(void)lld_data;
+	(void)packet;
+	(void)in;
+	(void)length;
+	(void)latency_us;
 }
 
+bool usbh_stats_get(const usbh_low_level_driver_t *lld, uint8_t address, uint8_t endpoint_address, usbh_transfer_stats_t *stats)
+{
+	(void)lld;
+	(void)address;
+	(void)endpoint_address;
+	memset(stats, 0, sizeof(*stats));
+	return false;
+}
+#endif
@@ -152,9 +152,9 @@ static void midi_in_message(midi_device_t *midi, const uint8_t datalen)
 	}
 }
 
-static void event(usbh_device_t *dev, usbh_packet_callback_data_t status)
+static void event(void *drvdata, usbh_packet_callback_data_t status)
 {
-	midi_device_t *midi = (midi_device_t *)dev->drvdata;
+	midi_device_t *midi = drvdata;
 	switch (midi->state) {
 	case 26:
 		{
@@ -204,7 +204,7 @@ static void read_midi_in(void *drvdata, const uint8_t nextstate)
 	packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
 	packet.speed = midi->usbh_device->speed;
 	packet.callback = event;
-	packet.callback_arg = midi->usbh_device;
+	packet.callback_arg = midi;
 	packet.toggle = &midi->endpoint_in_toggle;
 
 	midi->state = nextstate;
@@ -226,21 +226,28 @@ static void poll(void *drvdata, uint32_t t_us)
 	/// case 100, 101, 102 cares for ignoring those data
 	case 100:
 		{
-			midi->time_us_config = t_us;
+			usbh_timer_start(&midi->timer_config, MIDI_INITIAL_DELAY, NULL, NULL);
 			midi->state = 101;
+			usbh_poll_request(t_us);
 		}
 		break;
 
 	case 101:
 		{
-			read_midi_in(drvdata, 102);
+			// reads may complete faster than the poll period
+			if (!usbh_timer_pending(&midi->timer_config)) {
+				midi->state = 25;
+				usbh_poll_request(t_us);
+			} else {
+				read_midi_in(drvdata, 102);
+			}
 		}
 		break;
 
 	case 102:
 		{
 			// if elapsed MIDI initial delay microseconds
-			if (t_us - midi->time_us_config > MIDI_INITIAL_DELAY) {
+			if (!usbh_timer_pending(&midi->timer_config)) {
 				midi->state = 26;
 			}
 		}
@@ -263,16 +270,17 @@ static void poll(void *drvdata, uint32_t t_us)
 			if (midi_config->notify_connected) {
 				midi_config->notify_connected(midi->device_id);
 			}
+			usbh_poll_request(t_us);
 		}
 		break;
 	}
 }
 
 // don't call directly
-static void write_callback(usbh_device_t *dev, usbh_packet_callback_data_t status)
+static void write_callback(void *drvdata, usbh_packet_callback_data_t status)
 {
 	(void)status;
-	midi_device_t *midi = (midi_device_t *)dev->drvdata;
+	midi_device_t *midi = drvdata;
 
 	if (midi->sending) {
 		midi->sending = false;
@@ -324,7 +332,7 @@ void usbh_midi_write(uint8_t device_id, const void *data, uint32_t length, midi_
 	midi->write_packet.endpoint_type = USBH_ENDPOINT_TYPE_BULK;
 	midi->write_packet.speed = dev->speed;
 	midi->write_packet.callback = write_callback;
-	midi->write_packet.callback_arg = midi->usbh_device;
+	midi->write_packet.callback_arg = midi;
 	midi->write_packet.toggle = &midi->endpoint_out_toggle;
 
 
@@ -339,6 +347,7 @@ static void remove(void *drvdata)
 		midi_config->notify_disconnected(midi->device_id);
 	}
 
+	usbh_timer_stop(&midi->timer_config);
 	midi->state = 0;
 	midi->endpoint_in_address = 0;
 	midi->endpoint_out_address = 0;
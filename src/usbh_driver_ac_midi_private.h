@@ -45,8 +45,8 @@ struct _midi_device {
 	bool sending;
 	midi_write_callback_t write_callback_user;
 	usbh_packet_t write_packet;
-	// Timestamp at sending config command
-	uint32_t time_us_config;
+	// Armed at sending config command, data are ignored until it expires
+	usbh_timer_t timer_config;
 };
 typedef struct _midi_device midi_device_t;
 #endif
@@ -42,6 +42,7 @@ struct _gp_xbox_device {
 	uint8_t buffer[USBH_GP_XBOX_BUFFER];
 	uint16_t endpoint_in_maxpacketsize;
 	uint8_t endpoint_in_address;
+	uint8_t endpoint_in_interval;
 	enum STATES state_next;
 	uint8_t endpoint_in_toggle;
 	uint8_t device_id;
@@ -122,6 +123,7 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 				uint8_t epaddr = ep->bEndpointAddress;
 				if (epaddr & (1<<7)) {
 					gp_xbox->endpoint_in_address = epaddr&0x7f;
+					gp_xbox->endpoint_in_interval = ep->bInterval;
 					if (ep->wMaxPacketSize < USBH_GP_XBOX_BUFFER) {
 						gp_xbox->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
 					} else {
@@ -143,9 +145,8 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	return false;
 }
 
-static void parse_data(usbh_device_t *dev)
+static void parse_data(gp_xbox_device_t *gp_xbox)
 {
-	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)dev->drvdata;
 
 	uint8_t *packet = gp_xbox->buffer;
 
@@ -238,21 +239,21 @@ static void parse_data(usbh_device_t *dev)
 	}
 }
 
-static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+static void event(void *drvdata, usbh_packet_callback_data_t cb_data)
 {
-	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)dev->drvdata;
+	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)drvdata;
 	switch (gp_xbox->state_next) {
 	case STATE_READING_COMPLETE:
 		{
 			switch (cb_data.status) {
 			case USBH_PACKET_CALLBACK_STATUS_OK:
-				parse_data(dev);
+				parse_data(gp_xbox);
 				gp_xbox->state_next = STATE_READING_REQUEST;
 				break;
 
 			case USBH_PACKET_CALLBACK_STATUS_ERRSIZ:
 				if (cb_data.transferred_length == GP_XBOX_CORRECT_TRANSFERRED_LENGTH) {
-					parse_data(dev);
+					parse_data(gp_xbox);
 				}
 				gp_xbox->state_next = STATE_READING_REQUEST;
 				break;
@@ -288,10 +289,11 @@ static void read_gp_xbox_in(gp_xbox_device_t *gp_xbox)
 	packet.datalen = gp_xbox->endpoint_in_maxpacketsize;
 	packet.endpoint_address = gp_xbox->endpoint_in_address;
 	packet.endpoint_size_max = gp_xbox->endpoint_in_maxpacketsize;
+	packet.interval = gp_xbox->endpoint_in_interval;
 	packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
 	packet.speed = gp_xbox->usbh_device->speed;
 	packet.callback = event;
-	packet.callback_arg = gp_xbox->usbh_device;
+	packet.callback_arg = gp_xbox;
 	packet.toggle = &gp_xbox->endpoint_in_toggle;
 
 	gp_xbox->state_next = STATE_READING_COMPLETE;
@@ -306,8 +308,6 @@ static void read_gp_xbox_in(gp_xbox_device_t *gp_xbox)
  */
 static void poll(void *drvdata, uint32_t time_curr_us)
 {
-	(void)time_curr_us;
-
 	gp_xbox_device_t *gp_xbox = (gp_xbox_device_t *)drvdata;
 
 	switch (gp_xbox->state_next) {
@@ -325,6 +325,7 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 			if (gp_xbox_config->notify_connected) {
 				gp_xbox_config->notify_connected(gp_xbox->device_id);
 			}
+			usbh_poll_request(time_curr_us);
 		}
 		break;
 
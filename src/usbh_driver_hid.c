@@ -55,6 +55,7 @@ struct _hid_device {
 	uint8_t buffer[USBH_HID_BUFFER];
 	uint16_t endpoint_in_maxpacketsize;
 	uint8_t endpoint_in_address;
+	uint8_t endpoint_in_interval;
 	enum STATES state_next;
 	uint8_t endpoint_in_toggle;
 	uint8_t device_id;
@@ -63,6 +64,9 @@ struct _hid_device {
 	enum REPORT_STATE report_state;
 	uint8_t report_data[USBH_HID_REPORT_BUFFER];
 	uint8_t report_data_length;
+	// value set while the previous report was in progress
+	uint8_t report_next;
+	bool report_next_pending;
 	enum HID_TYPE hid_type;
 	uint8_t interface_number;
 };
@@ -113,6 +117,7 @@ static void *init(usbh_device_t *usbh_dev)
 			drvdata->report0_length = 0;
 			drvdata->usbh_device = usbh_dev;
 			drvdata->report_state = REPORT_STATE_NULL;
+			drvdata->report_next_pending = false;
 			drvdata->hid_type = HID_TYPE_NONE;
 			break;
 		}
@@ -159,12 +164,11 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	case USB_DT_INTERFACE:
 		{
 			const struct usb_interface_descriptor *ifDesc = (const struct usb_interface_descriptor *)descriptor;
+			hid->interface_number = ifDesc->bInterfaceNumber;
 			if (ifDesc->bInterfaceProtocol == 0x01) {
 				hid->hid_type = HID_TYPE_KEYBOARD;
-				hid->interface_number = ifDesc->bInterfaceNumber;
 			} else if (ifDesc->bInterfaceProtocol == 0x02) {
 				hid->hid_type = HID_TYPE_MOUSE;
-				hid->interface_number = ifDesc->bInterfaceNumber;
 			}
 		}
 		break;
@@ -176,6 +180,7 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 				uint8_t epaddr = ep->bEndpointAddress;
 				if (epaddr & (1<<7)) {
 					hid->endpoint_in_address = epaddr&0x7f;
+					hid->endpoint_in_interval = ep->bInterval;
 					if (ep->wMaxPacketSize < USBH_HID_BUFFER) {
 						hid->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
 					} else {
@@ -207,17 +212,24 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	return false;
 }
 
-static void report_event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+static bool report_send(hid_device_t *hid, uint8_t val);
+
+static void report_event(void *drvdata, usbh_packet_callback_data_t cb_data)
 {
 	(void)cb_data;// UNUSED
 
-	hid_device_t *hid = (hid_device_t *)dev->drvdata;
+	hid_device_t *hid = (hid_device_t *)drvdata;
 	hid->report_state = REPORT_STATE_READY;
+
+	if (hid->report_next_pending) {
+		hid->report_next_pending = false;
+		report_send(hid, hid->report_next);
+	}
 }
 
-static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+static void event(void *drvdata, usbh_packet_callback_data_t cb_data)
 {
-	hid_device_t *hid = (hid_device_t *)dev->drvdata;
+	hid_device_t *hid = (hid_device_t *)drvdata;
 
 	switch (hid->state_next) {
 	case STATE_READING_COMPLETE_AND_CHECK_REPORT:
@@ -274,10 +286,11 @@ static void read_hid_in_endpoint(void *drvdata)
 	packet.datalen = hid->endpoint_in_maxpacketsize;
 	packet.endpoint_address = hid->endpoint_in_address;
 	packet.endpoint_size_max = hid->endpoint_in_maxpacketsize;
+	packet.interval = hid->endpoint_in_interval;
 	packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
 	packet.speed = hid->usbh_device->speed;
 	packet.callback = event;
-	packet.callback_arg = hid->usbh_device;
+	packet.callback_arg = hid;
 	packet.toggle = &hid->endpoint_in_toggle;
 
 	hid->state_next = STATE_READING_COMPLETE_AND_CHECK_REPORT;
@@ -291,8 +304,6 @@ static void read_hid_in_endpoint(void *drvdata)
  */
 static void poll(void *drvdata, uint32_t time_curr_us)
 {
-	(void)time_curr_us;
-
 	hid_device_t *hid = (hid_device_t *)drvdata;
 	usbh_device_t *dev = hid->usbh_device;
 	switch (hid->state_next) {
@@ -317,11 +328,16 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 			setup_data.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_INTERFACE;
 			setup_data.bRequest = USB_REQ_GET_DESCRIPTOR;
 			setup_data.wValue = USB_DT_REPORT << 8;
-			setup_data.wIndex = 0;
+			setup_data.wIndex = hid->interface_number;
 			setup_data.wLength = hid->report0_length;
 
+			// control queue may be filled by the other interface of the composite device,
+			// retry in the next poll then
 			hid->state_next = STATE_GET_REPORT_DESCRIPTOR_READ_COMPLETE;
-			device_control(dev, event, &setup_data, hid->buffer);
+			if (!device_control(dev, event, hid, &setup_data, hid->buffer)) {
+				hid->state_next = STATE_GET_REPORT_DESCRIPTOR_READ_SETUP;
+				usbh_poll_request(time_curr_us + 1000);
+			}
 		}
 		break;
 
@@ -346,9 +362,15 @@ bool hid_set_report(uint8_t device_id, uint8_t val)
 	}
 
 	hid_device_t *hid = &hid_device[device_id];
+	if (hid->report_state == REPORT_STATE_PENDING) {
+		// store and update afterwards, only the last value is kept
+		hid->report_next = val;
+		hid->report_next_pending = true;
+		return true;
+	}
+
 	if (hid->report_state != REPORT_STATE_READY) {
 		LOG_PRINTF("reporting is not ready\n");
-		// store and update afterwards
 		return false;
 	}
 
@@ -357,6 +379,11 @@ bool hid_set_report(uint8_t device_id, uint8_t val)
 		return false;
 	}
 
+	return report_send(hid, val);
+}
+
+static bool report_send(hid_device_t *hid, uint8_t val)
+{
 	struct usb_setup_data setup_data;
 	setup_data.bmRequestType = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
 	setup_data.bRequest = USB_HID_SET_REPORT;
@@ -367,7 +394,10 @@ bool hid_set_report(uint8_t device_id, uint8_t val)
 	hid->report_data[0] = val;
 
 	hid->report_state = REPORT_STATE_PENDING;
-	device_control(hid->usbh_device, report_event, &setup_data, &hid->report_data);
+	if (!device_control(hid->usbh_device, report_event, hid, &setup_data, &hid->report_data)) {
+		hid->report_state = REPORT_STATE_READY;
+		return false;
+	}
 	return true;
 }
 
@@ -92,6 +92,7 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 				uint8_t epaddr = ep->bEndpointAddress;
 				if (epaddr & (1<<7)) {
 					hub->endpoint_in_address = epaddr&0x7f;
+					hub->endpoint_in_interval = ep->bInterval;
 					hub->endpoint_in_maxpacketsize = ep->wMaxPacketSize;
 				}
 			}
@@ -125,10 +126,36 @@ static bool analyze_descriptor(void *drvdata, void *descriptor)
 	return false;
 }
 
+/**
+ * Port has been reset and settled, enumerate the new device
+ */
+static void port_sleep_done(void *drvdata)
+{
+	hub_device_t *hub = (hub_device_t *)drvdata;
+	int8_t port = hub->current_port;
+	LOG_PRINTF("PORT: %d\n", port);
+	LOG_PRINTF("NEW device at address: %d\n", hub->device[port]->address);
+	hub->device[port]->lld = hub->device[0]->lld;
+
+	device_enumeration_start(hub->device[port]);
+	hub->current_port = CURRENT_PORT_NONE;
+
+	// Maybe error, when assigning address is taking too long
+	//
+	// Detail:
+	// USB hub cannot enable another port while the device
+	// the current one is also in address state (has address==0)
+	// Only one device on bus can have address==0
+	hub->busy = 0;
+
+	hub->state = EVENT_STATE_POLL_REQ;
+}
+
 // Enumerate
-static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
+static void event(void *drvdata, usbh_packet_callback_data_t cb_data)
 {
-	hub_device_t *hub = (hub_device_t *)dev->drvdata;
+	hub_device_t *hub = (hub_device_t *)drvdata;
+	usbh_device_t *dev = hub->device[0];
 
 	LOG_PRINTF("\nHUB->STATE = %d\n", hub->state);
 	switch (hub->state) {
@@ -183,7 +210,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 				hub->current_port = port;
 				LOG_PRINTF("\n\nPORT FOUND: %d\n", port);
-				device_control(dev, event, &setup_data, &hub->hub_and_port_status[port]);
+				device_control(dev, event, hub, &setup_data, &hub->hub_and_port_status[port]);
 			}
 			break;
 
@@ -194,7 +221,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 		case USBH_PACKET_CALLBACK_STATUS_EAGAIN:
 
-			// In case of EAGAIN error, retry read on status endpoint
+			// In case of EAGAIN error (retries of the core exhausted), read status endpoint again
 			hub->state = EVENT_STATE_POLL_REQ;
 			LOG_PRINTF("HUB: Retrying...\n");
 			break;
@@ -221,7 +248,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 						setup_data.wLength = hub->desc_len;
 
 						hub->state = EVENT_STATE_READ_HUB_DESCRIPTOR_COMPLETE;
-						device_control(dev, event, &setup_data, hub->buffer);
+						device_control(dev, event, hub, &setup_data, hub->buffer);
 						break;
 					} else if (hub_descriptor->head.bDescLength == hub->desc_len) {
 						hub->ports_num = hub_descriptor->head.bNbrPorts;
@@ -229,7 +256,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 						hub->state = EVENT_STATE_ENABLE_PORTS;
 						hub->index = 0;
 						cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
-						event(dev, cb_data);
+						event(hub, cb_data);
 					} else {
 						//try again
 					}
@@ -255,7 +282,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							hub->index = 0;
 
 							cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
-							event(dev, cb_data);
+							event(hub, cb_data);
 						}
 					}
 				}
@@ -283,7 +310,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 					setup_data.wIndex = hub->index;
 					setup_data.wLength = 0;
 
-					device_control(dev, event, &setup_data, 0);
+					device_control(dev, event, hub, &setup_data, 0);
 				} else {
 					// TODO:
 					// Delay Based on hub descriptor field bPwr2PwrGood
@@ -302,7 +329,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 					hub->state = EVENT_STATE_GET_PORT_STATUS;
 					hub->index = 0;
-					device_control(dev, event, &setup_data, hub->buffer);
+					device_control(dev, event, hub, &setup_data, hub->buffer);
 				}
 				break;
 
@@ -330,7 +357,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 						setup_data.wLength = 4;
 
 						hub->state = EVENT_STATE_GET_PORT_STATUS;
-						device_control(dev, event, &setup_data, hub->buffer);
+						device_control(dev, event, hub, &setup_data, hub->buffer);
 					} else {
 						hub->busy = 0;
 						hub->state = EVENT_STATE_POLL_REQ;
@@ -364,8 +391,8 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 
 							// Check, whether device is in connected state
 							if (!hub->device[port]) {
-								if (!usbh_enum_available() || hub->busy) {
-									LOG_PRINTF("\n\t\t\tCannot enumerate %d %d\n", !usbh_enum_available(), hub->busy);
+								if (!usbh_enum_available(dev) || hub->busy) {
+									LOG_PRINTF("\n\t\t\tCannot enumerate %d %d\n", !usbh_enum_available(dev), hub->busy);
 									hub->state = EVENT_STATE_POLL_REQ;
 									break;
 								}
@@ -381,7 +408,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							setup_data.wLength = 0;
 
 							hub->state = EVENT_STATE_PORT_RESET_REQ;
-							device_control(dev, event, &setup_data, 0);
+							device_control(dev, event, hub, &setup_data, 0);
 
 						} else if(stc & (1<<HUB_FEATURE_PORT_RESET)) {
 							// clear feature C_PORT_RESET
@@ -397,7 +424,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							hub->state = EVENT_STATE_PORT_RESET_COMPLETE;
 
 							LOG_PRINTF("RESET");
-							device_control(dev, event, &setup_data, 0);
+							device_control(dev, event, hub, &setup_data, 0);
 						} else {
 							LOG_PRINTF("another STC %d\n", stc);
 						}
@@ -438,7 +465,7 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							LOG_PRINTF("CONN");
 
 							hub->busy = 1;
-							device_control(dev, event, &setup_data, 0);
+							device_control(dev, event, hub, &setup_data, 0);
 						}
 					} else {
 						LOG_PRINTF("\t\t\t\tDISCONNECT EVENT\n");
@@ -497,19 +524,19 @@ static void event(usbh_device_t *dev, usbh_packet_callback_data_t cb_data)
 							hub->state = EVENT_STATE_GET_PORT_STATUS;
 
 							hub->current_port = CURRENT_PORT_NONE;
-							device_control(dev, event, &setup_data, 0);
+							device_control(dev, event, hub, &setup_data, 0);
 #else
 							hub->device[port]->speed = USBH_SPEED_LOW;
 							LOG_PRINTF("Low speed device");
-							hub->timestamp_us = hub->time_curr_us;
 							hub->state = EVENT_STATE_SLEEP_500_MS; // schedule wait for 500ms
+							usbh_timer_start(&hub->timer, 500000, port_sleep_done, hub);
 #endif
 						} else if (!(sts & (1<<(HUB_FEATURE_PORT_LOWSPEED))) &&
 							!(sts & (1<<(HUB_FEATURE_PORT_HIGHSPEED)))) {
 							hub->device[port]->speed = USBH_SPEED_FULL;
 							LOG_PRINTF("Full speed device");
-							hub->timestamp_us = hub->time_curr_us;
 							hub->state = EVENT_STATE_SLEEP_500_MS; // schedule wait for 500ms
+							usbh_timer_start(&hub->timer, 500000, port_sleep_done, hub);
 						}
 
 
@@ -545,10 +572,11 @@ static void read_ep1(void *drvdata)
 	packet.datalen = hub->endpoint_in_maxpacketsize;
 	packet.endpoint_address = hub->endpoint_in_address;
 	packet.endpoint_size_max = hub->endpoint_in_maxpacketsize;
+	packet.interval = hub->endpoint_in_interval;
 	packet.endpoint_type = USBH_ENDPOINT_TYPE_INTERRUPT;
 	packet.speed = hub->device[0]->speed;
 	packet.callback = event;
-	packet.callback_arg = hub->device[0];
+	packet.callback_arg = hub;
 	packet.toggle = &hub->endpoint_in_toggle;
 
 	hub->state = EVENT_STATE_POLL;
@@ -567,12 +595,10 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 	hub_device_t *hub = (hub_device_t *)drvdata;
 	usbh_device_t *dev = hub->device[0];
 
-	hub->time_curr_us = time_curr_us;
-
 	switch (hub->state) {
 	case EVENT_STATE_POLL_REQ:
 		{
-			if (usbh_enum_available()) {
+			if (usbh_enum_available(dev)) {
 				read_ep1(hub);
 			} else {
 				LOG_PRINTF("enum not available\n");
@@ -586,7 +612,7 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 				hub->index = 0;
 				hub->state = EVENT_STATE_ENABLE_PORTS;
 				LOG_PRINTF("No need to get HUB DESC\n");
-				event(dev, (usbh_packet_callback_data_t){0, 0});
+				event(hub, (usbh_packet_callback_data_t){0, 0});
 			} else {
 				hub->endpoint_in_toggle = 0;
 
@@ -600,43 +626,37 @@ static void poll(void *drvdata, uint32_t time_curr_us)
 				setup_data.wLength = hub->desc_len;
 
 				hub->state = EVENT_STATE_READ_HUB_DESCRIPTOR_COMPLETE;
-				device_control(dev, event, &setup_data, hub->buffer);
+				device_control(dev, event, hub, &setup_data, hub->buffer);
 				LOG_PRINTF("DO Need to get HUB DESC\n");
 			}
 		}
 		break;
-	case EVENT_STATE_SLEEP_500_MS:
-		if (hub->time_curr_us - hub->timestamp_us > 500000) {
-			int8_t port = hub->current_port;
-			LOG_PRINTF("PORT: %d\n", port);
-			LOG_PRINTF("NEW device at address: %d\n", hub->device[port]->address);
-			hub->device[port]->lld = hub->device[0]->lld;
-
-			device_enumeration_start(hub->device[port]);
-			hub->current_port = CURRENT_PORT_NONE;
-
-			// Maybe error, when assigning address is taking too long
-			//
-			// Detail:
-			// USB hub cannot enable another port while the device
-			// the current one is also in address state (has address==0)
-			// Only one device on bus can have address==0
-			hub->busy = 0;
+	default:
+		break;
+	}
 
-			hub->state = EVENT_STATE_POLL_REQ;
-		}
+	switch (hub->state) {
+	case EVENT_STATE_POLL_REQ:
+		// enumeration of another device is in progress
+		usbh_poll_request(time_curr_us + 1000);
 		break;
+
 	default:
 		break;
 	}
 
-	if (usbh_enum_available()) {
-		uint32_t i;
+	uint32_t i;
+	for (i = 1; i < USBH_HUB_MAX_DEVICES + 1; i++) {
+		// enumeration has failed, the core has released the device slot
+		if (hub->device[i] && hub->device[i]->address < 0) {
+			hub->device[i] = 0;
+		}
+	}
+
+	if (usbh_enum_available(dev)) {
 		for (i = 1; i < USBH_HUB_MAX_DEVICES + 1; i++) {
 			if (hub->device[i]) {
-				if (hub->device[i]->drv && hub->device[i]->drvdata) {
-					hub->device[i]->drv->poll(hub->device[i]->drvdata, time_curr_us);
-				}
+				device_poll(hub->device[i], time_curr_us);
 			}
 		}
 	}
@@ -646,6 +666,7 @@ static void remove(void *drvdata)
 	hub_device_t *hub = (hub_device_t *)drvdata;
 	uint8_t i;
 
+	usbh_timer_stop(&hub->timer);
 	hub->state = EVENT_STATE_NONE;
 	hub->endpoint_in_address = 0;
 	hub->busy = 0;
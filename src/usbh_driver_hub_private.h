@@ -80,6 +80,7 @@ struct _hub_device {
 	uint8_t buffer[USBH_HUB_BUFFER_SIZE];
 	uint16_t endpoint_in_maxpacketsize;
 	uint8_t endpoint_in_address;
+	uint8_t endpoint_in_interval;
 	uint8_t endpoint_in_toggle;
 	enum EVENT_STATE state;
 
@@ -95,8 +96,8 @@ struct _hub_device {
 
 	bool busy;
 
-	uint32_t time_curr_us;
-	uint32_t timestamp_us;
+	/// wait of the port after reset, before the device is enumerated
+	usbh_timer_t timer;
 };
 
 typedef struct _hub_device hub_device_t;
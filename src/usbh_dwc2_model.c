@@ -0,0 +1,1186 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_dwc2_model.h"
+#include "usbh_lld_fifo.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <libopencm3/stm32/otg_fs.h>
+
+/* Channels and FIFO RAM (shared by the receive and both transmit FIFOs) of the OTG_FS
+ * and of the OTG_HS core. The model takes the sizes of the core whose registers are accessed. */
+#define NUM_CHANNELS_FS	(8)
+#define NUM_CHANNELS_HS	(12)
+#define FIFO_RAM_WORDS_FS	(320)
+#define FIFO_RAM_WORDS_HS	(1024)
+#define NUM_CHANNELS	(NUM_CHANNELS_HS)
+#define FIFO_RAM_WORDS	(FIFO_RAM_WORDS_HS)
+
+/* Entries of the non-periodic and of the periodic transmit request queue. */
+#define TX_QUEUE_DEPTH	(8)
+
+/* Registers below the FIFO windows. */
+#define REGS_WORDS	(OTG_FIFO(0) / 4)
+
+#define CONTROL_BUFFER_SIZE	(BUFFER_ONE_BYTES)
+
+/* Largest packet of the channel (MPSIZ). */
+#define PACKET_SIZE_MAX	(0x7ff)
+
+/* Bus address of the data handed to the DMA by usbh_dwc2_model_dma_addr(), low bits kept. */
+#define DMA_ADDR_BASE	(0x20000000)
+
+/* Device does not answer, the host sees the transmit error. */
+#define ANSWER_NONE	(-3)
+
+#define GRXSTSP_CHNUM_MASK	(0xf)
+#define GRXSTSP_BCNT_SHIFT	(4)
+#define GRXSTSP_BCNT_MASK	(0x7ff << GRXSTSP_BCNT_SHIFT)
+#define HCTSIZ_PKTCNT_SHIFT	(19)
+#define HCTSIZ_PKTCNT_MASK	(0x3ff << HCTSIZ_PKTCNT_SHIFT)
+#define HCCHAR_DAD_SHIFT	(22)
+#define HCCHAR_EPNUM_SHIFT	(11)
+#define HFNUM_FRNUM_MASK	(0xffff)
+
+/* Bits of HPRT cleared by writing one. */
+#define HPRT_W1C	(OTG_HPRT_PCDET | OTG_HPRT_PENCHNG | OTG_HPRT_POCCHNG)
+
+/* Bits of GRSTCTL cleared by the core once done, immediately in the model. */
+#define GRSTCTL_SELF_CLEAR	(OTG_GRSTCTL_CSRST | OTG_GRSTCTL_RXFFLSH | OTG_GRSTCTL_TXFFLSH)
+
+/* Bits of GINTSTS given by the state of the core, the others are latched. */
+#define GINTSTS_DERIVED	(OTG_GINTSTS_RXFLVL | OTG_GINTSTS_NPTXFE | OTG_GINTSTS_PTXFE | \
+		OTG_GINTSTS_HPRTINT | OTG_GINTSTS_HCINT)
+
+#define REG(offset)	(model.regs[(offset) / 4])
+
+struct _channel_model {
+	/// packets pushed into the transmit FIFO, each starts at a word boundary
+	uint8_t tx_data[FIFO_RAM_WORDS * 4];
+	uint16_t tx_fill;
+	uint16_t tx_length[TX_QUEUE_DEPTH];
+	uint8_t tx_packets;
+
+	/// IN_COMP entry of the channel is in the receive FIFO, transfer ends once it is popped
+	bool in_comp;
+
+	/// IN packet waits for the space in the receive FIFO
+	bool rx_wait;
+
+	/// OUT packet has been NAKed, the driver halts the channel
+	bool nak_stop;
+
+	/// NAKs answered before the transfer is accepted, @see usbh_lld_sim_device_t
+	uint32_t naks_left;
+
+	/// memory of the DMA transfer and bytes moved
+	uint8_t *dma_data;
+	uint32_t dma_index;
+
+	/// NAKed non-periodic DMA transfer, asked again in the next frame
+	bool dma_retry;
+
+	/// channel is disabled, it reports the halt at the next usbh_dwc2_model_run()
+	bool halt_pending;
+};
+typedef struct _channel_model channel_model_t;
+
+struct _dwc2_model {
+	uint32_t regs[REGS_WORDS];
+	channel_model_t channels[NUM_CHANNELS];
+
+	/// sizes of the accessed core
+	uint8_t num_channels;
+	uint16_t fifo_ram_words;
+
+	/// data of the last usbh_dwc2_model_dma_addr(), bound to the channel by the write of HCDMA
+	void *dma_pending;
+
+	uint32_t frame_time_us;
+	uint16_t frame;
+
+	/// receive FIFO, status words followed by the data words
+	uint32_t rx[FIFO_RAM_WORDS];
+	uint16_t rx_head;
+	uint16_t rx_count;
+
+	/// data words of the popped status, not read yet
+	uint16_t rx_data_left;
+	uint8_t rx_channel;
+
+	/// state of the attached device
+	const usbh_lld_sim_device_t *device;
+	int8_t address;
+	int8_t address_pending;
+	/// data PID (DATA1) expected by the OUT endpoints, indexed by the endpoint number
+	bool out_toggle[16];
+	struct usb_setup_data setup_data;
+	int32_t control_length;
+	uint32_t control_index;
+	uint8_t control_buffer[CONTROL_BUFFER_SIZE];
+
+	usbh_dwc2_model_stats_t stats;
+};
+typedef struct _dwc2_model dwc2_model_t;
+
+static dwc2_model_t model;
+
+/* FIFO window of the channel, the data pass through the copy routines of the driver. */
+static volatile uint32_t fifo_window[OTG_FIFO(1) / 4 - OTG_FIFO(0) / 4];
+
+/* Whole words of the packet are written by the DMA. */
+static uint8_t packet_buffer[(PACKET_SIZE_MAX + 3) & ~3];
+
+static void channel_transact(uint8_t channel, bool frame_start);
+
+/**
+ * @returns offset of the register in the core at the address, whose sizes the model takes
+ */
+static uint32_t core_offset(uint32_t addr)
+{
+	if (addr >= USB_OTG_FS_BASE) {
+		model.num_channels = NUM_CHANNELS_FS;
+		model.fifo_ram_words = FIFO_RAM_WORDS_FS;
+		return addr - USB_OTG_FS_BASE;
+	}
+	model.num_channels = NUM_CHANNELS_HS;
+	model.fifo_ram_words = FIFO_RAM_WORDS_HS;
+	return addr - USB_OTG_HS_BASE;
+}
+
+static bool dma_enabled(void)
+{
+	return REG(OTG_GAHBCFG) & OTG_GAHBCFG_DMAEN;
+}
+
+static bool channel_periodic(uint8_t channel)
+{
+	const uint32_t eptyp = REG(OTG_HCCHAR(channel)) & OTG_HCCHAR_EPTYP_MASK;
+	return eptyp == OTG_HCCHAR_EPTYP_INTERRUPT || eptyp == OTG_HCCHAR_EPTYP_ISOCHRONOUS;
+}
+
+static uint32_t rx_size(void)
+{
+	const uint32_t size = REG(OTG_GRXFSIZ) & 0xffff;
+	return size < model.fifo_ram_words ? size : model.fifo_ram_words;
+}
+
+static uint32_t rx_free(void)
+{
+	const uint32_t size = rx_size();
+	return model.rx_count < size ? size - model.rx_count : 0;
+}
+
+static void rx_push_word(uint32_t word)
+{
+	model.rx[(model.rx_head + model.rx_count) % FIFO_RAM_WORDS] = word;
+	model.rx_count++;
+}
+
+static uint32_t rx_pop_word(void)
+{
+	const uint32_t word = model.rx[model.rx_head];
+	model.rx_head = (model.rx_head + 1) % FIFO_RAM_WORDS;
+	model.rx_count--;
+	return word;
+}
+
+/**
+ * Queue the receive status and the data of the packet, caller checks the free space
+ */
+static void rx_push(uint8_t channel, uint32_t pktsts, const uint8_t *data, uint16_t length)
+{
+	if (rx_free() < 1 + (length + 3U) / 4) {
+		model.stats.errors++;
+		return;
+	}
+
+	rx_push_word(channel | (length << GRXSTSP_BCNT_SHIFT) | pktsts);
+	uint32_t i;
+	for (i = 0; i < length; i += 4) {
+		uint32_t word = 0;
+		uint32_t j;
+		for (j = 0; j < 4 && i + j < length; j++) {
+			word |= (uint32_t)data[i + j] << (8 * j);
+		}
+		rx_push_word(word);
+	}
+}
+
+/**
+ * Continue the IN transfers waiting for the space in the receive FIFO
+ */
+static void channels_rx_resume(void)
+{
+	uint8_t channel;
+	for (channel = 0; channel < model.num_channels; channel++) {
+		if (model.channels[channel].rx_wait) {
+			channel_transact(channel, false);
+		}
+	}
+}
+
+static uint32_t rx_status_pop(void)
+{
+	if (model.rx_data_left) {
+		// data of the previous packet must be read first
+		model.stats.errors++;
+		while (model.rx_data_left) {
+			rx_pop_word();
+			model.rx_data_left--;
+		}
+	}
+	if (!model.rx_count) {
+		return 0;
+	}
+
+	const uint32_t status = rx_pop_word();
+	const uint8_t channel = status & GRXSTSP_CHNUM_MASK;
+	model.rx_channel = channel;
+	model.rx_data_left = ((status & GRXSTSP_BCNT_MASK) >> GRXSTSP_BCNT_SHIFT) + 3;
+	model.rx_data_left /= 4;
+
+	if ((status & OTG_GRXSTSP_PKTSTS_MASK) == OTG_GRXSTSP_PKTSTS_IN_COMP &&
+		model.channels[channel].in_comp) {
+		model.channels[channel].in_comp = false;
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_XFRC;
+		REG(OTG_HCCHAR(channel)) &= ~OTG_HCCHAR_CHENA;
+	}
+
+	if (!model.rx_data_left) {
+		channels_rx_resume();
+	}
+	return status;
+}
+
+static uint32_t rx_data_pop(void)
+{
+	if (!model.rx_data_left) {
+		model.stats.errors++;
+		return 0;
+	}
+
+	const uint32_t word = rx_pop_word();
+	model.rx_data_left--;
+	if (!model.rx_data_left) {
+		channels_rx_resume();
+	}
+	return word;
+}
+
+static void rx_flush(void)
+{
+	model.rx_head = 0;
+	model.rx_count = 0;
+	model.rx_data_left = 0;
+}
+
+static void tx_drop(uint8_t channel)
+{
+	channel_model_t *ch = &model.channels[channel];
+	ch->tx_fill = 0;
+	ch->tx_packets = 0;
+}
+
+static void tx_pop(uint8_t channel)
+{
+	channel_model_t *ch = &model.channels[channel];
+	const uint16_t bytes = (ch->tx_length[0] + 3) & ~3;
+
+	memmove(ch->tx_data, &ch->tx_data[bytes], ch->tx_fill - bytes);
+	memmove(ch->tx_length, &ch->tx_length[1], (ch->tx_packets - 1) * sizeof(ch->tx_length[0]));
+	ch->tx_fill -= bytes;
+	ch->tx_packets--;
+}
+
+/**
+ * @returns GNPTXSTS or HPTXSTS, free words of the transmit FIFO and of its request queue
+ */
+static uint32_t txsts(bool periodic)
+{
+	const uint32_t depth = (periodic ? REG(OTG_HPTXFSIZ) : REG(OTG_GNPTXFSIZ)) >> 16;
+	uint32_t words = 0;
+	uint32_t packets = 0;
+	uint8_t channel;
+
+	for (channel = 0; channel < model.num_channels; channel++) {
+		if (channel_periodic(channel) == periodic) {
+			words += model.channels[channel].tx_fill / 4;
+			packets += model.channels[channel].tx_packets;
+		}
+	}
+
+	const uint32_t fsav = words < depth ? depth - words : 0;
+	const uint32_t qsav = packets < TX_QUEUE_DEPTH ? TX_QUEUE_DEPTH - packets : 0;
+	return fsav | (qsav << 16);
+}
+
+/**
+ * FIFOs must follow each other in the FIFO RAM, as usbh_lld_stm32f4 programs them
+ */
+static void fifo_sizes_check(void)
+{
+	const uint32_t rx = REG(OTG_GRXFSIZ) & 0xffff;
+	const uint32_t tx_np = REG(OTG_GNPTXFSIZ) >> 16;
+	const uint32_t tx_p = REG(OTG_HPTXFSIZ) >> 16;
+
+	if ((REG(OTG_GNPTXFSIZ) & 0xffff) != rx ||
+		(REG(OTG_HPTXFSIZ) & 0xffff) != rx + tx_np ||
+		rx + tx_np + tx_p > model.fifo_ram_words) {
+		model.stats.errors++;
+	}
+}
+
+static uint32_t haint(void)
+{
+	uint32_t haint = 0;
+	uint8_t channel;
+
+	for (channel = 0; channel < model.num_channels; channel++) {
+		if (REG(OTG_HCINT(channel)) & REG(OTG_HCINTMSK(channel))) {
+			haint |= 1 << channel;
+		}
+	}
+	return haint;
+}
+
+static uint32_t gintsts(void)
+{
+	uint32_t gintsts = REG(OTG_GINTSTS) & ~GINTSTS_DERIVED;
+
+	if (model.rx_count && !model.rx_data_left) {
+		gintsts |= OTG_GINTSTS_RXFLVL;
+	}
+	if ((txsts(false) & 0xffff) == REG(OTG_GNPTXFSIZ) >> 16) {
+		gintsts |= OTG_GINTSTS_NPTXFE;
+	}
+	if ((txsts(true) & 0xffff) == REG(OTG_HPTXFSIZ) >> 16) {
+		gintsts |= OTG_GINTSTS_PTXFE;
+	}
+	if (REG(OTG_HPRT) & HPRT_W1C) {
+		gintsts |= OTG_GINTSTS_HPRTINT;
+	}
+	if (haint() & REG(OTG_HAINTMSK)) {
+		gintsts |= OTG_GINTSTS_HCINT;
+	}
+	return gintsts;
+}
+
+static void device_reset(void)
+{
+	model.address = 0;
+	model.address_pending = -1;
+	memset(model.out_toggle, 0, sizeof(model.out_toggle));
+	model.control_length = USBH_LLD_SIM_STALL;
+	model.control_index = 0;
+}
+
+static uint32_t port_speed(void)
+{
+	if (model.device->speed == USBH_SPEED_LOW) {
+		return OTG_HPRT_PSPD_LOW;
+	}
+	// high speed devices fall back to full speed on the OTG_FS core
+	return OTG_HPRT_PSPD_FULL;
+}
+
+/**
+ * Report the attached device once the port is powered
+ */
+static void port_connect(void)
+{
+	uint32_t hprt = REG(OTG_HPRT);
+	if (model.device && (hprt & OTG_HPRT_PPWR) && !(hprt & OTG_HPRT_PCSTS)) {
+		hprt &= ~OTG_HPRT_PSPD_MASK;
+		REG(OTG_HPRT) = hprt | OTG_HPRT_PCSTS | OTG_HPRT_PCDET | port_speed();
+	}
+}
+
+static void hprt_write(uint32_t value)
+{
+	uint32_t hprt = REG(OTG_HPRT);
+	const bool reset_end = (hprt & OTG_HPRT_PRST) && !(value & OTG_HPRT_PRST);
+
+	hprt &= ~(value & HPRT_W1C);
+	if (value & OTG_HPRT_PENA) {
+		// port is disabled by writing one to PENA
+		hprt &= ~OTG_HPRT_PENA;
+	}
+	hprt = (hprt & ~(OTG_HPRT_PRST | OTG_HPRT_PPWR)) | (value & (OTG_HPRT_PRST | OTG_HPRT_PPWR));
+
+	if (value & OTG_HPRT_PRST) {
+		hprt &= ~OTG_HPRT_PENA;
+		device_reset();
+	} else if (reset_end && (hprt & OTG_HPRT_PCSTS)) {
+		hprt |= OTG_HPRT_PENA | OTG_HPRT_PENCHNG;
+	}
+	REG(OTG_HPRT) = hprt;
+	port_connect();
+}
+
+/**
+ * Disable the channel, the core halts it after the current transaction, not within the write
+ */
+static void channel_halt(uint8_t channel, uint32_t hcchar)
+{
+	channel_model_t *ch = &model.channels[channel];
+
+	REG(OTG_HCCHAR(channel)) = hcchar & ~(OTG_HCCHAR_CHENA | OTG_HCCHAR_CHDIS);
+	tx_drop(channel);
+	ch->in_comp = false;
+	ch->rx_wait = false;
+	ch->nak_stop = false;
+	ch->dma_retry = false;
+	ch->halt_pending = true;
+}
+
+/**
+ * Report the halt of the channels disabled since the last run
+ */
+static void channels_halt_done(void)
+{
+	uint8_t channel;
+	for (channel = 0; channel < model.num_channels; channel++) {
+		channel_model_t *ch = &model.channels[channel];
+		if (!ch->halt_pending) {
+			continue;
+		}
+		ch->halt_pending = false;
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_CHH;
+		if ((REG(OTG_HCCHAR(channel)) & OTG_HCCHAR_EPDIR_IN) && !dma_enabled() && rx_free()) {
+			rx_push(channel, OTG_GRXSTSP_PKTSTS_CHH, NULL, 0);
+		}
+	}
+}
+
+static void hcchar_write(uint8_t channel, uint32_t value)
+{
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+
+	if (value & OTG_HCCHAR_CHDIS) {
+		if (hcchar & OTG_HCCHAR_CHENA) {
+			channel_halt(channel, value);
+		} else {
+			REG(OTG_HCCHAR(channel)) = value & ~(OTG_HCCHAR_CHENA | OTG_HCCHAR_CHDIS);
+		}
+		return;
+	}
+
+	REG(OTG_HCCHAR(channel)) = value;
+	if (value & OTG_HCCHAR_CHENA) {
+		model.channels[channel].nak_stop = false;
+		channel_transact(channel, false);
+	}
+}
+
+static void core_reset(void)
+{
+	const uint32_t hprt = REG(OTG_HPRT);
+
+	memset(model.regs, 0, sizeof(model.regs));
+	memset(model.channels, 0, sizeof(model.channels));
+	rx_flush();
+
+	// the root port keeps its state
+	REG(OTG_HPRT) = hprt;
+}
+
+/**
+ * Standard requests are answered by the model, the rest by the handler of the device
+ *
+ * @returns length of the IN data stage, 0, or USBH_LLD_SIM_STALL
+ */
+static int32_t control_setup(void)
+{
+	const usbh_lld_sim_device_t *device = model.device;
+	const struct usb_setup_data *setup_data = &model.setup_data;
+	int32_t length = USBH_LLD_SIM_STALL;
+
+	if ((setup_data->bmRequestType & 0x60) == USB_REQ_TYPE_STANDARD) {
+		switch (setup_data->bRequest) {
+		case USB_REQ_SET_ADDRESS:
+			// new address is valid after the status stage
+			model.address_pending = setup_data->wValue & 0x7f;
+			return 0;
+
+		case USB_REQ_SET_CONFIGURATION:
+			memset(model.out_toggle, 0, sizeof(model.out_toggle));
+			return 0;
+
+		case USB_REQ_GET_DESCRIPTOR:
+			switch (setup_data->wValue >> 8) {
+			case USB_DT_DEVICE:
+				length = USB_DT_DEVICE_SIZE;
+				memcpy(model.control_buffer, device->device_descriptor, length);
+				break;
+
+			case USB_DT_CONFIGURATION:
+				{
+					const struct usb_config_descriptor *cdt =
+						(const struct usb_config_descriptor *)device->config_descriptor;
+					length = cdt->wTotalLength;
+					if (length > CONTROL_BUFFER_SIZE) {
+						length = CONTROL_BUFFER_SIZE;
+					}
+					memcpy(model.control_buffer, device->config_descriptor, length);
+				}
+				break;
+
+			default:
+				break;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (length == USBH_LLD_SIM_STALL && device->control) {
+		if (setup_data->bmRequestType & USB_REQ_TYPE_IN) {
+			length = device->control(device->arg, setup_data, model.control_buffer);
+		} else {
+			// OUT requests are passed to the handler after the data stage
+			length = setup_data->wLength;
+		}
+	}
+
+	if (length > setup_data->wLength) {
+		length = setup_data->wLength;
+	}
+	return length;
+}
+
+/**
+ * Answer of the device to the IN token
+ *
+ * @returns count of bytes, USBH_LLD_SIM_NAK, USBH_LLD_SIM_STALL or ANSWER_NONE
+ */
+static int32_t device_in(uint8_t channel, uint8_t *data, uint16_t length)
+{
+	const usbh_lld_sim_device_t *device = model.device;
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+	channel_model_t *ch = &model.channels[channel];
+
+	if ((hcchar & OTG_HCCHAR_EPTYP_MASK) != OTG_HCCHAR_EPTYP_CONTROL) {
+		if (ch->naks_left) {
+			ch->naks_left--;
+			return USBH_LLD_SIM_NAK;
+		}
+		if (!device->in) {
+			return USBH_LLD_SIM_STALL;
+		}
+		return device->in(device->arg, (hcchar & OTG_HCCHAR_EPNUM_MASK) >> HCCHAR_EPNUM_SHIFT,
+			data, length);
+	}
+
+	if (model.control_length == USBH_LLD_SIM_STALL) {
+		return USBH_LLD_SIM_STALL;
+	}
+
+	if (!(model.setup_data.bmRequestType & USB_REQ_TYPE_IN)) {
+		// status stage of OUT request
+		if (model.address_pending >= 0) {
+			model.address = model.address_pending;
+			model.address_pending = -1;
+		}
+		return 0;
+	}
+
+	uint32_t left = model.control_length - model.control_index;
+	if (left > length) {
+		left = length;
+	}
+	if (left > device->device_descriptor[7]) {
+		left = device->device_descriptor[7];
+	}
+	memcpy(data, &model.control_buffer[model.control_index], left);
+	model.control_index += left;
+	return left;
+}
+
+/**
+ * Answer of the device to the OUT or SETUP packet
+ *
+ * @returns count of bytes, USBH_LLD_SIM_NAK, USBH_LLD_SIM_STALL or ANSWER_NONE
+ */
+static int32_t device_out(uint8_t channel, const uint8_t *data, uint16_t length, bool setup)
+{
+	const usbh_lld_sim_device_t *device = model.device;
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+	channel_model_t *ch = &model.channels[channel];
+
+	if ((hcchar & OTG_HCCHAR_EPTYP_MASK) != OTG_HCCHAR_EPTYP_CONTROL) {
+		if (ch->naks_left) {
+			ch->naks_left--;
+			return USBH_LLD_SIM_NAK;
+		}
+		if (!device->out) {
+			return USBH_LLD_SIM_STALL;
+		}
+		const uint8_t epnum = (hcchar & OTG_HCCHAR_EPNUM_MASK) >> HCCHAR_EPNUM_SHIFT;
+		const bool data1 = (REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_DPID_MASK) == OTG_HCTSIZ_DPID_DATA1;
+		if (data1 != model.out_toggle[epnum]) {
+			// taken for the retransmission of the previous packet, acknowledged and dropped
+			model.stats.errors++;
+			return length;
+		}
+		const int32_t answer = device->out(device->arg, epnum, data, length);
+		if (answer >= 0) {
+			model.out_toggle[epnum] = !data1;
+		}
+		return answer;
+	}
+
+	if (setup) {
+		if (length != sizeof(model.setup_data)) {
+			return ANSWER_NONE;
+		}
+		memcpy(&model.setup_data, data, sizeof(model.setup_data));
+		model.control_index = 0;
+		model.control_length = control_setup();
+		return length;
+	}
+
+	if (model.control_length == USBH_LLD_SIM_STALL) {
+		return USBH_LLD_SIM_STALL;
+	}
+
+	if (model.setup_data.bmRequestType & USB_REQ_TYPE_IN) {
+		// status stage of IN request
+		return 0;
+	}
+
+	if (model.control_index + length > CONTROL_BUFFER_SIZE) {
+		return USBH_LLD_SIM_STALL;
+	}
+	memcpy(&model.control_buffer[model.control_index], data, length);
+	model.control_index += length;
+	if (model.control_index >= model.setup_data.wLength && device->control &&
+		device->control(device->arg, &model.setup_data, model.control_buffer) == USBH_LLD_SIM_STALL) {
+		return USBH_LLD_SIM_STALL;
+	}
+	return length;
+}
+
+static bool device_addressed(uint8_t channel)
+{
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+
+	return model.device && (REG(OTG_HPRT) & OTG_HPRT_PENA) &&
+		(int32_t)((hcchar & OTG_HCCHAR_DAD_MASK) >> HCCHAR_DAD_SHIFT) == model.address;
+}
+
+/**
+ * Count the packet in HCTSIZ and toggle its data PID
+ *
+ * @returns packets left
+ */
+static uint32_t channel_packet_done(uint8_t channel, uint16_t length)
+{
+	uint32_t hctsiz = REG(OTG_HCTSIZ(channel));
+	uint32_t xfrsiz = hctsiz & OTG_HCTSIZ_XFRSIZ_MASK;
+	uint32_t pktcnt = (hctsiz & HCTSIZ_PKTCNT_MASK) >> HCTSIZ_PKTCNT_SHIFT;
+	uint32_t dpid = hctsiz & OTG_HCTSIZ_DPID_MASK;
+
+	xfrsiz = xfrsiz > length ? xfrsiz - length : 0;
+	if (pktcnt) {
+		pktcnt--;
+	}
+	dpid = dpid == OTG_HCTSIZ_DPID_DATA0 ? OTG_HCTSIZ_DPID_DATA1 : OTG_HCTSIZ_DPID_DATA0;
+
+	REG(OTG_HCTSIZ(channel)) = (hctsiz & ~(OTG_HCTSIZ_XFRSIZ_MASK | HCTSIZ_PKTCNT_MASK |
+		OTG_HCTSIZ_DPID_MASK)) | xfrsiz | (pktcnt << HCTSIZ_PKTCNT_SHIFT) | dpid;
+	return pktcnt;
+}
+
+/**
+ * End the transfer of the channel by the answer of the device other than data
+ */
+static void channel_answer_error(uint8_t channel, int32_t answer)
+{
+	if (answer == USBH_LLD_SIM_NAK) {
+		model.stats.naks++;
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_NAK;
+	} else if (answer == USBH_LLD_SIM_STALL) {
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_STALL;
+	} else {
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_TXERR;
+	}
+}
+
+/**
+ * One IN packet, the channel continues once it is enabled again (as the driver expects)
+ */
+static void channel_in(uint8_t channel)
+{
+	channel_model_t *ch = &model.channels[channel];
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+	const uint16_t mps = hcchar & OTG_HCCHAR_MPSIZ_MASK;
+	const uint32_t xfrsiz = REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_XFRSIZ_MASK;
+	const uint16_t length = xfrsiz < mps ? xfrsiz : mps;
+
+	// the packet along with the IN_COMP and channel halted entries
+	if (rx_free() < 3 + (mps + 3U) / 4) {
+		ch->rx_wait = true;
+		return;
+	}
+	ch->rx_wait = false;
+
+	model.stats.packets++;
+	const int32_t answer = device_addressed(channel) ? device_in(channel, packet_buffer, length) :
+		ANSWER_NONE;
+	if (answer < 0) {
+		channel_answer_error(channel, answer);
+		REG(OTG_HCCHAR(channel)) &= ~OTG_HCCHAR_CHENA;
+		return;
+	}
+
+	const uint16_t received = answer < length ? answer : length;
+	rx_push(channel, OTG_GRXSTSP_PKTSTS_IN, packet_buffer, received);
+	model.stats.bytes_in += received;
+	REG(OTG_HCINT(channel)) |= OTG_HCINT_ACK;
+
+	if (!channel_packet_done(channel, received) || received < mps) {
+		rx_push(channel, OTG_GRXSTSP_PKTSTS_IN_COMP, NULL, 0);
+		ch->in_comp = true;
+	} else {
+		REG(OTG_HCCHAR(channel)) &= ~OTG_HCCHAR_CHENA;
+	}
+}
+
+/**
+ * OUT packets, as many as are in the transmit FIFO (one per frame on periodic channels)
+ */
+static void channel_out(uint8_t channel)
+{
+	channel_model_t *ch = &model.channels[channel];
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+	const uint16_t mps = hcchar & OTG_HCCHAR_MPSIZ_MASK;
+	const bool setup = (hcchar & OTG_HCCHAR_EPTYP_MASK) == OTG_HCCHAR_EPTYP_CONTROL &&
+		(REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_DPID_MASK) == OTG_HCTSIZ_DPID_MDATA;
+
+	do {
+		const uint32_t xfrsiz = REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_XFRSIZ_MASK;
+		const uint16_t length = xfrsiz < mps ? xfrsiz : mps;
+
+		if (length && !ch->tx_packets) {
+			// waits for the data
+			return;
+		}
+		if (length && ch->tx_length[0] != length) {
+			model.stats.errors++;
+		}
+
+		model.stats.packets++;
+		const int32_t answer = device_addressed(channel) ?
+			device_out(channel, ch->tx_data, length, setup) : ANSWER_NONE;
+		if (answer == USBH_LLD_SIM_NAK) {
+			channel_answer_error(channel, answer);
+			ch->nak_stop = true;
+			return;
+		}
+		if (answer < 0) {
+			channel_answer_error(channel, answer);
+			REG(OTG_HCCHAR(channel)) &= ~OTG_HCCHAR_CHENA;
+			tx_drop(channel);
+			return;
+		}
+
+		if (length) {
+			tx_pop(channel);
+		}
+		model.stats.bytes_out += length;
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_ACK;
+		if (!channel_packet_done(channel, length)) {
+			REG(OTG_HCINT(channel)) |= OTG_HCINT_XFRC;
+			REG(OTG_HCCHAR(channel)) &= ~OTG_HCCHAR_CHENA;
+			return;
+		}
+	} while (!channel_periodic(channel));
+}
+
+/**
+ * End the DMA transfer of the channel, the driver reads the result once it halts
+ */
+static void channel_dma_halt(uint8_t channel, uint32_t hcint)
+{
+	REG(OTG_HCINT(channel)) |= hcint | OTG_HCINT_CHH;
+	REG(OTG_HCCHAR(channel)) &= ~OTG_HCCHAR_CHENA;
+}
+
+/**
+ * NAK of the DMA transfer: the core asks the non-periodic endpoint again by itself,
+ * the periodic channel halts
+ */
+static void channel_dma_nak(uint8_t channel)
+{
+	model.stats.naks++;
+	if (channel_periodic(channel)) {
+		channel_dma_halt(channel, OTG_HCINT_NAK);
+	} else {
+		model.channels[channel].dma_retry = true;
+	}
+}
+
+/**
+ * IN packets written into the memory by the DMA (one per frame on periodic channels)
+ *
+ * The DMA writes whole words as the core does, up to 3 bytes past the received data.
+ */
+static void channel_in_dma(uint8_t channel)
+{
+	channel_model_t *ch = &model.channels[channel];
+	const uint16_t mps = REG(OTG_HCCHAR(channel)) & OTG_HCCHAR_MPSIZ_MASK;
+
+	do {
+		const uint32_t xfrsiz = REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_XFRSIZ_MASK;
+		const uint16_t length = xfrsiz < mps ? xfrsiz : mps;
+
+		model.stats.packets++;
+		const int32_t answer = device_addressed(channel) ? device_in(channel, packet_buffer, length) :
+			ANSWER_NONE;
+		if (answer == USBH_LLD_SIM_NAK) {
+			channel_dma_nak(channel);
+			return;
+		}
+		if (answer < 0) {
+			channel_answer_error(channel, answer);
+			channel_dma_halt(channel, 0);
+			return;
+		}
+
+		const uint16_t received = answer < length ? answer : length;
+		if (received && !ch->dma_data) {
+			model.stats.errors++;
+		} else if (received) {
+			memcpy(&ch->dma_data[ch->dma_index], packet_buffer, (received + 3) & ~3);
+		}
+		ch->dma_index += received;
+		model.stats.bytes_in += received;
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_ACK;
+
+		if (!channel_packet_done(channel, received) || received < mps) {
+			channel_dma_halt(channel, OTG_HCINT_XFRC);
+			return;
+		}
+	} while (!channel_periodic(channel));
+}
+
+/**
+ * OUT packets fetched from the memory by the DMA (one per frame on periodic channels)
+ */
+static void channel_out_dma(uint8_t channel)
+{
+	channel_model_t *ch = &model.channels[channel];
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+	const uint16_t mps = hcchar & OTG_HCCHAR_MPSIZ_MASK;
+	const bool setup = (hcchar & OTG_HCCHAR_EPTYP_MASK) == OTG_HCCHAR_EPTYP_CONTROL &&
+		(REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_DPID_MASK) == OTG_HCTSIZ_DPID_MDATA;
+
+	do {
+		const uint32_t xfrsiz = REG(OTG_HCTSIZ(channel)) & OTG_HCTSIZ_XFRSIZ_MASK;
+		const uint16_t length = xfrsiz < mps ? xfrsiz : mps;
+
+		if (length && !ch->dma_data) {
+			model.stats.errors++;
+			channel_dma_halt(channel, OTG_HCINT_TXERR);
+			return;
+		}
+
+		model.stats.packets++;
+		const int32_t answer = device_addressed(channel) ?
+			device_out(channel, length ? &ch->dma_data[ch->dma_index] : packet_buffer, length, setup) :
+			ANSWER_NONE;
+		if (answer == USBH_LLD_SIM_NAK) {
+			channel_dma_nak(channel);
+			return;
+		}
+		if (answer < 0) {
+			channel_answer_error(channel, answer);
+			channel_dma_halt(channel, 0);
+			return;
+		}
+
+		ch->dma_index += length;
+		model.stats.bytes_out += length;
+		REG(OTG_HCINT(channel)) |= OTG_HCINT_ACK;
+		if (!channel_packet_done(channel, length)) {
+			channel_dma_halt(channel, OTG_HCINT_XFRC);
+			return;
+		}
+	} while (!channel_periodic(channel));
+}
+
+/**
+ * Issue the transactions of the enabled channel
+ *
+ * Periodic channels transfer at the start of the frame only.
+ */
+static void channel_transact(uint8_t channel, bool frame_start)
+{
+	const channel_model_t *ch = &model.channels[channel];
+	const uint32_t hcchar = REG(OTG_HCCHAR(channel));
+
+	if (!(hcchar & OTG_HCCHAR_CHENA) || ch->in_comp || ch->nak_stop ||
+		channel_periodic(channel) != frame_start) {
+		return;
+	}
+
+	if (dma_enabled()) {
+		model.channels[channel].dma_retry = false;
+		if (hcchar & OTG_HCCHAR_EPDIR_IN) {
+			channel_in_dma(channel);
+		} else {
+			channel_out_dma(channel);
+		}
+	} else if (hcchar & OTG_HCCHAR_EPDIR_IN) {
+		channel_in(channel);
+	} else {
+		channel_out(channel);
+	}
+}
+
+static void channel_write(uint8_t channel, uint32_t offset, uint32_t value)
+{
+	channel_model_t *ch = &model.channels[channel];
+
+	if (offset == (uint32_t)OTG_HCCHAR(channel)) {
+		hcchar_write(channel, value);
+	} else if (offset == (uint32_t)OTG_HCINT(channel)) {
+		REG(offset) &= ~value;
+	} else {
+		REG(offset) = value;
+		if (offset == (uint32_t)OTG_HCTSIZ(channel)) {
+			ch->naks_left = model.device ? model.device->nak_count : 0;
+		} else if (offset == (uint32_t)OTG_HCDMA(channel)) {
+			// DMA accesses whole words at the address
+			if ((value & ~3U) != DMA_ADDR_BASE || (value & 3) || !model.dma_pending) {
+				model.stats.errors++;
+			}
+			ch->dma_data = model.dma_pending;
+			ch->dma_index = 0;
+			model.dma_pending = NULL;
+		}
+	}
+}
+
+uint32_t usbh_dwc2_model_read(uint32_t addr)
+{
+	const uint32_t offset = core_offset(addr);
+
+	if (offset >= OTG_FIFO(0)) {
+		model.stats.fifo_words_in++;
+		return rx_data_pop();
+	}
+
+	model.stats.reads++;
+	switch (offset) {
+	case OTG_GRSTCTL:
+		return (REG(offset) & ~GRSTCTL_SELF_CLEAR) | OTG_GRSTCTL_AHBIDL;
+
+	case OTG_GINTSTS:
+		return gintsts();
+
+	case OTG_GRXSTSR:
+		return model.rx_count && !model.rx_data_left ? model.rx[model.rx_head] : 0;
+
+	case OTG_GRXSTSP:
+		return rx_status_pop();
+
+	case OTG_GNPTXSTS:
+		return txsts(false);
+
+	case OTG_HPTXSTS:
+		return txsts(true);
+
+	case OTG_HAINT:
+		return haint();
+
+	case OTG_HFNUM:
+		return model.frame;
+
+	default:
+		return REG(offset);
+	}
+}
+
+void usbh_dwc2_model_write(uint32_t addr, uint32_t value)
+{
+	const uint32_t offset = core_offset(addr);
+
+	if (offset >= OTG_FIFO(0)) {
+		// data are pushed by usbh_dwc2_model_fifo_write()
+		model.stats.fifo_words_out++;
+		model.stats.errors++;
+		return;
+	}
+
+	model.stats.writes++;
+	switch (offset) {
+	case OTG_GRSTCTL:
+		if (value & OTG_GRSTCTL_CSRST) {
+			core_reset();
+		}
+		if (value & OTG_GRSTCTL_RXFFLSH) {
+			rx_flush();
+		}
+		if (value & OTG_GRSTCTL_TXFFLSH) {
+			uint8_t channel;
+			fifo_sizes_check();
+			for (channel = 0; channel < model.num_channels; channel++) {
+				tx_drop(channel);
+			}
+		}
+		REG(offset) = value & ~GRSTCTL_SELF_CLEAR;
+		break;
+
+	case OTG_GINTSTS:
+		REG(offset) &= ~(value & ~GINTSTS_DERIVED);
+		break;
+
+	case OTG_HPRT:
+		hprt_write(value);
+		break;
+
+	case OTG_GRXSTSR:
+	case OTG_GRXSTSP:
+	case OTG_GNPTXSTS:
+	case OTG_HPTXSTS:
+	case OTG_HAINT:
+	case OTG_HFNUM:
+		// read only
+		break;
+
+	default:
+		if (offset >= OTG_HCCHAR(0) && offset < (uint32_t)OTG_HCCHAR(model.num_channels)) {
+			channel_write((offset - OTG_HCCHAR(0)) / (OTG_HCCHAR(1) - OTG_HCCHAR(0)), offset, value);
+		} else {
+			REG(offset) = value;
+		}
+		break;
+	}
+}
+
+void usbh_dwc2_model_fifo_write(uint32_t addr, const void *data, uint32_t length)
+{
+	const uint8_t channel = core_offset(addr) / OTG_FIFO(0) - 1;
+	const uint32_t words = (length + 3) / 4;
+
+	model.stats.fifo_words_out += words;
+	if (channel >= model.num_channels) {
+		model.stats.errors++;
+		return;
+	}
+
+	channel_model_t *ch = &model.channels[channel];
+	const uint32_t status = txsts(channel_periodic(channel));
+	if (words > (status & 0xffff) || !(status >> 16) || ch->tx_fill + words * 4 > sizeof(ch->tx_data)) {
+		model.stats.errors++;
+		return;
+	}
+
+	usbh_fifo_write(fifo_window, data, length);
+	uint32_t i;
+	for (i = 0; i < words; i++) {
+		const uint32_t word = fifo_window[i];
+		memcpy(&ch->tx_data[ch->tx_fill + 4 * i], &word, 4);
+	}
+	ch->tx_fill += words * 4;
+	ch->tx_length[ch->tx_packets++] = length;
+
+	channel_transact(channel, false);
+}
+
+void usbh_dwc2_model_fifo_read(uint32_t addr, void *data, uint32_t length)
+{
+	const uint8_t channel = core_offset(addr) / OTG_FIFO(0) - 1;
+	const uint32_t words = (length + 3) / 4;
+
+	if (channel != model.rx_channel || words > model.rx_data_left) {
+		model.stats.errors++;
+	}
+
+	uint32_t i;
+	for (i = 0; i < words; i++) {
+		fifo_window[i] = rx_data_pop();
+	}
+	model.stats.fifo_words_in += words;
+	usbh_fifo_read(fifo_window, data, length);
+}
+
+void usbh_dwc2_model_run(uint32_t time_curr_us)
+{
+	channels_halt_done();
+	while ((int32_t)(time_curr_us - model.frame_time_us) >= 1000) {
+		model.frame_time_us += 1000;
+		model.frame = (model.frame + 1) & HFNUM_FRNUM_MASK;
+		if (!(REG(OTG_HPRT) & OTG_HPRT_PENA)) {
+			continue;
+		}
+
+		REG(OTG_GINTSTS) |= OTG_GINTSTS_SOF;
+		uint8_t channel;
+		for (channel = 0; channel < model.num_channels; channel++) {
+			const bool odd = REG(OTG_HCCHAR(channel)) & OTG_HCCHAR_ODDFRM;
+			if (model.channels[channel].dma_retry) {
+				channel_transact(channel, false);
+			} else if (odd == (model.frame & 1)) {
+				channel_transact(channel, true);
+			}
+		}
+	}
+}
+
+uint32_t usbh_dwc2_model_dma_addr(const void *data)
+{
+	model.dma_pending = (void *)data;
+	return DMA_ADDR_BASE | ((uintptr_t)data & 3);
+}
+
+void usbh_dwc2_model_attach(const usbh_lld_sim_device_t *device)
+{
+	model.device = device;
+	device_reset();
+	port_connect();
+}
+
+void usbh_dwc2_model_detach(void)
+{
+	uint32_t hprt = REG(OTG_HPRT);
+
+	model.device = NULL;
+	if (hprt & OTG_HPRT_PENA) {
+		hprt |= OTG_HPRT_PENCHNG;
+	}
+	REG(OTG_HPRT) = hprt & ~(OTG_HPRT_PCSTS | OTG_HPRT_PENA | OTG_HPRT_PSPD_MASK);
+	REG(OTG_GINTSTS) |= OTG_GINTSTS_DISCINT;
+}
+
+void usbh_dwc2_model_get_stats(usbh_dwc2_model_stats_t *stats, bool reset)
+{
+	*stats = model.stats;
+	if (reset) {
+		memset(&model.stats, 0, sizeof(model.stats));
+	}
+}
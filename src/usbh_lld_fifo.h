@@ -0,0 +1,143 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USBH_LLD_FIFO_
+#define USBH_LLD_FIFO_
+
+#include <stdint.h>
+
+/*
+ * Copy routines between packet buffers and the data FIFO of the OTG core
+ *
+ * Every word of the FIFO window (4kB per channel) accesses the same FIFO, so the
+ * FIFO pointer is incremented along with the buffer. Aligned buffers of 16 bytes
+ * and more are copied by blocks of four words to cut the loop overhead, the FIFO
+ * accesses stay single word ones as they are volatile. Shorter ones take the plain
+ * word loop. Unaligned buffers are packed byte by byte, little endian, instead
+ * of relying on unaligned word accesses.
+ */
+
+/**
+ * @brief usbh_fifo_write push the data into the transmit FIFO
+ * @param fifo FIFO window of the channel
+ * @param length bytes to push, (length + 3) / 4 words are written
+ */
+static inline void usbh_fifo_write(volatile uint32_t *fifo, const void *data, uint32_t length)
+{
+	const uint8_t *buf8 = data;
+	uint32_t words = length / 4;
+
+	if (!((uintptr_t)data & 3)) {
+		const uint32_t *buf32 = data;
+		// short packets take the word loop only
+		if (words >= 4) {
+			for (; words >= 4; words -= 4) {
+				const uint32_t w0 = buf32[0];
+				const uint32_t w1 = buf32[1];
+				const uint32_t w2 = buf32[2];
+				const uint32_t w3 = buf32[3];
+				fifo[0] = w0;
+				fifo[1] = w1;
+				fifo[2] = w2;
+				fifo[3] = w3;
+				fifo += 4;
+				buf32 += 4;
+			}
+		}
+		while (words--) {
+			*fifo++ = *buf32++;
+		}
+		buf8 = (const uint8_t *)buf32;
+	} else {
+		while (words--) {
+			*fifo++ = (uint32_t)buf8[0] | ((uint32_t)buf8[1] << 8) |
+				((uint32_t)buf8[2] << 16) | ((uint32_t)buf8[3] << 24);
+			buf8 += 4;
+		}
+	}
+
+	length &= 3;
+	if (length) {
+		// do not read past the end of the buffer
+		uint32_t word = 0;
+		uint32_t i;
+		for (i = 0; i < length; i++) {
+			word |= (uint32_t)buf8[i] << (8 * i);
+		}
+		*fifo = word;
+	}
+}
+
+/**
+ * @brief usbh_fifo_read pop the data from the receive FIFO
+ * @param fifo FIFO window of the channel
+ * @param length bytes to pop, (length + 3) / 4 words are read
+ */
+static inline void usbh_fifo_read(volatile uint32_t *fifo, void *data, uint32_t length)
+{
+	uint8_t *buf8 = data;
+	uint32_t words = length / 4;
+
+	if (!((uintptr_t)data & 3)) {
+		uint32_t *buf32 = data;
+		// short packets take the word loop only
+		if (words >= 4) {
+			for (; words >= 4; words -= 4) {
+				const uint32_t w0 = fifo[0];
+				const uint32_t w1 = fifo[1];
+				const uint32_t w2 = fifo[2];
+				const uint32_t w3 = fifo[3];
+				buf32[0] = w0;
+				buf32[1] = w1;
+				buf32[2] = w2;
+				buf32[3] = w3;
+				fifo += 4;
+				buf32 += 4;
+			}
+		}
+		while (words--) {
+			*buf32++ = *fifo++;
+		}
+		buf8 = (uint8_t *)buf32;
+	} else {
+		while (words--) {
+			const uint32_t word = *fifo++;
+			buf8[0] = word;
+			buf8[1] = word >> 8;
+			buf8[2] = word >> 16;
+			buf8[3] = word >> 24;
+			buf8 += 4;
+		}
+	}
+
+	length &= 3;
+	if (length) {
+		// do not write past the end of the buffer
+		uint32_t word = *fifo;
+		while (length--) {
+			*buf8++ = word;
+			word >>= 8;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,653 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "driver/usbh_device_driver.h"
+#include "usbh_lld_sim.h"
+#include "usart_helpers.h"
+#include "usbh_trace.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#define NUM_CHANNELS_SIM	(8)
+
+/* Time between the attach and the connection being reported. */
+#define PORT_RESET_US	(10000)
+
+/* Data stage buffer of the simulated control endpoint. */
+#define CONTROL_BUFFER_SIZE	(BUFFER_ONE_BYTES)
+
+/* OUT data are latched on submission, as hardware does by filling the TX FIFO. */
+#define CHANNEL_OUT_BUFFER_SIZE	(1024)
+
+/* Interrupt endpoints whose next transfer time is remembered, the least recently due is replaced. */
+#define PERIODIC_ENDPOINTS	(8)
+
+enum CHANNEL_STATE {
+	CHANNEL_STATE_FREE = 0,
+	CHANNEL_STATE_WORK = 1
+};
+
+struct _channel {
+	enum CHANNEL_STATE state;
+	usbh_packet_t packet;
+	bool in;
+	uint32_t naks_left;
+	uint16_t naks;
+	uint32_t time_due_us;
+	uint32_t time_start_us;
+	uint8_t data_out[CHANNEL_OUT_BUFFER_SIZE];
+};
+typedef struct _channel channel_t;
+
+struct _periodic {
+	/// -1 for unused entry
+	int8_t address;
+
+	/// endpoint number ORed with 0x80 for IN
+	uint8_t endpoint;
+	uint32_t time_next_us;
+};
+typedef struct _periodic periodic_t;
+
+enum PORT_STATE {
+	PORT_STATE_DISCONN = 0,
+	PORT_STATE_RESET = 1,
+	PORT_STATE_RUN = 2,
+	PORT_STATE_DETACH = 3
+};
+
+struct _usbh_lld_sim_driver_data {
+	usbh_generic_data_t generic;
+	channel_t channels[NUM_CHANNELS_SIM];
+	periodic_t periodic[PERIODIC_ENDPOINTS];
+
+	const usbh_lld_sim_device_t *device;
+	enum PORT_STATE port_state;
+	uint32_t time_curr_us;
+
+	// port reset in progress
+	usbh_timer_t timer_reset;
+
+	// state of the simulated device
+	int8_t address;
+	int8_t address_pending;
+	struct usb_setup_data setup_data;
+	int32_t control_length;
+	uint8_t control_buffer[CONTROL_BUFFER_SIZE];
+
+	// injected transmit errors left
+	uint32_t txerrs_left;
+
+	usbh_lld_sim_stats_t stats;
+};
+typedef struct _usbh_lld_sim_driver_data usbh_lld_sim_driver_data_t;
+
+static bool time_reached(uint32_t time_curr_us, uint32_t time_us)
+{
+	return (int32_t)(time_curr_us - time_us) >= 0;
+}
+
+static uint32_t frame_us(const usbh_lld_sim_driver_data_t *dev)
+{
+	if (dev->device && dev->device->speed == USBH_SPEED_HIGH) {
+		return 125;
+	}
+	return 1000;
+}
+
+static void init(void *drvdata)
+{
+	usbh_lld_sim_driver_data_t *dev = drvdata;
+	uint32_t i;
+
+	for (i = 0; i < NUM_CHANNELS_SIM; i++) {
+		dev->channels[i].state = CHANNEL_STATE_FREE;
+	}
+	dev->port_state = PORT_STATE_DISCONN;
+	dev->address = 0;
+	dev->address_pending = -1;
+	dev->txerrs_left = 0;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+/**
+ * Time the transfer of the interrupt endpoint is due, once per its bInterval
+ */
+static uint32_t periodic_due(usbh_lld_sim_driver_data_t *dev, const usbh_packet_t *packet, bool in)
+{
+	const uint8_t endpoint = packet->endpoint_address | (in ? 0x80 : 0);
+	const uint8_t interval = packet->interval ? packet->interval : 1;
+	periodic_t *periodic = NULL;
+	uint32_t i;
+
+	for (i = 0; i < PERIODIC_ENDPOINTS; i++) {
+		periodic_t *entry = &dev->periodic[i];
+		if (entry->address == packet->address && entry->endpoint == endpoint) {
+			periodic = entry;
+			break;
+		}
+		if (!periodic || (periodic->address != -1 && (entry->address == -1 ||
+			!time_reached(entry->time_next_us, periodic->time_next_us)))) {
+			periodic = entry;
+		}
+	}
+	if (i == PERIODIC_ENDPOINTS) {
+		periodic->address = packet->address;
+		periodic->endpoint = endpoint;
+		periodic->time_next_us = dev->time_curr_us;
+	}
+
+	// overdue endpoints are served at once
+	if (time_reached(dev->time_curr_us, periodic->time_next_us)) {
+		periodic->time_next_us = dev->time_curr_us;
+	}
+	const uint32_t time_due_us = periodic->time_next_us;
+	if (packet->speed == USBH_SPEED_HIGH) {
+		periodic->time_next_us += 125 << (interval > 13 ? 12 : interval - 1);
+	} else {
+		periodic->time_next_us += interval * 1000;
+	}
+	return time_due_us;
+}
+
+static int8_t get_free_channel(usbh_lld_sim_driver_data_t *dev)
+{
+	uint32_t i;
+	for (i = 0; i < NUM_CHANNELS_SIM; i++) {
+		if (dev->channels[i].state == CHANNEL_STATE_FREE) {
+			dev->channels[i].state = CHANNEL_STATE_WORK;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool submit(usbh_lld_sim_driver_data_t *dev, const usbh_packet_t *packet, bool in)
+{
+	int8_t channel = get_free_channel(dev);
+	if (channel == -1) {
+		return false;
+	}
+
+	channel_t *ch = &dev->channels[channel];
+	ch->packet = *packet;
+	ch->in = in;
+	if (!in && packet->datalen <= CHANNEL_OUT_BUFFER_SIZE) {
+		memcpy(ch->data_out, packet->data.out, packet->datalen);
+		ch->packet.data.out = ch->data_out;
+	}
+	ch->time_due_us = dev->time_curr_us;
+	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_INTERRUPT) {
+		ch->time_due_us = periodic_due(dev, packet, in);
+	}
+	ch->time_start_us = ch->time_due_us;
+	ch->naks_left = 0;
+	ch->naks = 0;
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_ALLOC, channel, packet, in, packet->datalen);
+	if (dev->device) {
+		ch->time_due_us += dev->device->latency_us;
+		if (packet->endpoint_type != USBH_ENDPOINT_TYPE_CONTROL) {
+			ch->naks_left = dev->device->nak_count;
+		}
+	}
+	usbh_poll_request(ch->time_due_us);
+	return true;
+}
+
+static bool read(void *drvdata, usbh_packet_t *packet)
+{
+	return submit(drvdata, packet, true);
+}
+
+static bool write(void *drvdata, const usbh_packet_t *packet)
+{
+	return submit(drvdata, packet, false);
+}
+
+/**
+ * Prepare the data stage of a control request
+ *
+ * @returns length of the data stage or USBH_LLD_SIM_STALL
+ */
+static bool cancel(void *drvdata, const usbh_packet_t *packet)
+{
+	usbh_lld_sim_driver_data_t *dev = drvdata;
+	uint32_t i;
+
+	for (i = 0; i < NUM_CHANNELS_SIM; i++) {
+		channel_t *ch = &dev->channels[i];
+		if (ch->state == CHANNEL_STATE_WORK && ch->packet.callback_arg == packet->callback_arg) {
+			USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_FREE, i, &ch->packet, ch->in, 0);
+			ch->state = CHANNEL_STATE_FREE;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Take the channel from the IN transfer waiting for its NAK retry or interval
+ *
+ * The lowest priority is parked first, then the one NAKed the most.
+ */
+static bool park(void *drvdata, uint8_t priority)
+{
+	usbh_lld_sim_driver_data_t *dev = drvdata;
+	channel_t *parked = NULL;
+	uint32_t i;
+
+	for (i = 0; i < NUM_CHANNELS_SIM; i++) {
+		channel_t *ch = &dev->channels[i];
+		if (ch->state != CHANNEL_STATE_WORK || !ch->in ||
+			(!ch->naks && ch->packet.endpoint_type != USBH_ENDPOINT_TYPE_INTERRUPT) ||
+			time_reached(dev->time_curr_us, ch->time_due_us)) {
+			continue;
+		}
+
+		const uint8_t ch_priority = usbh_channel_priority[ch->packet.endpoint_type];
+		if (ch_priority > priority) {
+			continue;
+		}
+		if (!parked) {
+			parked = ch;
+			continue;
+		}
+		const uint8_t parked_priority = usbh_channel_priority[parked->packet.endpoint_type];
+		if (ch_priority < parked_priority || (ch_priority == parked_priority && ch->naks > parked->naks)) {
+			parked = ch;
+		}
+	}
+	if (!parked) {
+		return false;
+	}
+
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_FREE, parked - dev->channels, &parked->packet, true, 0);
+	usbh_packet_callback_data_t cb_data;
+	cb_data.status = USBH_PACKET_CALLBACK_STATUS_ENAK;
+	cb_data.transferred_length = 0;
+
+	// channel can be reused by the callback
+	parked->state = CHANNEL_STATE_FREE;
+	parked->packet.callback(parked->packet.callback_arg, cb_data);
+	return true;
+}
+
+static int32_t control_setup(usbh_lld_sim_driver_data_t *dev)
+{
+	const usbh_lld_sim_device_t *device = dev->device;
+	const struct usb_setup_data *setup_data = &dev->setup_data;
+	int32_t length = USBH_LLD_SIM_STALL;
+
+	if ((setup_data->bmRequestType & 0x60) == USB_REQ_TYPE_STANDARD) {
+		switch (setup_data->bRequest) {
+		case USB_REQ_SET_ADDRESS:
+			// new address is valid after the status stage
+			dev->address_pending = setup_data->wValue & 0x7f;
+			return 0;
+
+		case USB_REQ_SET_CONFIGURATION:
+			return 0;
+
+		case USB_REQ_GET_DESCRIPTOR:
+			switch (setup_data->wValue >> 8) {
+			case USB_DT_DEVICE:
+				length = USB_DT_DEVICE_SIZE;
+				memcpy(dev->control_buffer, device->device_descriptor, length);
+				break;
+
+			case USB_DT_CONFIGURATION:
+				{
+					const struct usb_config_descriptor *cdt =
+						(const struct usb_config_descriptor *)device->config_descriptor;
+					length = cdt->wTotalLength;
+					if (length > CONTROL_BUFFER_SIZE) {
+						length = CONTROL_BUFFER_SIZE;
+					}
+					memcpy(dev->control_buffer, device->config_descriptor, length);
+				}
+				break;
+
+			default:
+				break;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (length == USBH_LLD_SIM_STALL && device->control) {
+		if (setup_data->bmRequestType & USB_REQ_TYPE_IN) {
+			length = device->control(device->arg, setup_data, dev->control_buffer);
+		} else {
+			// OUT requests are passed to the handler after the data stage
+			length = setup_data->wLength;
+		}
+	}
+
+	if (length > setup_data->wLength) {
+		length = setup_data->wLength;
+	}
+	return length;
+}
+
+/**
+ * Perform transaction on the bus
+ *
+ * @returns true when the transfer is complete, false on NAK
+ */
+static bool transaction(usbh_lld_sim_driver_data_t *dev, channel_t *ch, usbh_packet_callback_data_t *cb_data)
+{
+	const usbh_lld_sim_device_t *device = dev->device;
+	usbh_packet_t *packet = &ch->packet;
+	int32_t length;
+
+	cb_data->transferred_length = 0;
+
+	if (!device || dev->port_state != PORT_STATE_RUN || packet->address != dev->address) {
+		// nobody answers: behave as transmit error
+		usbh_stats_event(dev, packet, ch->in, USBH_STATS_EVENT_TXERR);
+		cb_data->status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+		return true;
+	}
+
+	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_CONTROL) {
+		if (!ch->in && packet->control_type == USBH_CONTROL_TYPE_SETUP) {
+			memcpy(&dev->setup_data, packet->data.out, sizeof(dev->setup_data));
+			dev->control_length = control_setup(dev);
+			packet->toggle[0] = 1;
+			cb_data->status = USBH_PACKET_CALLBACK_STATUS_OK;
+			return true;
+		}
+
+		if (dev->control_length == USBH_LLD_SIM_STALL) {
+			dev->stats.stalls++;
+			usbh_stats_event(dev, packet, ch->in, USBH_STATS_EVENT_STALL);
+			cb_data->status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+			return true;
+		}
+
+		if (ch->in) {
+			if (packet->datalen == 0) {
+				// status stage of OUT request
+				if (dev->address_pending >= 0) {
+					dev->address = dev->address_pending;
+					dev->address_pending = -1;
+				}
+				cb_data->status = USBH_PACKET_CALLBACK_STATUS_OK;
+				return true;
+			}
+
+			length = dev->control_length;
+			if (length > packet->datalen) {
+				length = packet->datalen;
+			}
+
+			// host expecting bigger packets than the device sends takes
+			// the first packet as the short one, that ends the transfer
+			const uint8_t packet_size_max0 = device->device_descriptor[7];
+			if (packet->endpoint_size_max > packet_size_max0 && length > packet_size_max0) {
+				length = packet_size_max0;
+			}
+			memcpy(packet->data.in, dev->control_buffer, length);
+		} else {
+			length = packet->datalen;
+			if (length > CONTROL_BUFFER_SIZE) {
+				length = CONTROL_BUFFER_SIZE;
+			}
+			memcpy(dev->control_buffer, packet->data.out, length);
+			if (device->control &&
+				device->control(device->arg, &dev->setup_data, dev->control_buffer) == USBH_LLD_SIM_STALL) {
+				dev->stats.stalls++;
+				usbh_stats_event(dev, packet, ch->in, USBH_STATS_EVENT_STALL);
+				cb_data->status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+				return true;
+			}
+		}
+	} else {
+		if (dev->txerrs_left) {
+			dev->txerrs_left--;
+			dev->stats.txerrs++;
+			usbh_stats_event(dev, packet, ch->in, USBH_STATS_EVENT_TXERR);
+			cb_data->status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+			return true;
+		}
+
+		if (ch->naks_left) {
+			ch->naks_left--;
+			return false;
+		}
+
+		length = USBH_LLD_SIM_STALL;
+		if (ch->in && device->in) {
+			length = device->in(device->arg, packet->endpoint_address, packet->data.in, packet->datalen);
+		} else if (!ch->in && device->out) {
+			length = device->out(device->arg, packet->endpoint_address, packet->data.out, packet->datalen);
+		}
+
+		if (length == USBH_LLD_SIM_NAK) {
+			return false;
+		}
+
+		if (length < 0) {
+			dev->stats.stalls++;
+			usbh_stats_event(dev, packet, ch->in, USBH_STATS_EVENT_STALL);
+			cb_data->status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+			return true;
+		}
+	}
+
+	if (length > packet->datalen) {
+		length = packet->datalen;
+	}
+
+	// every packet of the transfer toggles data pid
+	uint32_t num_packets = 1;
+	if (length) {
+		num_packets = ((length - 1) / packet->endpoint_size_max) + 1;
+	}
+	packet->toggle[0] ^= num_packets & 1;
+
+	if (ch->in) {
+		dev->stats.bytes_in += length;
+	} else {
+		dev->stats.bytes_out += length;
+	}
+
+	cb_data->transferred_length = length;
+	if (ch->in && length != packet->datalen) {
+		cb_data->status = USBH_PACKET_CALLBACK_STATUS_ERRSIZ;
+	} else {
+		cb_data->status = USBH_PACKET_CALLBACK_STATUS_OK;
+	}
+	return true;
+}
+
+static void channels_init(usbh_lld_sim_driver_data_t *dev)
+{
+	uint32_t i;
+	for (i = 0; i < NUM_CHANNELS_SIM; i++) {
+		dev->channels[i].state = CHANNEL_STATE_FREE;
+	}
+	for (i = 0; i < PERIODIC_ENDPOINTS; i++) {
+		dev->periodic[i].address = -1;
+	}
+}
+
+static enum USBH_POLL_STATUS poll(void *drvdata, uint32_t time_curr_us)
+{
+	usbh_lld_sim_driver_data_t *dev = drvdata;
+
+	dev->time_curr_us = time_curr_us;
+	dev->stats.polls++;
+
+	switch (dev->port_state) {
+	case PORT_STATE_DISCONN:
+		if (dev->device) {
+			dev->port_state = PORT_STATE_RESET;
+			usbh_timer_start(&dev->timer_reset, PORT_RESET_US, NULL, NULL);
+		}
+		return USBH_POLL_STATUS_NONE;
+
+	case PORT_STATE_RESET:
+		if (!dev->device) {
+			usbh_timer_stop(&dev->timer_reset);
+			dev->port_state = PORT_STATE_DISCONN;
+		} else if (!usbh_timer_pending(&dev->timer_reset)) {
+			channels_init(dev);
+			dev->address = 0;
+			dev->address_pending = -1;
+			dev->port_state = PORT_STATE_RUN;
+			return USBH_POLL_STATUS_DEVICE_CONNECTED;
+		}
+		return USBH_POLL_STATUS_NONE;
+
+	case PORT_STATE_DETACH:
+		channels_init(dev);
+		dev->port_state = PORT_STATE_DISCONN;
+		return USBH_POLL_STATUS_DEVICE_DISCONNECTED;
+
+	case PORT_STATE_RUN:
+	default:
+		break;
+	}
+
+	uint32_t i;
+	for (i = 0; i < NUM_CHANNELS_SIM; i++) {
+		channel_t *ch = &dev->channels[i];
+		if (ch->state != CHANNEL_STATE_WORK) {
+			continue;
+		}
+		if (!time_reached(time_curr_us, ch->time_due_us)) {
+			usbh_poll_request(ch->time_due_us);
+			continue;
+		}
+
+		usbh_packet_callback_data_t cb_data;
+		if (!transaction(dev, ch, &cb_data)) {
+			// NAK: retry as the NAK policy says, or in the interval of the interrupt endpoint
+			const usbh_nak_policy_t *policy = &usbh_nak_policy[ch->packet.endpoint_type];
+			dev->stats.naks++;
+			USBH_TRACE_PACKET(USBH_TRACE_EVENT_NAK, i, &ch->packet, ch->in, 0);
+			usbh_stats_event(dev, &ch->packet, ch->in, USBH_STATS_EVENT_NAK);
+			if (ch->in && ch->naks < UINT16_MAX) {
+				ch->naks++;
+			}
+			if (ch->in && policy->limit && ch->naks >= policy->limit) {
+				// give the channel back, the core queues the transfer again
+				USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_FREE, i, &ch->packet, ch->in, 0);
+				cb_data.status = USBH_PACKET_CALLBACK_STATUS_ENAK;
+				cb_data.transferred_length = 0;
+				ch->state = CHANNEL_STATE_FREE;
+				ch->packet.callback(ch->packet.callback_arg, cb_data);
+				continue;
+			}
+			ch->time_due_us = time_curr_us + frame_us(dev) *
+				(ch->in && policy->retry_frames > 1 ? policy->retry_frames : 1);
+			if (ch->packet.endpoint_type == USBH_ENDPOINT_TYPE_INTERRUPT) {
+				ch->time_due_us = periodic_due(dev, &ch->packet, ch->in);
+			}
+			usbh_poll_request(ch->time_due_us);
+			continue;
+		}
+
+		dev->stats.transfers++;
+		if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK ||
+			cb_data.status == USBH_PACKET_CALLBACK_STATUS_ERRSIZ) {
+			usbh_stats_complete(dev, &ch->packet, ch->in, cb_data.transferred_length,
+				time_curr_us - ch->time_start_us);
+		}
+
+		USBH_TRACE_PACKET(cb_data.status == USBH_PACKET_CALLBACK_STATUS_EFATAL ? USBH_TRACE_EVENT_STALL :
+			cb_data.status == USBH_PACKET_CALLBACK_STATUS_EAGAIN ? USBH_TRACE_EVENT_TXERR : USBH_TRACE_EVENT_XFRC,
+			i, &ch->packet, ch->in, cb_data.transferred_length);
+		USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_FREE, i, &ch->packet, ch->in, cb_data.transferred_length);
+
+		// channel can be reused by the callback
+		ch->state = CHANNEL_STATE_FREE;
+		ch->packet.callback(ch->packet.callback_arg, cb_data);
+	}
+
+	return USBH_POLL_STATUS_NONE;
+}
+
+static enum USBH_SPEED root_speed(void *drvdata)
+{
+	usbh_lld_sim_driver_data_t *dev = drvdata;
+	if (!dev->device) {
+		return USBH_SPEED_FULL;
+	}
+	return dev->device->speed;
+}
+
+void usbh_lld_sim_attach(const usbh_low_level_driver_t *lld, const usbh_lld_sim_device_t *device)
+{
+	usbh_lld_sim_driver_data_t *dev = lld->driver_data;
+	dev->device = device;
+}
+
+void usbh_lld_sim_detach(const usbh_low_level_driver_t *lld)
+{
+	usbh_lld_sim_driver_data_t *dev = lld->driver_data;
+	if (dev->port_state == PORT_STATE_RUN) {
+		dev->port_state = PORT_STATE_DETACH;
+	}
+	dev->device = NULL;
+}
+
+void usbh_lld_sim_inject_txerr(const usbh_low_level_driver_t *lld, uint32_t count)
+{
+	usbh_lld_sim_driver_data_t *dev = lld->driver_data;
+	dev->txerrs_left = count;
+}
+
+void usbh_lld_sim_get_stats(const usbh_low_level_driver_t *lld, usbh_lld_sim_stats_t *stats)
+{
+	const usbh_lld_sim_driver_data_t *dev = lld->driver_data;
+	*stats = dev->stats;
+}
+
+static usbh_lld_sim_driver_data_t driver_data_0;
+const usbh_low_level_driver_t usbh_lld_sim_driver_0 = {
+	.init = init,
+	.poll = poll,
+	.read = read,
+	.write = write,
+	.cancel = cancel,
+	.park = park,
+	.root_speed = root_speed,
+	.driver_data = &driver_data_0
+};
+
+static usbh_lld_sim_driver_data_t driver_data_1;
+const usbh_low_level_driver_t usbh_lld_sim_driver_1 = {
+	.init = init,
+	.poll = poll,
+	.read = read,
+	.write = write,
+	.cancel = cancel,
+	.park = park,
+	.root_speed = root_speed,
+	.driver_data = &driver_data_1
+};
@@ -23,33 +23,132 @@
 #include "driver/usbh_device_driver.h"
 #include "usbh_lld_stm32f4.h"
 #include "usart_helpers.h"
+#include "usbh_trace.h"
+#include "usbh_lld_fifo.h"
 
 #include <string.h>
 #include <stdint.h>
 #include <libopencm3/stm32/otg_hs.h>
 #include <libopencm3/stm32/otg_fs.h>
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+#include <libopencm3/cm3/cortex.h>
+#endif
+
+
+
+/* FIFO RAM in 32-bit words, split between the receive and the transmit FIFOs. */
+#define FIFO_WORDS_FS	(320)
+#define FIFO_WORDS_HS	(1024)
+/* Smallest FIFO in 32-bit words. */
+#define FIFO_MIN_WORDS	(16)
+/* Packet size the FIFOs are split for until endpoints are bound, control endpoints need no more. */
+#define FIFO_PACKET_DEFAULT	(64)
 
+/* Free space of the transmit FIFO in words and of its request queue, fields of GNPTXSTS and HPTXSTS. */
+#define TXSTS_FSAV(txsts)	((txsts) & 0xffff)
+#define TXSTS_QSAV(txsts)	(((txsts) >> 16) & 0xff)
 
+#if defined(USE_STM32F4_USBH_DRIVER_HS_DMA) && !defined(USE_STM32F4_USBH_DRIVER_HS)
+#error USE_STM32F4_USBH_DRIVER_HS_DMA needs USE_STM32F4_USBH_DRIVER_HS
+#endif
+
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+/* Bounce buffer of the channel in bytes, for packets the DMA cannot reach.
+ * Longer ones pass through it by parts of whole packets. */
+#define DMA_BOUNCE_SIZE	(64)
+#define DMA_ENABLED(dev)	((dev)->dma)
+#else
+#define DMA_ENABLED(dev)	(false)
+#endif
 
-/* Receive FIFO size in 32-bit words. */
-#define RX_FIFO_SIZE    (64)
-/* Transmit NON-periodic FIFO size in 32-bit words. */
-#define TX_NP_FIFO_SIZE (64)
-/* Transmit periodic FIFO size in 32-bit words. */
-#define TX_P_FIFO_SIZE  (64)
+/* Periodic endpoints whose next frame is remembered, the least recently due is replaced. */
+#define PERIODIC_ENDPOINTS	(8)
+
+/* Frame number counter of HFNUM, microframes at high speed. */
+#define FRAME_MASK	(0x3fff)
+
+/* Core coupled memory, not connected to the DMA of the OTG_HS core. */
+#define CCM_DATA_RAM_BASE	(0x10000000)
+#define CCM_DATA_RAM_SIZE	(0x10000)
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+/* Completions handed from the interrupt to the poll, power of two. */
+#define IRQ_QUEUE_SIZE	(16)
+#if (IRQ_QUEUE_SIZE & (IRQ_QUEUE_SIZE - 1)) || IRQ_QUEUE_SIZE < USBH_MAX_URBS
+#error IRQ_QUEUE_SIZE must be a power of two holding all the URBs
+#endif
+
+/* Count of enum USBH_STATS_EVENT values, replayed in the poll */
+#define CHANNEL_EVENTS	(USBH_STATS_EVENT_RETRY + 1)
+#endif
 
 enum CHANNEL_STATE {
 	CHANNEL_STATE_FREE = 0,
-	CHANNEL_STATE_WORK = 1
+	CHANNEL_STATE_WORK = 1,
+
+	/// cancelled transfer, waits for channel halted interrupt
+	CHANNEL_STATE_HALT = 2
 };
 
 struct _channel {
 	enum CHANNEL_STATE state;
 	usbh_packet_t packet;
-	uint32_t data_index; //used in receive function
+	uint32_t data_index; //used in receive function, acknowledged OUT data in write
+
+	/// OUT data pushed into the transmit FIFO
+	uint32_t fifo_index;
+	uint32_t time_start_us;
+
+	/// periodic transfer set up, enabled by the poll in the frame before frame_due
+	bool periodic_wait;
+	uint16_t frame_due;
+
+	/// NAKed IN transfer, enabled again by the poll in frame_due
+	bool nak_retry;
+	uint16_t naks;
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+	/// DMA transfers the data through the bounce buffer of the channel
+	bool bounce;
+
+	/// bytes of the part programmed to the DMA, starting at data_index
+	uint16_t dma_length;
+#endif
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	/// bus events counted by the interrupt, @see USBH_STATS_EVENT
+	uint8_t events[CHANNEL_EVENTS];
+#endif
 };
 typedef struct _channel channel_t;
 
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+/**
+ * @brief Transfer completed by the interrupt, waits for the poll to call its callback
+ */
+struct _channel_completion {
+	usbh_packet_t packet;
+	usbh_packet_callback_data_t cb_data;
+	uint32_t time_start_us;
+	bool in;
+	uint8_t events[CHANNEL_EVENTS];
+};
+typedef struct _channel_completion channel_completion_t;
+#endif
+
+/**
+ * @brief Schedule of the interrupt endpoint, kept between its transfers
+ */
+struct _periodic {
+	/// -1 for unused entry
+	int8_t address;
+
+	/// endpoint number ORed with 0x80 for IN
+	uint8_t endpoint;
+
+	/// frame the next transfer of the endpoint is due
+	uint16_t frame_next;
+};
+typedef struct _periodic periodic_t;
+
 enum DEVICE_STATE {
 	DEVICE_STATE_INIT = 0,
 	DEVICE_STATE_RUN = 1,
@@ -68,18 +167,68 @@ struct _usbh_lld_stm32f4_driver_data {
 	const uint32_t base;
 	channel_t *channels;
 	const uint8_t num_channels;
+	const uint16_t fifo_words;
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+	/// channels move the data by the internal DMA instead of the CPU
+	const bool dma;
+	uint32_t (*dma_bounce)[DMA_BOUNCE_SIZE / 4];
+#endif
 
 	uint32_t poll_sequence;
 	enum DEVICE_POLL_STATE dpstate;
 	enum DEVICE_STATE state;
 	uint32_t state_prev;//for reset only
 	uint32_t time_curr_us;
-	uint32_t timestamp_us;
+
+	/// waits of the initialization sequence, port reset and connection
+	usbh_timer_t timer;
+
+	periodic_t periodic[PERIODIC_ENDPOINTS];
+
+	/// largest packets of the bound endpoints: IN, non-periodic OUT and periodic OUT
+	uint16_t fifo_packet_in;
+	uint16_t fifo_packet_np_out;
+	uint16_t fifo_packet_p_out;
+
+	/// sizes of the receive, non-periodic and periodic transmit FIFO in words
+	uint16_t fifo_rx;
+	uint16_t fifo_tx_np;
+	uint16_t fifo_tx_p;
+
+	/// new sizes wait until all channels are free, @see fifo_update()
+	bool fifo_changed;
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	/// single producer (interrupt), single consumer (poll) ring
+	volatile uint32_t queue_head;
+	volatile uint32_t queue_tail;
+	channel_completion_t queue[IRQ_QUEUE_SIZE];
+#endif
 };
 typedef struct _usbh_lld_stm32f4_driver_data usbh_lld_stm32f4_driver_data_t;
 
 
 
+/*
+ * Register accessors. On the target they compile to plain MMIO accesses, the host
+ * build with USBH_LLD_STM32F4_MODEL routes them to the behavioral model of the core
+ * instead, @see usbh_dwc2_model.h
+ */
+#ifdef USBH_LLD_STM32F4_MODEL
+#include "usbh_dwc2_model.h"
+#define OTG_REG_READ(addr)					usbh_dwc2_model_read(addr)
+#define OTG_REG_WRITE(addr, value)			usbh_dwc2_model_write(addr, value)
+#define OTG_FIFO_WRITE(addr, data, length)	usbh_dwc2_model_fifo_write(addr, data, length)
+#define OTG_FIFO_READ(addr, data, length)	usbh_dwc2_model_fifo_read(addr, data, length)
+#define OTG_DMA_ADDR(data)					usbh_dwc2_model_dma_addr(data)
+#else
+#define OTG_REG_READ(addr)					MMIO32(addr)
+#define OTG_REG_WRITE(addr, value)			(MMIO32(addr) = (value))
+#define OTG_FIFO_WRITE(addr, data, length)	usbh_fifo_write(&MMIO32(addr), data, length)
+#define OTG_FIFO_READ(addr, data, length)	usbh_fifo_read(&MMIO32(addr), data, length)
+#define OTG_DMA_ADDR(data)					((uint32_t)(uintptr_t)(data))
+#endif
+
 /*
  * Define correct REBASE. If only one driver is enabled use directly OTG base
  *
@@ -89,30 +238,46 @@ typedef struct _usbh_lld_stm32f4_driver_data usbh_lld_stm32f4_driver_data_t;
 
 #if 	defined(USE_STM32F4_USBH_DRIVER_FS) && \
 		defined(USE_STM32F4_USBH_DRIVER_HS)
-#define REBASE(reg)				MMIO32(dev->base + reg)
-#define REBASE_CH(reg, x)	MMIO32(dev->base + reg(x))
+#define REBASE_ADDR(reg)		(dev->base + (reg))
 #elif defined(USE_STM32F4_USBH_DRIVER_FS)
-#define REBASE(reg)				MMIO32(USB_OTG_FS_BASE + reg)
-#define REBASE_CH(reg, x)	MMIO32(USB_OTG_FS_BASE + reg(x))
+#define REBASE_ADDR(reg)		(USB_OTG_FS_BASE + (reg))
 #elif defined(USE_STM32F4_USBH_DRIVER_HS)
-#define REBASE(reg)				MMIO32(USB_OTG_HS_BASE + reg)
-#define REBASE_CH(reg, x)	MMIO32(USB_OTG_HS_BASE + reg(x))
+#define REBASE_ADDR(reg)		(USB_OTG_HS_BASE + (reg))
 #endif
 
+#define REBASE(reg)							OTG_REG_READ(REBASE_ADDR(reg))
+#define REBASE_WRITE(reg, value)			OTG_REG_WRITE(REBASE_ADDR(reg), value)
+#define REBASE_CH(reg, x)					REBASE(reg(x))
+#define REBASE_CH_WRITE(reg, x, value)		REBASE_WRITE(reg(x), value)
+#define REBASE_FIFO_WRITE(x, data, length)	OTG_FIFO_WRITE(REBASE_ADDR(OTG_FIFO(x)), data, length)
+#define REBASE_FIFO_READ(x, data, length)	OTG_FIFO_READ(REBASE_ADDR(OTG_FIFO(x)), data, length)
+
 static int8_t get_free_channel(void *drvdata);
 static void channels_init(void *drvdata);
 static void rxflvl_handle(void *drvdata);
 static void free_channel(void *drvdata, uint8_t channel);
+static enum USBH_SPEED root_speed(void *drvdata);
 
 
 
 
 
+/**
+ * Time between the polls while a transfer is in progress
+ */
+static uint32_t frame_us(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	if (root_speed(dev) == USBH_SPEED_HIGH) {
+		return 125;
+	}
+	return 1000;
+}
+
 static inline void reset_start(usbh_lld_stm32f4_driver_data_t *dev)
 {
 
 	// apply reset condition on port
-	REBASE(OTG_HPRT) |= OTG_HPRT_PRST;
+	REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) | OTG_HPRT_PRST);
 
 	// push current state to stack
 	dev->state_prev = dev->state;
@@ -121,7 +286,7 @@ static inline void reset_start(usbh_lld_stm32f4_driver_data_t *dev)
 	dev->state = DEVICE_STATE_RESET;
 
 	// schedule disable reset condition after ~10ms
-	dev->timestamp_us = dev->time_curr_us;
+	usbh_timer_start(&dev->timer, 10000, NULL, NULL);
 }
 
 /**
@@ -133,13 +298,13 @@ static void init(void *drvdata)
 	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
 	dev->state = DEVICE_STATE_INIT;
 	dev->poll_sequence = 0;
-	dev->timestamp_us = dev->time_curr_us;
+	usbh_timer_stop(&dev->timer);
 
 	//Disable interrupts first
-	REBASE(OTG_GAHBCFG) &= ~OTG_GAHBCFG_GINT;
+	REBASE_WRITE(OTG_GAHBCFG, REBASE(OTG_GAHBCFG) & ~OTG_GAHBCFG_GINT);
 
 	// Select full speed phy
-	REBASE(OTG_GUSBCFG) |= OTG_GUSBCFG_PHYSEL;
+	REBASE_WRITE(OTG_GUSBCFG, REBASE(OTG_GUSBCFG) | OTG_GUSBCFG_PHYSEL);
 }
 
 static uint32_t usbh_to_stm32_endpoint_type(enum USBH_ENDPOINT_TYPE usbh_eptyp)
@@ -148,9 +313,7 @@ static uint32_t usbh_to_stm32_endpoint_type(enum USBH_ENDPOINT_TYPE usbh_eptyp)
 	case USBH_ENDPOINT_TYPE_CONTROL: return OTG_HCCHAR_EPTYP_CONTROL;
 	case USBH_ENDPOINT_TYPE_BULK: return OTG_HCCHAR_EPTYP_BULK;
 
-	// Use bulk transfer also for interrupt, since no difference is on protocol layer
-	// Except different behaviour of the core
-	case USBH_ENDPOINT_TYPE_INTERRUPT: return OTG_HCCHAR_EPTYP_BULK;
+	case USBH_ENDPOINT_TYPE_INTERRUPT: return OTG_HCCHAR_EPTYP_INTERRUPT;
 	case USBH_ENDPOINT_TYPE_ISOCHRONOUS: return OTG_HCCHAR_EPTYP_ISOCHRONOUS;
 	default:
 		LOG_PRINTF("\n\n\n\nWRONG EP TYPE\n\n\n\n\n");
@@ -158,6 +321,319 @@ static uint32_t usbh_to_stm32_endpoint_type(enum USBH_ENDPOINT_TYPE usbh_eptyp)
 	}
 }
 
+static uint16_t frame_curr(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	(void)dev;
+	return REBASE(OTG_HFNUM) & FRAME_MASK;
+}
+
+/**
+ * @returns frame_a - frame_b, frame numbers wrap around
+ */
+static int16_t frame_diff(uint16_t frame_a, uint16_t frame_b)
+{
+	return (int16_t)(((frame_a - frame_b) & FRAME_MASK) << 2) >> 2;
+}
+
+/**
+ * Period of the interrupt endpoint in (micro)frames of the root port
+ */
+static uint16_t periodic_frames(usbh_lld_stm32f4_driver_data_t *dev, const usbh_packet_t *packet)
+{
+	uint8_t interval = packet->interval ? packet->interval : 1;
+
+	if (packet->speed == USBH_SPEED_HIGH) {
+		// 2^(bInterval-1) microframes, limited to keep the distance of frames comparable
+		return 1 << (interval > 13 ? 12 : interval - 1);
+	}
+	if (root_speed(dev) == USBH_SPEED_HIGH) {
+		return interval * 8;
+	}
+	return interval;
+}
+
+/**
+ * Find the schedule of the endpoint, or replace the least recently due one by it
+ */
+static periodic_t *periodic_find(usbh_lld_stm32f4_driver_data_t *dev, const usbh_packet_t *packet, bool in)
+{
+	const uint8_t endpoint = packet->endpoint_address | (in ? 0x80 : 0);
+	periodic_t *oldest = NULL;
+	uint32_t i;
+
+	for (i = 0; i < PERIODIC_ENDPOINTS; i++) {
+		periodic_t *periodic = &dev->periodic[i];
+		if (periodic->address == packet->address && periodic->endpoint == endpoint) {
+			return periodic;
+		}
+		if (!oldest || (oldest->address != -1 && (periodic->address == -1 ||
+			frame_diff(periodic->frame_next, oldest->frame_next) < 0))) {
+			oldest = periodic;
+		}
+	}
+
+	oldest->address = packet->address;
+	oldest->endpoint = endpoint;
+	oldest->frame_next = frame_curr(dev);
+	return oldest;
+}
+
+static bool channel_periodic(const channel_t *ch)
+{
+	return ch->packet.endpoint_type == USBH_ENDPOINT_TYPE_INTERRUPT ||
+		ch->packet.endpoint_type == USBH_ENDPOINT_TYPE_ISOCHRONOUS;
+}
+
+/**
+ * Check the enabled OUT channel has data not pushed into its transmit FIFO yet
+ */
+static bool channel_fifo_pending(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	const channel_t *ch = &dev->channels[channel];
+	const uint32_t hcchar = REBASE_CH(OTG_HCCHAR, channel);
+
+	// halting channel takes no more data
+	return !DMA_ENABLED(dev) && ch->state == CHANNEL_STATE_WORK &&
+		!(hcchar & OTG_HCCHAR_EPDIR_IN) &&
+		(hcchar & (OTG_HCCHAR_CHENA | OTG_HCCHAR_CHDIS)) == OTG_HCCHAR_CHENA &&
+		ch->fifo_index < ch->packet.datalen;
+}
+
+/**
+ * Push the OUT packets of the channel into the transmit FIFO, as many as there is space for
+ *
+ * The core sends a packet once it is complete in the FIFO, so only whole packets
+ * are pushed. The rest is pushed when the FIFO becomes empty, @see channels_fifo_fill()
+ */
+static void channel_fifo_fill(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	channel_t *ch = &dev->channels[channel];
+	const bool periodic = channel_periodic(ch);
+
+	while (ch->fifo_index < ch->packet.datalen) {
+		uint32_t length = ch->packet.datalen - ch->fifo_index;
+		if (length > ch->packet.endpoint_size_max) {
+			length = ch->packet.endpoint_size_max;
+		}
+
+		const uint32_t txsts = periodic ? REBASE(OTG_HPTXSTS) : REBASE(OTG_GNPTXSTS);
+		if (TXSTS_FSAV(txsts) < (length + 3) / 4 || !TXSTS_QSAV(txsts)) {
+			return;
+		}
+		// the core pushes into the transmit FIFO of the channel type
+		REBASE_FIFO_WRITE(channel, (const uint8_t *)ch->packet.data.out + ch->fifo_index, length);
+		ch->fifo_index += length;
+	}
+}
+
+/**
+ * Continue the OUT transfers larger than the free space of the transmit FIFO
+ *
+ * In the interrupt mode, FIFO empty interrupts stay unmasked while some data waits.
+ */
+static void channels_fifo_fill(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	uint32_t gintmsk = REBASE(OTG_GINTMSK) & ~(OTG_GINTMSK_NPTXFEM | OTG_GINTMSK_PTXFEM);
+	uint32_t channel;
+
+	for (channel = 0; channel < dev->num_channels; channel++) {
+		if (!channel_fifo_pending(dev, channel)) {
+			continue;
+		}
+		channel_fifo_fill(dev, channel);
+		if (channel_fifo_pending(dev, channel)) {
+			gintmsk |= channel_periodic(&dev->channels[channel]) ?
+				OTG_GINTMSK_PTXFEM : OTG_GINTMSK_NPTXFEM;
+		}
+	}
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	REBASE_WRITE(OTG_GINTMSK, gintmsk);
+#else
+	(void)gintmsk;
+#endif
+}
+
+/**
+ * Enable the periodic channel if it is due in the next frame
+ */
+static void channel_periodic_start(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	channel_t *ch = &dev->channels[channel];
+	const uint16_t frame_next = (frame_curr(dev) + 1) & FRAME_MASK;
+
+	if (frame_diff(ch->frame_due, frame_next) > 0) {
+		return;
+	}
+	ch->periodic_wait = false;
+	ch->time_start_us = dev->time_curr_us;
+
+	// transaction is issued in the frame of the same parity
+	uint32_t hcchar = REBASE_CH(OTG_HCCHAR, channel) & ~OTG_HCCHAR_ODDFRM;
+	if (frame_next & 1) {
+		hcchar |= OTG_HCCHAR_ODDFRM;
+	}
+	REBASE_CH_WRITE(OTG_HCCHAR, channel, hcchar | OTG_HCCHAR_CHENA);
+
+	if (channel_fifo_pending(dev, channel)) {
+		channels_fifo_fill(dev);
+	}
+}
+
+/**
+ * Set the channel of the interrupt endpoint up for the frame its next transfer is due
+ *
+ * Overdue endpoints are served in the next frame
+ */
+static void channel_periodic_schedule(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	channel_t *ch = &dev->channels[channel];
+	const bool in = REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN;
+	periodic_t *periodic = periodic_find(dev, &ch->packet, in);
+	const uint16_t frame_next = (frame_curr(dev) + 1) & FRAME_MASK;
+
+	if (frame_diff(periodic->frame_next, frame_next) < 0) {
+		periodic->frame_next = frame_next;
+	}
+	ch->frame_due = periodic->frame_next;
+	periodic->frame_next = (periodic->frame_next + periodic_frames(dev, &ch->packet)) & FRAME_MASK;
+
+	ch->periodic_wait = true;
+	channel_periodic_start(dev, channel);
+}
+
+/**
+ * Enable the periodic channels due in the next frame
+ */
+static void channels_periodic_start(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	channel_t *channels = dev->channels;
+	uint32_t channel;
+
+	for (channel = 0; channel < dev->num_channels; channel++) {
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		uint32_t mask = cm_mask_interrupts(1);
+#endif
+		if (channels[channel].state == CHANNEL_STATE_WORK && channels[channel].periodic_wait) {
+			channel_periodic_start(dev, channel);
+		}
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		cm_mask_interrupts(mask);
+#endif
+	}
+}
+
+/**
+ * Split the FIFO RAM for the largest packets of the bound endpoints
+ *
+ * Each FIFO holds two packets at least, so the next one is transferred while the
+ * previous one is processed. The receive FIFO also holds the status of each channel.
+ * The rest goes to the receive and non-periodic transmit FIFOs, by their need.
+ */
+static void fifo_split(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	uint32_t words = dev->fifo_words;
+	if (DMA_ENABLED(dev)) {
+		// the core keeps the DMA addresses of the channels at the end of the FIFO RAM
+		words -= dev->num_channels;
+	}
+
+	uint32_t rx = 2 * ((dev->fifo_packet_in + 3) / 4 + 1) + dev->num_channels;
+	uint32_t tx_np = 2 * ((dev->fifo_packet_np_out + 3) / 4);
+	uint32_t tx_p = 2 * ((dev->fifo_packet_p_out + 3) / 4);
+	if (tx_np < FIFO_MIN_WORDS) {
+		tx_np = FIFO_MIN_WORDS;
+	}
+	if (tx_p < FIFO_MIN_WORDS) {
+		tx_p = FIFO_MIN_WORDS;
+	}
+
+	if (rx + tx_np + tx_p > words) {
+		LOG_PRINTF("FIFO RAM of %d words too small for %d/%d/%d\n", words, rx, tx_np, tx_p);
+		rx = words / 3;
+		tx_np = words / 3;
+		tx_p = words - rx - tx_np;
+	} else {
+		const uint32_t spare = words - rx - tx_np - tx_p;
+		const uint32_t spare_rx = spare * rx / (rx + tx_np);
+		rx += spare_rx;
+		tx_np += spare - spare_rx;
+	}
+
+	if (rx != dev->fifo_rx || tx_np != dev->fifo_tx_np || tx_p != dev->fifo_tx_p) {
+		dev->fifo_rx = rx;
+		dev->fifo_tx_np = tx_np;
+		dev->fifo_tx_p = tx_p;
+		dev->fifo_changed = true;
+	}
+}
+
+/**
+ * Program the FIFO sizes, FIFOs must be flushed after this
+ */
+static void fifo_configure(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	REBASE_WRITE(OTG_GRXFSIZ, dev->fifo_rx);
+	REBASE_WRITE(OTG_GNPTXFSIZ, (dev->fifo_tx_np << 16) | dev->fifo_rx);
+	REBASE_WRITE(OTG_HPTXFSIZ, (dev->fifo_tx_p << 16) | (dev->fifo_rx + dev->fifo_tx_np));
+	dev->fifo_changed = false;
+	LOG_PRINTF("FIFO split %d/%d/%d words\n", dev->fifo_rx, dev->fifo_tx_np, dev->fifo_tx_p);
+}
+
+/**
+ * Apply the new FIFO split, once no channel works
+ */
+static void fifo_update(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	uint32_t channel;
+
+	for (channel = 0; channel < dev->num_channels; channel++) {
+		if (dev->channels[channel].state != CHANNEL_STATE_FREE ||
+			(REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_CHENA)) {
+			return;
+		}
+	}
+
+	fifo_configure(dev);
+
+	// FIFOs are empty, the flush takes a few cycles of the PHY clock
+	REBASE_WRITE(OTG_GRSTCTL, REBASE(OTG_GRSTCTL) | OTG_GRSTCTL_RXFFLSH);
+	while (REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_RXFFLSH);
+	REBASE_WRITE(OTG_GRSTCTL, REBASE(OTG_GRSTCTL) | OTG_GRSTCTL_TXFFLSH | (0x10 << 6));
+	while (REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_TXFFLSH);
+}
+
+/**
+ * Forget the endpoints of the detached devices
+ */
+static void fifo_reset(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	dev->fifo_packet_in = FIFO_PACKET_DEFAULT;
+	dev->fifo_packet_np_out = FIFO_PACKET_DEFAULT;
+	dev->fifo_packet_p_out = 0;
+	fifo_split(dev);
+}
+
+/**
+ * FIFOs are split again for the endpoint, when the channels are free
+ */
+static void endpoint(void *drvdata, enum USBH_ENDPOINT_TYPE type, bool in, uint16_t max_packet_size)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+	uint16_t *packet;
+
+	if (in) {
+		packet = &dev->fifo_packet_in;
+	} else if (type == USBH_ENDPOINT_TYPE_INTERRUPT || type == USBH_ENDPOINT_TYPE_ISOCHRONOUS) {
+		packet = &dev->fifo_packet_p_out;
+	} else {
+		packet = &dev->fifo_packet_np_out;
+	}
+	if (max_packet_size > *packet) {
+		*packet = max_packet_size;
+		fifo_split(dev);
+	}
+}
+
 static void stm32f4_usbh_port_channel_setup(
 	void *drvdata, uint32_t channel, uint32_t epdir)
 {
@@ -173,8 +649,7 @@ static void stm32f4_usbh_port_channel_setup(
 		speed = OTG_HCCHAR_LSDEV;
 	}
 
-	REBASE_CH(OTG_HCCHAR, channel) = OTG_HCCHAR_CHENA |
-				(OTG_HCCHAR_DAD_MASK & (address << 22)) |
+	const uint32_t hcchar = (OTG_HCCHAR_DAD_MASK & (address << 22)) |
 				OTG_HCCHAR_MCNT_1 |
 				(OTG_HCCHAR_EPTYP_MASK & (eptyp)) |
 				(speed) |
@@ -182,30 +657,134 @@ static void stm32f4_usbh_port_channel_setup(
 				(OTG_HCCHAR_EPNUM_MASK & (epnum << 11)) |
 				(OTG_HCCHAR_MPSIZ_MASK & max_packet_size);
 
+	if (channels[channel].packet.endpoint_type == USBH_ENDPOINT_TYPE_INTERRUPT) {
+		REBASE_CH_WRITE(OTG_HCCHAR, channel, hcchar);
+		channel_periodic_schedule(dev, channel);
+	} else {
+		REBASE_CH_WRITE(OTG_HCCHAR, channel, hcchar | OTG_HCCHAR_CHENA);
+	}
 }
 
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+/**
+ * Check the DMA can transfer the packet data in place
+ */
+static bool dma_direct(const void *data, uint32_t datalen, bool in)
+{
+	const uintptr_t addr = (uintptr_t)data;
+
+	if (!datalen) {
+		return true;
+	}
+
+	// DMA accesses whole words only
+	if ((addr & 3) || (in && (datalen & 3))) {
+		return false;
+	}
+
+	if (addr >= CCM_DATA_RAM_BASE && addr < CCM_DATA_RAM_BASE + CCM_DATA_RAM_SIZE) {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Point the DMA of the channel to the rest of the packet data, or to the bounce buffer
+ *
+ * Data the DMA cannot reach in place are moved through the bounce buffer, as many
+ * whole packets at once as it holds. HCTSIZ is programmed for that part, the next
+ * one is set up when it completes, @see channel_dma_service().
+ * Must be called before the channel is enabled
+ */
+static void channel_dma_setup(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, bool in)
+{
+	channel_t *ch = &dev->channels[channel];
+	uint32_t *bounce = dev->dma_bounce[channel];
+	const uint8_t *data = (const uint8_t *)ch->packet.data.out + ch->data_index;
+	const uint16_t mps = ch->packet.endpoint_size_max;
+	uint32_t length = ch->packet.datalen - ch->data_index;
+
+	ch->bounce = !dma_direct(data, length, in);
+	if (ch->bounce && length > DMA_BOUNCE_SIZE) {
+		length = DMA_BOUNCE_SIZE - DMA_BOUNCE_SIZE % mps;
+	}
+	ch->dma_length = length;
+
+	if (length != ch->packet.datalen) {
+		// data PID is kept, as the core left it after the previous part
+		const uint32_t dpid = REBASE_CH(OTG_HCTSIZ, channel) & OTG_HCTSIZ_DPID_MASK;
+		const uint32_t num_packets = ((length - 1) / mps) + 1;
+		REBASE_CH_WRITE(OTG_HCTSIZ, channel, dpid | (num_packets << 19) | length);
+	}
+
+	if (!ch->bounce) {
+		REBASE_CH_WRITE(OTG_HCDMA, channel, OTG_DMA_ADDR(data));
+		return;
+	}
+
+	if (!in) {
+		memcpy(bounce, data, length);
+	}
+	REBASE_CH_WRITE(OTG_HCDMA, channel, OTG_DMA_ADDR(bounce));
+}
+
+/**
+ * Account the data the DMA has moved in the programmed part of the transfer
+ */
+static void channel_dma_done(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, bool in,
+	uint32_t length)
+{
+	channel_t *ch = &dev->channels[channel];
+
+	if (in && ch->bounce) {
+		memcpy((uint8_t *)ch->packet.data.in + ch->data_index, dev->dma_bounce[channel], length);
+	}
+	ch->data_index += length;
+}
+
+/**
+ * Reject the packets which neither the DMA nor the bounce buffer can transfer
+ *
+ * Only the packets of the endpoints whose max packet size exceeds the bounce buffer
+ * are rejected, the others go through the bounce buffer by parts. Partial transfers
+ * retried by the core continue at a multiple of the max packet size, so the packet
+ * stays transferable after it is validated. Cortex-M4 has no data cache to be maintained.
+ */
+static bool validate(void *drvdata, const usbh_packet_t *packet, bool in)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+
+	if (!DMA_ENABLED(dev) || dma_direct(packet->data.out, packet->datalen, in)) {
+		return true;
+	}
+	if (packet->endpoint_size_max > DMA_BOUNCE_SIZE) {
+		LOG_PRINTF("DMA cannot reach packets of %d bytes at %08X\n", packet->endpoint_size_max,
+			(uint32_t)(uintptr_t)packet->data.out);
+		return false;
+	}
+	return true;
+}
+#endif
+
 
 /**
  * TODO: Check for maximum datalength
  */
-static void read(void *drvdata, usbh_packet_t *packet)
+static bool read(void *drvdata, usbh_packet_t *packet)
 {
 	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
 	channel_t *channels = dev->channels;
 
 	int8_t channel = get_free_channel(dev);
 	if (channel == -1) {
-		// BIG PROBLEM
-		LOG_PRINTF("FATAL ERROR IN, NO CHANNEL LEFT \n");
-		usbh_packet_callback_data_t cb_data;
-		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
-		cb_data.transferred_length = 0;
-		packet->callback(packet->callback_arg, cb_data);
-		return;
+		// core keeps the packet queued until some channel is free
+		return false;
 	}
 
 	channels[channel].data_index = 0;
 	channels[channel].packet = *packet;
+	channels[channel].time_start_us = dev->time_curr_us;
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_ALLOC, channel, packet, true, packet->datalen);
 
 	uint32_t dpid;
 	if (packet->toggle[0]) {
@@ -221,16 +800,26 @@ static void read(void *drvdata, usbh_packet_t *packet)
 		num_packets = 0;
 	}
 
-	REBASE_CH(OTG_HCTSIZ, channel) = dpid | (num_packets << 19) | packet->datalen;
+	REBASE_CH_WRITE(OTG_HCTSIZ, channel, dpid | (num_packets << 19) | packet->datalen);
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+	if (DMA_ENABLED(dev)) {
+		channel_dma_setup(dev, channel, true);
+	}
+#endif
 
 	stm32f4_usbh_port_channel_setup(dev, channel, OTG_HCCHAR_EPDIR_IN);
+#ifndef USE_STM32F4_USBH_DRIVER_IRQ
+	usbh_poll_request(dev->time_curr_us + frame_us(dev));
+#endif
+	return true;
 }
 
 /**
+ * Start the OUT transfer, all its packets are programmed to the channel at once
  *
- * 	Bug: datalen > max_packet_size ...
+ * Without the DMA, the data are pushed into the transmit FIFO as it has free space.
  */
-static void write(void *drvdata, const usbh_packet_t *packet)
+static bool write(void *drvdata, const usbh_packet_t *packet)
 {
 	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
 	channel_t *channels = dev->channels;
@@ -238,17 +827,15 @@ static void write(void *drvdata, const usbh_packet_t *packet)
 	int8_t channel = get_free_channel(dev);
 
 	if (channel == -1) {
-		// BIG PROBLEM
-		LOG_PRINTF("FATAL ERROR OUT, NO CHANNEL LEFT \n");
-		usbh_packet_callback_data_t cb_data;
-		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
-		cb_data.transferred_length = 0;
-		packet->callback(packet->callback_arg, cb_data);
-		return;
+		// core keeps the packet queued until some channel is free
+		return false;
 	}
 
 	channels[channel].data_index = 0;
+	channels[channel].fifo_index = 0;
 	channels[channel].packet = *packet;
+	channels[channel].time_start_us = dev->time_curr_us;
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_ALLOC, channel, packet, false, packet->datalen);
 
 	uint32_t dpid;
 	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_CONTROL) {
@@ -273,43 +860,100 @@ static void write(void *drvdata, const usbh_packet_t *packet)
 	} else {
 		num_packets = 1;
 	}
-	REBASE_CH(OTG_HCTSIZ, channel) = dpid | (num_packets << 19) | packet->datalen;
+	REBASE_CH_WRITE(OTG_HCTSIZ, channel, dpid | (num_packets << 19) | packet->datalen);
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+	if (DMA_ENABLED(dev)) {
+		channel_dma_setup(dev, channel, false);
+	}
+#endif
 
 	stm32f4_usbh_port_channel_setup(dev, channel, OTG_HCCHAR_EPDIR_OUT);
 
-	if (packet->endpoint_type == USBH_ENDPOINT_TYPE_CONTROL ||
-		packet->endpoint_type == USBH_ENDPOINT_TYPE_BULK) {
+	// data is fetched by the DMA, interrupt data are pushed when the channel is due
+	if (channel_fifo_pending(dev, channel)) {
+		LOG_PRINTF("\nSending[%d]\n", packet->datalen);
+		channels_fifo_fill(dev);
+	}
+	LOG_PRINTF("->WRITE %08X\n", REBASE_CH(OTG_HCCHAR, channel));
+#ifndef USE_STM32F4_USBH_DRIVER_IRQ
+	usbh_poll_request(dev->time_curr_us + frame_us(dev));
+#endif
+	return true;
+}
+
+/**
+ * Take the channel from its transfer, late events of the transfer are not reported
+ */
+static void channel_halt(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	channel_t *channels = dev->channels;
 
-		volatile uint32_t *fifo = &REBASE_CH(OTG_FIFO, channel) + RX_FIFO_SIZE;
-		const uint32_t * buf32 = packet->data.out;
-		int i;
-		LOG_PRINTF("\nSending[%d]: ", packet->datalen);
-		for(i = packet->datalen; i >= 4; i-=4) {
-			const uint8_t *buf8 = (const uint8_t *)buf32;
-			LOG_PRINTF("%02X %02X %02X %02X, ", buf8[0], buf8[1], buf8[2], buf8[3]);
-			*fifo++ = *buf32++;
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_FREE, channel, &channels[channel].packet,
+		REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN, channels[channel].data_index);
+	LOG_PRINTF("\nHalting channel %d\n", channel);
 
+	if (REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_CHENA) {
+		// channel is freed by the channel halted interrupt
+		REBASE_CH_WRITE(OTG_HCCHAR, channel, REBASE_CH(OTG_HCCHAR, channel) | OTG_HCCHAR_CHDIS | OTG_HCCHAR_CHENA);
+		channels[channel].state = CHANNEL_STATE_HALT;
+	} else {
+		channels[channel].state = CHANNEL_STATE_FREE;
+	}
+}
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+/**
+ * Count the bus events the interrupt has recorded for the completed transfer
+ */
+static void irq_queue_stats(usbh_lld_stm32f4_driver_data_t *dev, const channel_completion_t *entry)
+{
+	uint32_t event;
+	for (event = 0; event < CHANNEL_EVENTS; event++) {
+		uint32_t count;
+		for (count = 0; count < entry->events[event]; count++) {
+			usbh_stats_event(dev, &entry->packet, entry->in, event);
 		}
+	}
+}
+#endif
 
-		if (i > 0) {
-			*fifo = *buf32&((1 << (8*i)) - 1);
-			uint8_t *buf8 = (uint8_t *)buf32;
-			while (i--) {
-				LOG_PRINTF("%02X ", *buf8++);
-			}
+static bool cancel(void *drvdata, const usbh_packet_t *packet)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+	channel_t *channels = dev->channels;
+	uint32_t channel;
+
+	for (channel = 0; channel < dev->num_channels; channel++) {
+		if (channels[channel].state != CHANNEL_STATE_WORK ||
+			channels[channel].packet.callback_arg != packet->callback_arg) {
+			continue;
 		}
-		LOG_PRINTF("\n");
 
-	} else {
-		volatile uint32_t *fifo = &REBASE_CH(OTG_FIFO, channel) +
-			RX_FIFO_SIZE + TX_NP_FIFO_SIZE;
-		const uint32_t * buf32 = packet->data.out;
-		int i;
-		for(i = packet->datalen; i > 0; i-=4) {
-			*fifo++ = *buf32++;
+		channel_halt(dev, channel);
+		return true;
+	}
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	// completed by the interrupt, the callback waits for the poll. The core may reuse
+	// the URB once it handles the cancelled transfer, so the completion is removed
+	// from the queue, which then keeps one entry per URB at most. The interrupt
+	// is masked here, @see cancel_irq()
+	uint32_t i;
+	for (i = dev->queue_tail; i != dev->queue_head; i++) {
+		channel_completion_t *entry = &dev->queue[i & (IRQ_QUEUE_SIZE - 1)];
+		if (entry->packet.callback_arg != packet->callback_arg) {
+			continue;
+		}
+
+		irq_queue_stats(dev, entry);
+		for (i++; i != dev->queue_head; i++) {
+			dev->queue[(i - 1) & (IRQ_QUEUE_SIZE - 1)] = dev->queue[i & (IRQ_QUEUE_SIZE - 1)];
 		}
+		dev->queue_head--;
+		return true;
 	}
-	LOG_PRINTF("->WRITE %08X\n", REBASE_CH(OTG_HCCHAR, channel));
+#endif
+	return false;
 }
 
 static void rxflvl_handle(void *drvdata)
@@ -319,29 +963,27 @@ static void rxflvl_handle(void *drvdata)
 	uint32_t rxstsp = REBASE(OTG_GRXSTSP);
 	uint8_t channel = rxstsp&0xf;
 	uint32_t len = (rxstsp>>4) & 0x1ff;
-	if ((rxstsp&OTG_GRXSTSP_PKTSTS_MASK) == OTG_GRXSTSP_PKTSTS_IN) {
+	if ((rxstsp&OTG_GRXSTSP_PKTSTS_MASK) == OTG_GRXSTSP_PKTSTS_IN &&
+		channels[channel].state == CHANNEL_STATE_HALT) {
+		// buffer of the cancelled transfer may be in use again, drop the data
+		uint32_t i;
+		for (i = 0; i < len; i += 4) {
+			(void)REBASE_CH(OTG_FIFO, channel);
+		}
+	} else if ((rxstsp&OTG_GRXSTSP_PKTSTS_MASK) == OTG_GRXSTSP_PKTSTS_IN) {
 		uint8_t *data = channels[channel].packet.data.in;
-		uint32_t *buf32 = (uint32_t *)&data[channels[channel].data_index];
 
-		int32_t i;
-		uint32_t extra;
 		if (!len) {
 			return;
 		}
 		// Receive data from fifo
-		volatile uint32_t *fifo = &REBASE_CH(OTG_FIFO, channel);
-		for (i = len; i > 4; i -= 4) {
-			*buf32++ = *fifo++;
-		}
-		extra = *fifo;
-
-		memcpy(buf32, &extra, i);
+		REBASE_FIFO_READ(channel, &data[channels[channel].data_index], len);
 		channels[channel].data_index += len;
 
 		// If transfer not complete, Enable channel to continue
 		if ( channels[channel].data_index < channels[channel].packet.datalen) {
 			if (len == channels[channel].packet.endpoint_size_max) {
-				REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+				REBASE_CH_WRITE(OTG_HCCHAR, channel, REBASE_CH(OTG_HCCHAR, channel) | OTG_HCCHAR_CHENA);
 				LOG_PRINTF("CHENA[%d/%d] ", channels[channel].data_index, channels[channel].packet.datalen);
 			}
 
@@ -364,174 +1006,425 @@ static void rxflvl_handle(void *drvdata)
 }
 
 
-static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
+/**
+ * Count the bus event of the channel
+ */
+static void channel_event(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, bool in,
+	enum USBH_STATS_EVENT event)
 {
-	channel_t *channels = dev->channels;
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	(void)in;
+	if (dev->channels[channel].events[event] < UINT8_MAX) {
+		dev->channels[channel].events[event]++;
+	}
+#else
+	usbh_stats_event(dev, &dev->channels[channel].packet, in, event);
+#endif
+}
 
-	if (dev->dpstate == DEVICE_POLL_STATE_DISCONN) {
-		REBASE(OTG_GINTSTS) = REBASE(OTG_GINTSTS);
-		// Check for connection of device
-		if ((REBASE(OTG_HPRT) & OTG_HPRT_PCDET)  &&
-			(REBASE(OTG_HPRT) & OTG_HPRT_PCSTS) ) {
+/**
+ * Report the completed transfer to the core, always in the context of the poll
+ */
+static void channel_report(usbh_lld_stm32f4_driver_data_t *dev, const usbh_packet_t *packet,
+	bool in, uint32_t time_start_us, usbh_packet_callback_data_t cb_data)
+{
+	if (cb_data.status == USBH_PACKET_CALLBACK_STATUS_OK ||
+		cb_data.status == USBH_PACKET_CALLBACK_STATUS_ERRSIZ) {
+		usbh_stats_complete(dev, packet, in, cb_data.transferred_length,
+			dev->time_curr_us - time_start_us);
+	}
+	packet->callback(packet->callback_arg, cb_data);
+}
 
-			dev->dpstate = DEVICE_POLL_STATE_DEVCONN;
-			dev->timestamp_us = dev->time_curr_us;
-			return USBH_POLL_STATUS_NONE;
-		}
+/**
+ * The transfer of the channel has ended, the channel itself has already been freed
+ */
+static void channel_complete(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, bool in,
+	usbh_packet_callback_data_t cb_data)
+{
+	channel_t *ch = &dev->channels[channel];
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	// one transfer per URB at most, so the queue never overflows
+	channel_completion_t *entry = &dev->queue[dev->queue_head & (IRQ_QUEUE_SIZE - 1)];
+
+	entry->packet = ch->packet;
+	entry->cb_data = cb_data;
+	entry->time_start_us = ch->time_start_us;
+	entry->in = in;
+	memcpy(entry->events, ch->events, sizeof(entry->events));
+	memset(ch->events, 0, sizeof(ch->events));
+
+	__sync_synchronize();
+	dev->queue_head++;
+#else
+	channel_report(dev, &ch->packet, in, ch->time_start_us, cb_data);
+#endif
+}
+
+/**
+ * Take the data toggle of the next transfer of the endpoint from the channel
+ *
+ * The core advances HCTSIZ.DPID with every acknowledged packet. ACK interrupts
+ * of several packets merge into one between the services, so they are not counted.
+ */
+static void channel_toggle_update(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, bool in)
+{
+	channel_t *ch = &dev->channels[channel];
+
+	if (!in && ch->packet.endpoint_type == USBH_ENDPOINT_TYPE_CONTROL) {
+		// data or status stage after the setup and the status after OUT data start with DATA1
+		ch->packet.toggle[0] = 1;
+	} else {
+		ch->packet.toggle[0] =
+			(REBASE_CH(OTG_HCTSIZ, channel) & OTG_HCTSIZ_DPID_MASK) == OTG_HCTSIZ_DPID_DATA1;
 	}
+}
 
-	if (dev->dpstate == DEVICE_POLL_STATE_DEVCONN) {
-		// May be other condition, e.g. Debounce done,
-		// using 0.5s wait by default
-		if (dev->time_curr_us - dev->timestamp_us < 500000) {
-			return USBH_POLL_STATUS_NONE;
-		}
+/**
+ * @returns bytes of the OUT transfer acknowledged by the device, counted from HCTSIZ.PKTCNT
+ */
+static uint32_t channel_out_acked(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	const channel_t *ch = &dev->channels[channel];
+	const uint32_t mps = ch->packet.endpoint_size_max;
+	const uint32_t packets = ch->packet.datalen ? (ch->packet.datalen - 1) / mps + 1 : 1;
+	const uint32_t pktcnt = (REBASE_CH(OTG_HCTSIZ, channel) & OTG_HCTSIZ_PKTCNT_MASK) >> 19;
 
-		if ((REBASE(OTG_HPRT) & OTG_HPRT_PCDET)  &&
-			(REBASE(OTG_HPRT) & OTG_HPRT_PCSTS) ) {
-			if ((REBASE(OTG_HPRT) & OTG_HPRT_PSPD_MASK) == OTG_HPRT_PSPD_FULL) {
-				REBASE(OTG_HFIR) = (REBASE(OTG_HFIR) & ~OTG_HFIR_FRIVL_MASK) | 48000;
-				if ((REBASE(OTG_HCFG) & OTG_HCFG_FSLSPCS_MASK) != OTG_HCFG_FSLSPCS_48MHz) {
-					REBASE(OTG_HCFG) = (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) | OTG_HCFG_FSLSPCS_48MHz;
-					LOG_PRINTF("\n Reset Full-Speed \n");
-				}
-				channels_init(dev);
-				dev->dpstate = DEVICE_POLL_STATE_DEVRST;
-				reset_start(dev);
+	if (pktcnt >= packets) {
+		return 0;
+	}
+	const uint32_t acked = (packets - pktcnt) * mps;
+	return acked < ch->packet.datalen ? acked : ch->packet.datalen;
+}
 
-			} else if ((REBASE(OTG_HPRT) & OTG_HPRT_PSPD_MASK) == OTG_HPRT_PSPD_LOW) {
-				REBASE(OTG_HFIR) = (REBASE(OTG_HFIR) & ~OTG_HFIR_FRIVL_MASK) | 6000;
-				if ((REBASE(OTG_HCFG) & OTG_HCFG_FSLSPCS_MASK) != OTG_HCFG_FSLSPCS_6MHz) {
-					REBASE(OTG_HCFG) = (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) | OTG_HCFG_FSLSPCS_6MHz;
-					LOG_PRINTF("\n Reset Low-Speed \n");
-				}
+/**
+ * Apply the NAK policy (usbh_nak_policy) to the NAKed IN channel
+ *
+ * Interrupt endpoints are asked again in their next interval.
+ */
+static void channel_nak(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel)
+{
+	channel_t *ch = &dev->channels[channel];
+	const uint8_t eptyp = ch->packet.endpoint_type;
+	const usbh_nak_policy_t *policy = &usbh_nak_policy[eptyp];
 
-				channels_init(dev);
-				dev->dpstate = DEVICE_POLL_STATE_DEVRST;
-				reset_start(dev);
-			}
-			return USBH_POLL_STATUS_NONE;
-		}
+	if (ch->naks < UINT16_MAX) {
+		ch->naks++;
 	}
+	if (policy->limit && ch->naks >= policy->limit) {
+		// give the channel to other transfers, the core queues this one again
+		channel_toggle_update(dev, channel, true);
+		channel_halt(dev, channel);
 
-	if (dev->dpstate == DEVICE_POLL_STATE_DEVRST) {
-		if (dev->time_curr_us - dev->timestamp_us < 210000) {
-			return USBH_POLL_STATUS_NONE;
-		} else {
-			dev->dpstate = DEVICE_POLL_STATE_RUN;
+		usbh_packet_callback_data_t cb_data;
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_ENAK;
+		cb_data.transferred_length = ch->data_index;
+
+		channel_complete(dev, channel, true, cb_data);
+		return;
+	}
+
+	if (eptyp == USBH_ENDPOINT_TYPE_INTERRUPT) {
+		channel_periodic_schedule(dev, channel);
+		return;
+	}
+
+	uint8_t frames = policy->retry_frames;
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	if (!frames && (eptyp == USBH_ENDPOINT_TYPE_CONTROL || eptyp == USBH_ENDPOINT_TYPE_BULK)) {
+		// re-enabled from the interrupt, the device would be asked every few microseconds
+		frames = 1;
+	}
+#endif
+	if (!frames) {
+		REBASE_CH_WRITE(OTG_HCCHAR, channel, REBASE_CH(OTG_HCCHAR, channel) | OTG_HCCHAR_CHENA);
+		return;
+	}
+	ch->nak_retry = true;
+	ch->frame_due = (frame_curr(dev) + frames) & FRAME_MASK;
+}
+
+/**
+ * Enable the NAKed IN channels whose frame has come
+ */
+static void channels_nak_retry(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	channel_t *channels = dev->channels;
+	const uint16_t frame = frame_curr(dev);
+	uint32_t channel;
+
+	for (channel = 0; channel < dev->num_channels; channel++) {
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		uint32_t mask = cm_mask_interrupts(1);
+#endif
+		if (channels[channel].state == CHANNEL_STATE_WORK && channels[channel].nak_retry &&
+			frame_diff(frame, channels[channel].frame_due) >= 0) {
+			channels[channel].nak_retry = false;
+			REBASE_CH_WRITE(OTG_HCCHAR, channel, REBASE_CH(OTG_HCCHAR, channel) | OTG_HCCHAR_CHENA);
 		}
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		cm_mask_interrupts(mask);
+#endif
 	}
+}
 
-	// ELSE RUN
+/**
+ * Take the channel from the IN transfer waiting for its NAK retry or interval
+ *
+ * The lowest priority is parked first, then the one NAKed the most.
+ */
+static bool park(void *drvdata, uint8_t priority)
+{
+	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+	channel_t *channels = dev->channels;
+	int32_t parked = -1;
+	uint32_t channel;
+
+	for (channel = 0; channel < dev->num_channels; channel++) {
+		const channel_t *ch = &channels[channel];
+		if (ch->state == CHANNEL_STATE_HALT) {
+			// the channel is free soon, do not park another one
+			return false;
+		}
+		if (ch->state != CHANNEL_STATE_WORK || !(ch->nak_retry || ch->periodic_wait) ||
+			!(REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN)) {
+			continue;
+		}
 
-	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_SOF) {
-		REBASE(OTG_GINTSTS) = OTG_GINTSTS_SOF;
+		const uint8_t ch_priority = usbh_channel_priority[ch->packet.endpoint_type];
+		if (ch_priority > priority) {
+			continue;
+		}
+		if (parked < 0) {
+			parked = channel;
+			continue;
+		}
+		const uint8_t parked_priority = usbh_channel_priority[channels[parked].packet.endpoint_type];
+		if (ch_priority < parked_priority ||
+			(ch_priority == parked_priority && ch->naks > channels[parked].naks)) {
+			parked = channel;
+		}
+	}
+	if (parked < 0) {
+		return false;
 	}
 
-	while (REBASE(OTG_GINTSTS) & OTG_GINTSTS_RXFLVL) {
-		//receive data
-		rxflvl_handle(dev);
+	channel_t *ch = &channels[parked];
+	ch->nak_retry = false;
+	ch->periodic_wait = false;
+	channel_toggle_update(dev, parked, true);
+	channel_halt(dev, parked);
+
+	usbh_packet_callback_data_t cb_data;
+	cb_data.status = USBH_PACKET_CALLBACK_STATUS_ENAK;
+	cb_data.transferred_length = ch->data_index;
+
+	channel_complete(dev, parked, true, cb_data);
+	return true;
+}
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+
+/**
+ * Call the callbacks of the transfers completed by the interrupt
+ */
+static void irq_queue_drain(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	while (dev->queue_tail != dev->queue_head) {
+		__sync_synchronize();
+		channel_completion_t entry = dev->queue[dev->queue_tail & (IRQ_QUEUE_SIZE - 1)];
+		dev->queue_tail++;
+
+		irq_queue_stats(dev, &entry);
+		channel_report(dev, &entry.packet, entry.in, entry.time_start_us, entry.cb_data);
 	}
+}
 
-	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_HPRTINT) {
-		if (REBASE(OTG_HPRT) & OTG_HPRT_PENCHNG) {
-			uint32_t hprt = REBASE(OTG_HPRT);
-			// Clear Interrupt
-			// HARDWARE BUG - not mentioned in errata
-			// To clear interrupt write 0 to PENA
-			// To disable port write 1 to PENCHNG
-			REBASE(OTG_HPRT) &= ~OTG_HPRT_PENA;
-			LOG_PRINTF("PENCHNG");
-			if ((hprt & OTG_HPRT_PENA)) {
-				return USBH_POLL_STATUS_DEVICE_CONNECTED;
-			}
+/**
+ * Drop the completions of the transfers on the disconnected bus
+ */
+static void irq_queue_flush(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	dev->queue_tail = dev->queue_head;
+}
+#endif
 
-		}
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+/**
+ * Handle the channel working in DMA mode
+ *
+ * The core retries NAKed non-periodic transfers and toggles the data PID by itself,
+ * the result of the transfer is read once the channel halts.
+ */
+static void channel_dma_service(usbh_lld_stm32f4_driver_data_t *dev, uint8_t channel, uint32_t hcint)
+{
+	channel_t *ch = &dev->channels[channel];
+	bool in = REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN;
 
-		if (REBASE(OTG_HPRT) & OTG_HPRT_POCCHNG) {
-			// TODO: Check for functionality
-			REBASE(OTG_HPRT) |= OTG_HPRT_POCCHNG;
-			LOG_PRINTF("POCCHNG");
-		}
+	REBASE_CH_WRITE(OTG_HCINT, channel, hcint);
+	if (!(hcint & OTG_HCINT_CHH)) {
+		return;
 	}
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHH, channel, &ch->packet, in, hcint);
 
-	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_DISCINT) {
-		REBASE(OTG_GINTSTS) = OTG_GINTSTS_DISCINT;
-		LOG_PRINTF("DISCINT");
+	uint32_t hctsiz = REBASE_CH(OTG_HCTSIZ, channel);
+	uint32_t length;
+	if (in) {
+		length = ch->dma_length - (hctsiz & OTG_HCTSIZ_XFRSIZ_MASK);
+	} else {
+		length = (hcint & OTG_HCINT_XFRC) ? ch->dma_length : 0;
+	}
 
-		/*
-		 * When the voltage drops, DISCINT interrupt is generated although
-		 * Device is connected, so there is no need to reinitialize channels.
-		 * Often, DISCINT is bad interpreted upon insertion of device
-		 */
-		if (!(REBASE(OTG_HPRT) & OTG_HPRT_PCSTS)) {
-			LOG_PRINTF("discint processsing...");
-			channels_init(dev);
+	channel_toggle_update(dev, channel, in);
+
+	if (in && (hcint & OTG_HCINT_NAK) && !(hcint & OTG_HCINT_XFRC)) {
+		// periodic IN, the device has no data in this frame. Packets received
+		// before are kept, the rest of the transfer is programmed again
+		channel_dma_done(dev, channel, true, length);
+		channel_dma_setup(dev, channel, true);
+		channel_event(dev, channel, true, USBH_STATS_EVENT_NAK);
+		channel_nak(dev, channel);
+		return;
+	}
+
+	usbh_packet_callback_data_t cb_data;
+	if (hcint & OTG_HCINT_XFRC) {
+		channel_dma_done(dev, channel, in, length);
+		if (length == ch->dma_length && ch->data_index < ch->packet.datalen) {
+			// next part through the bounce buffer
+			channel_dma_setup(dev, channel, in);
+			stm32f4_usbh_port_channel_setup(dev, channel, in ? OTG_HCCHAR_EPDIR_IN : OTG_HCCHAR_EPDIR_OUT);
+			return;
 		}
-		REBASE(OTG_GINTSTS) = REBASE(OTG_GINTSTS);
-		dev->dpstate = DEVICE_POLL_STATE_DISCONN;
-		return USBH_POLL_STATUS_DEVICE_DISCONNECTED;
+		if (ch->data_index == ch->packet.datalen) {
+			cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
+		} else {
+			cb_data.status = USBH_PACKET_CALLBACK_STATUS_ERRSIZ;
+		}
+	} else if (hcint & OTG_HCINT_STALL) {
+		channel_event(dev, channel, in, USBH_STATS_EVENT_STALL);
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+	} else if (hcint & OTG_HCINT_BBERR) {
+		channel_event(dev, channel, in, USBH_STATS_EVENT_BBERR);
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+	} else if (hcint & OTG_HCINT_TXERR) {
+		channel_event(dev, channel, in, USBH_STATS_EVENT_TXERR);
+		cb_data.status = in ? USBH_PACKET_CALLBACK_STATUS_EFATAL : USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+	} else if (hcint & OTG_HCINT_DTERR) {
+		channel_event(dev, channel, in, USBH_STATS_EVENT_DTERR);
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+	} else if (hcint & OTG_HCINT_NAK) {
+		channel_event(dev, channel, in, USBH_STATS_EVENT_NAK);
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
+	} else if (hcint & OTG_HCINT_FRMOR) {
+		cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
+	} else {
+		// halted by free_channel()
+		free_channel(dev, channel);
+		return;
 	}
 
+	// failed transfer is retried after the completed parts
+	cb_data.transferred_length = ch->data_index;
+	free_channel(dev, channel);
+	channel_complete(dev, channel, in, cb_data);
+}
+#endif
+
+/**
+ * Handle the interrupts of the channels, called from the poll or from the interrupt
+ */
+static void channels_service(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	channel_t *channels = dev->channels;
+
 	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_HCINT) {
 		uint32_t channel;
 
 		for(channel = 0; channel < dev->num_channels; channel++)
 		{
-			if (channels[channel].state != CHANNEL_STATE_WORK ||
-				!(REBASE(OTG_HAINT)&(1<<channel))) {
+			if (!(REBASE(OTG_HAINT)&(1<<channel))) {
+				continue;
+			}
+			if (channels[channel].state == CHANNEL_STATE_FREE) {
+				// stale flags would keep the interrupt pending
+				REBASE_CH_WRITE(OTG_HCINT, channel, ~0);
 				continue;
 			}
 			uint32_t hcint = REBASE_CH(OTG_HCINT, channel);
+
+			if (channels[channel].state == CHANNEL_STATE_HALT) {
+				// late events of the cancelled transfer are not reported
+				REBASE_CH_WRITE(OTG_HCINT, channel, hcint);
+				if (hcint & OTG_HCINT_CHH) {
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHH, channel, &channels[channel].packet,
+						REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN, channels[channel].data_index);
+					channels[channel].state = CHANNEL_STATE_FREE;
+				}
+				continue;
+			}
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+			if (DMA_ENABLED(dev)) {
+				channel_dma_service(dev, channel, hcint);
+				continue;
+			}
+#endif
 			uint8_t eptyp = channels[channel].packet.endpoint_type;
 
 			// Write
 			if (!(REBASE_CH(OTG_HCCHAR, channel)&OTG_HCCHAR_EPDIR_IN)) {
 
+				if (hcint & OTG_HCINT_ACK) {
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_ACK);
+					// one ACK may stand for several packets
+					channels[channel].data_index = channel_out_acked(dev, channel);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_ACK, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
+					LOG_PRINTF("ACK");
+				}
+
 				if (hcint & OTG_HCINT_NAK) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NAK;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_NAK);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_NAK, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
 					LOG_PRINTF("NAK\n");
+					channel_event(dev, channel, false, USBH_STATS_EVENT_NAK);
 
+					// NAKed transfer is continued by the core after the acknowledged packets
+					channels[channel].data_index = channel_out_acked(dev, channel);
+					channel_toggle_update(dev, channel, false);
 					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
 					cb_data.transferred_length = channels[channel].data_index;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
-
-				}
-
-				if (hcint & OTG_HCINT_ACK) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK;
-					LOG_PRINTF("ACK");
-					if (eptyp == USBH_ENDPOINT_TYPE_CONTROL) {
-						channels[channel].packet.toggle[0] = 1;
-					} else {
-						channels[channel].packet.toggle[0] ^= 1;
-					}
+					channel_complete(dev, channel, false, cb_data);
+					continue;
 				}
 
 				if (hcint & OTG_HCINT_XFRC) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_XFRC;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_XFRC);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_XFRC, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
 					LOG_PRINTF("XFRC\n");
 
+					channels[channel].data_index = channels[channel].packet.datalen;
+					channel_toggle_update(dev, channel, false);
 					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_OK;
-					cb_data.transferred_length = channels[channel].data_index;
+					cb_data.transferred_length = channels[channel].packet.datalen;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, false, cb_data);
 					continue;
 				}
 
 				if (hcint & OTG_HCINT_FRMOR) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_FRMOR;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_FRMOR);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_FRMOR, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
 					LOG_PRINTF("FRMOR");
 
 					free_channel(dev, channel);
@@ -540,31 +1433,36 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
 					cb_data.transferred_length = 0;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, false, cb_data);
 				}
 
 				if (hcint & OTG_HCINT_TXERR) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_TXERR;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_TXERR);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_TXERR, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
 					LOG_PRINTF("TXERR");
+					channel_event(dev, channel, false, USBH_STATS_EVENT_TXERR);
 
+					// retried after the acknowledged packets
+					channels[channel].data_index = channel_out_acked(dev, channel);
+					channel_toggle_update(dev, channel, false);
 					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EAGAIN;
-					cb_data.transferred_length = 0;
+					cb_data.transferred_length = channels[channel].data_index;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, false, cb_data);
 
 
 				}
 
 				if (hcint & OTG_HCINT_STALL) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_STALL;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_STALL);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_STALL, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
 					LOG_PRINTF("STALL");
+					channel_event(dev, channel, false, USBH_STATS_EVENT_STALL);
 
 					free_channel(dev, channel);
 
@@ -573,13 +1471,13 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 					cb_data.transferred_length = 0;
 
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, false, cb_data);
 				}
 
 				if (hcint & OTG_HCINT_CHH) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_CHH;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_CHH);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHH, channel, &channels[channel].packet, false,
+						channels[channel].data_index);
 					LOG_PRINTF("CHH");
 
 					free_channel(dev, channel);
@@ -587,34 +1485,42 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 			} else { // Read
 
 				if (hcint & OTG_HCINT_NAK) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_NAK;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_NAK);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_NAK, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					if (eptyp == USBH_ENDPOINT_TYPE_CONTROL) {
 						 LOG_PRINTF("NAK");
 					}
+					channel_event(dev, channel, true, USBH_STATS_EVENT_NAK);
 
-					REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHENA;
+					channel_nak(dev, channel);
 
 				}
 
 				if (hcint & OTG_HCINT_DTERR) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_DTERR;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_DTERR);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_DTERR, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("DTERR");
+					channel_event(dev, channel, true, USBH_STATS_EVENT_DTERR);
 				}
 
 				if (hcint & OTG_HCINT_ACK) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_ACK;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_ACK);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_ACK, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("ACK");
-
-					channels[channel].packet.toggle[0] ^= 1;
-
 				}
 
 
 
 				if (hcint & OTG_HCINT_XFRC) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_XFRC;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_XFRC);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_XFRC, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("XFRC\n");
 
+					channel_toggle_update(dev, channel, true);
 					free_channel(dev, channel);
 					usbh_packet_callback_data_t cb_data;
 					if (channels[channel].data_index == channels[channel].packet.datalen) {
@@ -624,36 +1530,40 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 					}
 					cb_data.transferred_length = channels[channel].data_index;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, true, cb_data);
 
 					continue;
 				}
 
 				if (hcint & OTG_HCINT_BBERR) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_BBERR;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_BBERR);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_BBERR, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("BBERR");
+					channel_event(dev, channel, true, USBH_STATS_EVENT_BBERR);
 					free_channel(dev, channel);
 
 					usbh_packet_callback_data_t cb_data;
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
 					cb_data.transferred_length = 0;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, true, cb_data);
 				}
 
 				if (hcint & OTG_HCINT_FRMOR) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_FRMOR;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_FRMOR);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_FRMOR, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("FRMOR");
 
 				}
 
 				if (hcint & OTG_HCINT_TXERR) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_TXERR;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_TXERR);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_TXERR, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("TXERR");
+					channel_event(dev, channel, true, USBH_STATS_EVENT_TXERR);
 
 					free_channel(dev, channel);
 
@@ -661,15 +1571,16 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
 					cb_data.transferred_length = 0;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, true, cb_data);
 
 				}
 
 				if (hcint & OTG_HCINT_STALL) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_STALL;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_STALL);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_STALL, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("STALL");
+					channel_event(dev, channel, true, USBH_STATS_EVENT_STALL);
 
 					free_channel(dev, channel);
 
@@ -677,13 +1588,13 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 					cb_data.status = USBH_PACKET_CALLBACK_STATUS_EFATAL;
 					cb_data.transferred_length = 0;
 
-					channels[channel].packet.callback(
-						channels[channel].packet.callback_arg,
-						cb_data);
+					channel_complete(dev, channel, true, cb_data);
 
 				}
 				if (hcint & OTG_HCINT_CHH) {
-					REBASE_CH(OTG_HCINT, channel) = OTG_HCINT_CHH;
+					REBASE_CH_WRITE(OTG_HCINT, channel, OTG_HCINT_CHH);
+					USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHH, channel, &channels[channel].packet, true,
+						channels[channel].data_index);
 					LOG_PRINTF("CHH");
 					free_channel(dev, channel);
 				}
@@ -691,14 +1602,145 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
 			}
 		}
 	}
+}
+
+static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	if (dev->dpstate == DEVICE_POLL_STATE_DISCONN) {
+		REBASE_WRITE(OTG_GINTSTS, REBASE(OTG_GINTSTS));
+		// Check for connection of device
+		if ((REBASE(OTG_HPRT) & OTG_HPRT_PCDET)  &&
+			(REBASE(OTG_HPRT) & OTG_HPRT_PCSTS) ) {
+
+			dev->dpstate = DEVICE_POLL_STATE_DEVCONN;
+			usbh_timer_start(&dev->timer, 500000, NULL, NULL);
+			return USBH_POLL_STATUS_NONE;
+		}
+	}
+
+	if (dev->dpstate == DEVICE_POLL_STATE_DEVCONN) {
+		// May be other condition, e.g. Debounce done,
+		// using 0.5s wait by default
+		if (usbh_timer_pending(&dev->timer)) {
+			return USBH_POLL_STATUS_NONE;
+		}
+
+		if ((REBASE(OTG_HPRT) & OTG_HPRT_PCDET)  &&
+			(REBASE(OTG_HPRT) & OTG_HPRT_PCSTS) ) {
+			if ((REBASE(OTG_HPRT) & OTG_HPRT_PSPD_MASK) == OTG_HPRT_PSPD_FULL) {
+				REBASE_WRITE(OTG_HFIR, (REBASE(OTG_HFIR) & ~OTG_HFIR_FRIVL_MASK) | 48000);
+				if ((REBASE(OTG_HCFG) & OTG_HCFG_FSLSPCS_MASK) != OTG_HCFG_FSLSPCS_48MHz) {
+					REBASE_WRITE(OTG_HCFG, (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) | OTG_HCFG_FSLSPCS_48MHz);
+					LOG_PRINTF("\n Reset Full-Speed \n");
+				}
+				channels_init(dev);
+				dev->dpstate = DEVICE_POLL_STATE_DEVRST;
+				reset_start(dev);
+
+			} else if ((REBASE(OTG_HPRT) & OTG_HPRT_PSPD_MASK) == OTG_HPRT_PSPD_LOW) {
+				REBASE_WRITE(OTG_HFIR, (REBASE(OTG_HFIR) & ~OTG_HFIR_FRIVL_MASK) | 6000);
+				if ((REBASE(OTG_HCFG) & OTG_HCFG_FSLSPCS_MASK) != OTG_HCFG_FSLSPCS_6MHz) {
+					REBASE_WRITE(OTG_HCFG, (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) | OTG_HCFG_FSLSPCS_6MHz);
+					LOG_PRINTF("\n Reset Low-Speed \n");
+				}
+
+				channels_init(dev);
+				dev->dpstate = DEVICE_POLL_STATE_DEVRST;
+				reset_start(dev);
+			}
+			return USBH_POLL_STATUS_NONE;
+		}
+	}
+
+	if (dev->dpstate == DEVICE_POLL_STATE_DEVRST) {
+		// port reset and the recovery after it
+		if (usbh_timer_pending(&dev->timer)) {
+			return USBH_POLL_STATUS_NONE;
+		} else {
+			dev->dpstate = DEVICE_POLL_STATE_RUN;
+		}
+	}
+
+	// ELSE RUN
+
+	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_SOF) {
+		REBASE_WRITE(OTG_GINTSTS, OTG_GINTSTS_SOF);
+	}
+
+	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_HPRTINT) {
+		if (REBASE(OTG_HPRT) & OTG_HPRT_PENCHNG) {
+			uint32_t hprt = REBASE(OTG_HPRT);
+			// Clear Interrupt
+			// HARDWARE BUG - not mentioned in errata
+			// To clear interrupt write 0 to PENA
+			// To disable port write 1 to PENCHNG
+			REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) & ~OTG_HPRT_PENA);
+			LOG_PRINTF("PENCHNG");
+			if ((hprt & OTG_HPRT_PENA)) {
+				return USBH_POLL_STATUS_DEVICE_CONNECTED;
+			}
+
+		}
+
+		if (REBASE(OTG_HPRT) & OTG_HPRT_POCCHNG) {
+			// TODO: Check for functionality
+			REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) | OTG_HPRT_POCCHNG);
+			LOG_PRINTF("POCCHNG");
+		}
+	}
+
+	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_DISCINT) {
+		REBASE_WRITE(OTG_GINTSTS, OTG_GINTSTS_DISCINT);
+		LOG_PRINTF("DISCINT");
+
+		/*
+		 * When the voltage drops, DISCINT interrupt is generated although
+		 * Device is connected, so there is no need to reinitialize channels.
+		 * Often, DISCINT is bad interpreted upon insertion of device
+		 */
+		if (!(REBASE(OTG_HPRT) & OTG_HPRT_PCSTS)) {
+			LOG_PRINTF("discint processsing...");
+			channels_init(dev);
+		}
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		irq_queue_flush(dev);
+#endif
+		REBASE_WRITE(OTG_GINTSTS, REBASE(OTG_GINTSTS));
+		dev->dpstate = DEVICE_POLL_STATE_DISCONN;
+		return USBH_POLL_STATUS_DEVICE_DISCONNECTED;
+	}
+
+#ifndef USE_STM32F4_USBH_DRIVER_IRQ
+	while (REBASE(OTG_GINTSTS) & OTG_GINTSTS_RXFLVL) {
+		//receive data
+		rxflvl_handle(dev);
+	}
+
+	channels_service(dev);
+	channels_fifo_fill(dev);
+#else
+	// channels are serviced by the interrupt
+	irq_queue_drain(dev);
+#endif
+	channels_nak_retry(dev);
+	channels_periodic_start(dev);
+	if (dev->fifo_changed) {
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+		uint32_t mask = cm_mask_interrupts(1);
+		fifo_update(dev);
+		cm_mask_interrupts(mask);
+#else
+		fifo_update(dev);
+#endif
+	}
 
 	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_MMIS) {
-		REBASE(OTG_GINTSTS) = OTG_GINTSTS_MMIS;
+		REBASE_WRITE(OTG_GINTSTS, OTG_GINTSTS_MMIS);
 		LOG_PRINTF("Mode mismatch");
 	}
 
 	if (REBASE(OTG_GINTSTS) & OTG_GINTSTS_IPXFR) {
-		REBASE(OTG_GINTSTS) = OTG_GINTSTS_IPXFR;
+		REBASE_WRITE(OTG_GINTSTS, OTG_GINTSTS_IPXFR);
 		LOG_PRINTF("IPXFR");
 	}
 
@@ -711,6 +1753,19 @@ static enum USBH_POLL_STATUS poll_run(usbh_lld_stm32f4_driver_data_t *dev)
  * If value of poll_sequence is needed elsewhere, enum must be defined.
  *
  */
+/**
+ * Wait before the step of the initialization sequence, from the end of the previous step
+ */
+static const uint32_t poll_init_wait_us[] = {
+	[1] = 1000,
+	[3] = 50000,
+	[5] = 50000,
+	[6] = 200000,
+	[7] = 12000,
+	[8] = 12000,
+	[11] = 200000,
+};
+
 static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 {
 	//=======================================
@@ -728,8 +1783,8 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 
 		// needs delay to not hang?? Do not know why.
 		// Maybe after AHBIDL is set, it needs to set up some things
-		if (dev->time_curr_us - dev->timestamp_us > 1000) {
-			REBASE(OTG_GRSTCTL) |= OTG_GRSTCTL_CSRST;
+		if (!usbh_timer_pending(&dev->timer)) {
+			REBASE_WRITE(OTG_GRSTCTL, REBASE(OTG_GRSTCTL) | OTG_GRSTCTL_CSRST);
 			done = 1;
 		}
 		break;
@@ -741,39 +1796,39 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 		break;
 
 	case 3:// wait for 50ms
-		if (dev->time_curr_us - dev->timestamp_us > 50000) {
+		if (!usbh_timer_pending(&dev->timer)) {
 			done = 1;
 		}
 		break;
 
 	case 4:// wait until AHBIDL is set and power up the USB
 		if (REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_AHBIDL) {
-			REBASE(OTG_GCCFG) = OTG_GCCFG_VBUSASEN | OTG_GCCFG_VBUSBSEN |
-					OTG_GCCFG_NOVBUSSENS | OTG_GCCFG_PWRDWN;
+			REBASE_WRITE(OTG_GCCFG, OTG_GCCFG_VBUSASEN | OTG_GCCFG_VBUSBSEN |
+					OTG_GCCFG_NOVBUSSENS | OTG_GCCFG_PWRDWN);
 			done = 1;
 		}
 		break;
 
 	case 5:// wait for 50ms and force host only mode
-		if (dev->time_curr_us - dev->timestamp_us > 50000) {
+		if (!usbh_timer_pending(&dev->timer)) {
 
 			// Core initialized
 			// Force host only mode.
-			REBASE(OTG_GUSBCFG) |= OTG_GUSBCFG_FHMOD;
+			REBASE_WRITE(OTG_GUSBCFG, REBASE(OTG_GUSBCFG) | OTG_GUSBCFG_FHMOD);
 			done = 1;
 		}
 		break;
 
 	case 6:// wait for 200ms and reset PHY clock start reset processing
-		if (dev->time_curr_us - dev->timestamp_us > 200000) {
+		if (!usbh_timer_pending(&dev->timer)) {
 			/* Restart the PHY clock. */
-			REBASE(OTG_PCGCCTL) = 0;
+			REBASE_WRITE(OTG_PCGCCTL, 0);
 
-			REBASE(OTG_HCFG) = 	(REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) |
-							OTG_HCFG_FSLSPCS_48MHz;
+			REBASE_WRITE(OTG_HCFG, (REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSPCS_MASK) |
+							OTG_HCFG_FSLSPCS_48MHz);
 
 			// Start reset processing
-			REBASE(OTG_HPRT) |= OTG_HPRT_PRST;
+			REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) | OTG_HPRT_PRST);
 
 			done = 1;
 
@@ -781,26 +1836,23 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 		break;
 
 	case 7:// wait for reset processing to be done(12ms), disable PRST
-		if (dev->time_curr_us - dev->timestamp_us > 12000) {
+		if (!usbh_timer_pending(&dev->timer)) {
 
-			REBASE(OTG_HPRT) &= ~OTG_HPRT_PRST;
+			REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) & ~OTG_HPRT_PRST);
 			done = 1;
 		}
 		break;
 
 	case 8:// wait 12ms after PRST was disabled, configure fifo
-		if (dev->time_curr_us - dev->timestamp_us > 12000) {
+		if (!usbh_timer_pending(&dev->timer)) {
 
-			REBASE(OTG_HCFG) &= ~OTG_HCFG_FSLSS;
+			REBASE_WRITE(OTG_HCFG, REBASE(OTG_HCFG) & ~OTG_HCFG_FSLSS);
 
-			REBASE(OTG_GRXFSIZ) = RX_FIFO_SIZE;
-			REBASE(OTG_GNPTXFSIZ) = (TX_NP_FIFO_SIZE << 16) |
-								RX_FIFO_SIZE;
-			REBASE(OTG_HPTXFSIZ) = (TX_P_FIFO_SIZE << 16) |
-								(RX_FIFO_SIZE +	TX_NP_FIFO_SIZE);
+			fifo_reset(dev);
+			fifo_configure(dev);
 
 			// FLUSH RX FIFO
-			REBASE(OTG_GRSTCTL) |= OTG_GRSTCTL_RXFFLSH;
+			REBASE_WRITE(OTG_GRSTCTL, REBASE(OTG_GRSTCTL) | OTG_GRSTCTL_RXFFLSH);
 
 			done = 1;
 		}
@@ -808,7 +1860,7 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 
 	case 9: // wait to RX FIFO become flushed, flush TX
 		if (!(REBASE(OTG_GRSTCTL) & OTG_GRSTCTL_RXFFLSH)) {
-			REBASE(OTG_GRSTCTL) |= OTG_GRSTCTL_TXFFLSH | (0x10 << 6);
+			REBASE_WRITE(OTG_GRSTCTL, REBASE(OTG_GRSTCTL) | OTG_GRSTCTL_TXFFLSH | (0x10 << 6));
 
 			done = 1;
 		}
@@ -819,20 +1871,30 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 
 			channels_init(dev);
 
-			REBASE(OTG_GOTGINT) |= 1 << 19;
-			REBASE(OTG_GINTMSK) = 0;
-			REBASE(OTG_GINTSTS) = ~0;
-			REBASE(OTG_HPRT) |= OTG_HPRT_PPWR;
+			REBASE_WRITE(OTG_GOTGINT, REBASE(OTG_GOTGINT) | 1 << 19);
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+			// receive FIFO is drained by the DMA
+			REBASE_WRITE(OTG_GINTMSK, DMA_ENABLED(dev) ? OTG_GINTMSK_HCIM :
+				OTG_GINTMSK_RXFLVLM | OTG_GINTMSK_HCIM);
+#else
+			REBASE_WRITE(OTG_GINTMSK, 0);
+#endif
+			REBASE_WRITE(OTG_GINTSTS, ~0);
+			REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) | OTG_HPRT_PPWR);
 
 			done = 1;
 		}
 		break;
 
 	case 11: // wait 200ms
-		if (dev->time_curr_us - dev->timestamp_us > 200000) {
+		if (!usbh_timer_pending(&dev->timer)) {
 
 			// Uncomment to enable Interrupt generation
-			REBASE(OTG_GAHBCFG) |= OTG_GAHBCFG_GINT;
+			REBASE_WRITE(OTG_GAHBCFG, REBASE(OTG_GAHBCFG) | OTG_GAHBCFG_GINT);
+			if (DMA_ENABLED(dev)) {
+				REBASE_WRITE(OTG_GAHBCFG, (REBASE(OTG_GAHBCFG) & ~OTG_GAHBCFG_HBSTLEN_MASK) |
+					OTG_GAHBCFG_HBSTLEN_INCR4 | OTG_GAHBCFG_DMAEN);
+			}
 
 			LOG_PRINTF("INIT COMPLETE\n");
 
@@ -846,7 +1908,10 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 
 	if (done) {
 		dev->poll_sequence++;
-		dev->timestamp_us = dev->time_curr_us;
+		if (dev->poll_sequence < sizeof(poll_init_wait_us) / sizeof(poll_init_wait_us[0]) &&
+			poll_init_wait_us[dev->poll_sequence]) {
+			usbh_timer_start(&dev->timer, poll_init_wait_us[dev->poll_sequence], NULL, NULL);
+		}
 		LOG_PRINTF("\t\t POLL SEQUENCE %d\n", dev->poll_sequence);
 	}
 
@@ -854,14 +1919,74 @@ static void poll_init(usbh_lld_stm32f4_driver_data_t *dev)
 
 static void poll_reset(usbh_lld_stm32f4_driver_data_t *dev)
 {
-	if (dev->time_curr_us - dev->timestamp_us > 10000) {
-		REBASE(OTG_HPRT) &= ~OTG_HPRT_PRST;
+	if (!usbh_timer_pending(&dev->timer)) {
+		REBASE_WRITE(OTG_HPRT, REBASE(OTG_HPRT) & ~OTG_HPRT_PRST);
 		dev->state = dev->state_prev;
 		dev->state_prev = DEVICE_STATE_RESET;
 
+		// let the device recover from the reset (210ms since its start)
+		usbh_timer_start(&dev->timer, 200000, NULL, NULL);
+
 		LOG_PRINTF("RESET");
-	} else {
-		LOG_PRINTF("waiting %d < %d\n",dev->time_curr_us, dev->timestamp_us);
+	}
+}
+
+/**
+ * Report the time of the next poll needed by this driver to the core
+ */
+static void poll_deadline(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	const uint16_t frame_next = (frame_curr(dev) + 1) & FRAME_MASK;
+	uint32_t i;
+
+	switch (dev->state) {
+	case DEVICE_STATE_INIT:
+		// flags of the initialization sequence are checked every millisecond
+		usbh_poll_request(dev->time_curr_us + 1000);
+		break;
+
+	case DEVICE_STATE_RUN:
+		// waits for the connection and the reset are woken up by dev->timer
+		switch (dev->dpstate) {
+		case DEVICE_POLL_STATE_RUN:
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+			// channels are serviced by the interrupt, only the NAKed transfers wait for the poll
+			if (dev->queue_tail != dev->queue_head) {
+				usbh_poll_request(dev->time_curr_us);
+			}
+#endif
+			for (i = 0; i < dev->num_channels; i++) {
+				const channel_t *ch = &dev->channels[i];
+#ifndef USE_STM32F4_USBH_DRIVER_IRQ
+				if (channel_fifo_pending(dev, i)) {
+					// transmit FIFO is refilled by the poll as the packets are sent
+					usbh_poll_request(dev->time_curr_us);
+					continue;
+				}
+#endif
+				if (ch->state == CHANNEL_STATE_WORK && ch->periodic_wait) {
+					// enabled in the frame before the due one
+					int16_t frames = frame_diff(ch->frame_due, frame_next);
+					usbh_poll_request(dev->time_curr_us + (frames > 1 ? frames : 1) * frame_us(dev));
+				} else if (ch->state == CHANNEL_STATE_WORK && ch->nak_retry) {
+					int16_t frames = frame_diff(ch->frame_due, frame_next) + 1;
+					usbh_poll_request(dev->time_curr_us + (frames > 1 ? frames : 1) * frame_us(dev));
+#ifndef USE_STM32F4_USBH_DRIVER_IRQ
+				} else if (ch->state != CHANNEL_STATE_FREE) {
+					// channels are serviced by polling, NAKed transfers are retried every frame
+					usbh_poll_request(dev->time_curr_us + frame_us(dev));
+#endif
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+		break;
+
+	default:
+		break;
 	}
 }
 
@@ -891,6 +2016,7 @@ static enum USBH_POLL_STATUS poll(void *drvdata, uint32_t time_curr_us)
 		break;
 	}
 
+	poll_deadline(dev);
 	return ret;
 
 }
@@ -910,13 +2036,23 @@ static int8_t get_free_channel(void *drvdata)
 		if (dev->channels[i].state == CHANNEL_STATE_FREE &&
 			!(REBASE_CH(OTG_HCCHAR, i) & OTG_HCCHAR_CHENA)) {
 			channels[i].state = CHANNEL_STATE_WORK;
-			REBASE_CH(OTG_HCINT, i) = ~0;
-			REBASE_CH(OTG_HCINTMSK, i) |= OTG_HCINTMSK_ACKM | OTG_HCINTMSK_NAKM |
+			channels[i].periodic_wait = false;
+			channels[i].nak_retry = false;
+			channels[i].naks = 0;
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+			memset(channels[i].events, 0, sizeof(channels[i].events));
+#endif
+			REBASE_CH_WRITE(OTG_HCINT, i, ~0);
+			REBASE_CH_WRITE(OTG_HCINTMSK, i, REBASE_CH(OTG_HCINTMSK, i) | OTG_HCINTMSK_ACKM | OTG_HCINTMSK_NAKM |
 				OTG_HCINTMSK_TXERRM | OTG_HCINTMSK_XFRCM |
 				OTG_HCINTMSK_DTERRM | OTG_HCINTMSK_BBERRM |
 				OTG_HCINTMSK_CHHM | OTG_HCINTMSK_STALLM |
-				OTG_HCINTMSK_FRMORM;
-			REBASE(OTG_HAINTMSK) |= (1 << i);
+				OTG_HCINTMSK_FRMORM);
+			if (DMA_ENABLED(dev)) {
+				// results are read on the channel halted interrupt
+				REBASE_CH_WRITE(OTG_HCINTMSK, i, OTG_HCINTMSK_CHHM);
+			}
+			REBASE_WRITE(OTG_HAINTMSK, REBASE(OTG_HAINTMSK) | (1 << i));
 			return i;
 		}
 	}
@@ -932,9 +2068,12 @@ static void free_channel(void *drvdata, uint8_t channel)
 	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
 	channel_t *channels = dev->channels;
 
+	USBH_TRACE_PACKET(USBH_TRACE_EVENT_CHANNEL_FREE, channel, &channels[channel].packet,
+		REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_EPDIR_IN, channels[channel].data_index);
+
 	if (REBASE_CH(OTG_HCCHAR, channel) & OTG_HCCHAR_CHENA) {
-		REBASE_CH(OTG_HCCHAR, channel) |= OTG_HCCHAR_CHDIS;
-		REBASE_CH(OTG_HCINT, channel) = ~0;
+		REBASE_CH_WRITE(OTG_HCCHAR, channel, REBASE_CH(OTG_HCCHAR, channel) | OTG_HCCHAR_CHDIS);
+		REBASE_CH_WRITE(OTG_HCINT, channel, ~0);
 		LOG_PRINTF("\nDisabling channel %d\n", channel);
 	} else {
 		channels[channel].state = CHANNEL_STATE_FREE;
@@ -946,16 +2085,27 @@ static void free_channel(void *drvdata, uint8_t channel)
 static void channels_init(void *drvdata)
 {
 	usbh_lld_stm32f4_driver_data_t *dev = drvdata;
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	uint32_t mask = cm_mask_interrupts(1);
+#endif
 
 	uint32_t i = 0;
 	for (i = 0; i < dev->num_channels; i++) {
-		REBASE_CH(OTG_HCINT, i) = ~0;
-		REBASE_CH(OTG_HCINTMSK, i) = 0x7ff;
+		REBASE_CH_WRITE(OTG_HCINT, i, ~0);
+		REBASE_CH_WRITE(OTG_HCINTMSK, i, DMA_ENABLED(dev) ? OTG_HCINTMSK_CHHM : 0x7ff);
 		free_channel(dev, i);
 	}
 
 	// Enable interrupt mask bits for all channels
-	REBASE(OTG_HAINTMSK) = (1 << dev->num_channels) - 1;
+	REBASE_WRITE(OTG_HAINTMSK, (1 << dev->num_channels) - 1);
+
+	for (i = 0; i < PERIODIC_ENDPOINTS; i++) {
+		dev->periodic[i].address = -1;
+	}
+	fifo_reset(dev);
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	cm_mask_interrupts(mask);
+#endif
 }
 
 /**
@@ -978,6 +2128,59 @@ static enum USBH_SPEED root_speed(void *drvdata)
 		return USBH_SPEED_FULL;
 	}
 }
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+/*
+ * Channels are shared with the interrupt, the core reaches them only with the interrupts masked
+ */
+static bool read_irq(void *drvdata, usbh_packet_t *packet)
+{
+	uint32_t mask = cm_mask_interrupts(1);
+	bool ret = read(drvdata, packet);
+	cm_mask_interrupts(mask);
+	return ret;
+}
+
+static bool write_irq(void *drvdata, const usbh_packet_t *packet)
+{
+	uint32_t mask = cm_mask_interrupts(1);
+	bool ret = write(drvdata, packet);
+	cm_mask_interrupts(mask);
+	return ret;
+}
+
+static bool cancel_irq(void *drvdata, const usbh_packet_t *packet)
+{
+	uint32_t mask = cm_mask_interrupts(1);
+	bool ret = cancel(drvdata, packet);
+	cm_mask_interrupts(mask);
+	return ret;
+}
+
+static bool park_irq(void *drvdata, uint8_t priority)
+{
+	uint32_t mask = cm_mask_interrupts(1);
+	bool ret = park(drvdata, priority);
+	cm_mask_interrupts(mask);
+	return ret;
+}
+
+/**
+ * Service the channels in the interrupt of the OTG core
+ *
+ * @returns true if some transfer has completed, so usbh_poll() has callbacks to call
+ */
+static bool irq(usbh_lld_stm32f4_driver_data_t *dev)
+{
+	while (REBASE(OTG_GINTSTS) & OTG_GINTSTS_RXFLVL) {
+		rxflvl_handle(dev);
+	}
+	channels_service(dev);
+	channels_fifo_fill(dev);
+
+	return dev->queue_tail != dev->queue_head;
+}
+#endif
 #endif // if defined otg_hs or otg_fs
 
 
@@ -993,7 +2196,7 @@ void print_channels(const void *lld)
 	int32_t i;
 	LOG_PRINTF("\nCHANNELS: \n");
 	for (i = 0;i < dev->num_channels;i++) {
-		LOG_PRINTF("%4d %4d %4d %08X\n", channels[i].state, channels[i].packet.address, channels[i].packet.datalen, MMIO32(dev->base + OTG_HCINT(i)));
+		LOG_PRINTF("%4d %4d %4d %08X\n", channels[i].state, channels[i].packet.address, channels[i].packet.datalen, REBASE_CH(OTG_HCINT, i));
 	}
 }
 #endif
@@ -1005,35 +2208,83 @@ static channel_t channels_fs[NUM_CHANNELS_FS];
 static usbh_lld_stm32f4_driver_data_t driver_data_fs = {
 	.base = USB_OTG_FS_BASE,
 	.channels = channels_fs,
-	.num_channels = NUM_CHANNELS_FS
+	.num_channels = NUM_CHANNELS_FS,
+	.fifo_words = FIFO_WORDS_FS
 };
 const usbh_low_level_driver_t usbh_lld_stm32f4_driver_fs = {
 	.init = init,
 	.poll = poll,
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	.read = read_irq,
+	.write = write_irq,
+	.cancel = cancel_irq,
+	.park = park_irq,
+	.endpoint = endpoint,
+#else
 	.read = read,
 	.write = write,
+	.cancel = cancel,
+	.park = park,
+	.endpoint = endpoint,
+#endif
 	.root_speed = root_speed,
 	.driver_data = &driver_data_fs
 };
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+bool usbh_lld_stm32f4_irq_fs(void)
+{
+	return irq(&driver_data_fs);
+}
+#endif
 #endif
 
 // USB High Speed - OTG_HS
 #if defined(USE_STM32F4_USBH_DRIVER_HS)
 #define NUM_CHANNELS_HS		(12)
 static channel_t channels_hs[NUM_CHANNELS_HS];
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+static uint32_t dma_bounce_hs[NUM_CHANNELS_HS][DMA_BOUNCE_SIZE / 4];
+#endif
 static usbh_lld_stm32f4_driver_data_t driver_data_hs = {
 	.base = USB_OTG_HS_BASE,
 	.channels = channels_hs,
-	.num_channels = NUM_CHANNELS_HS
+	.num_channels = NUM_CHANNELS_HS,
+	.fifo_words = FIFO_WORDS_HS,
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+	.dma = true,
+	.dma_bounce = dma_bounce_hs
+#endif
 };
 
 const usbh_low_level_driver_t usbh_lld_stm32f4_driver_hs = {
 	.init = init,
 	.poll = poll,
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	.read = read_irq,
+	.write = write_irq,
+	.cancel = cancel_irq,
+	.park = park_irq,
+	.endpoint = endpoint,
+#else
 	.read = read,
 	.write = write,
+	.cancel = cancel,
+	.park = park,
+	.endpoint = endpoint,
+#endif
+#ifdef USE_STM32F4_USBH_DRIVER_HS_DMA
+	.validate = validate,
+#endif
 	.root_speed = root_speed,
 	.driver_data = &driver_data_hs
 };
 
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+bool usbh_lld_stm32f4_irq_hs(void)
+{
+	return irq(&driver_data_hs);
+}
+#endif
+
 #endif
@@ -0,0 +1,84 @@
+/*
+ * This file is part of the libusbhost library
+ * hosted at http://github.com/libusbhost/libusbhost
+ *
+ * Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+ *
+ *
+ * libusbhost is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "usbh_trace.h"
+
+#include <stddef.h>
+
+#ifdef USBH_USE_TRACE
+
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+#include <libopencm3/cm3/cortex.h>
+#endif
+
+static usbh_trace_t trace = {
+	.magic = USBH_TRACE_MAGIC,
+	.entry_size = sizeof(usbh_trace_entry_t),
+	.entry_count = USBH_TRACE_ENTRIES,
+	.head = 0,
+};
+
+static uint32_t (*trace_clock_us)(void);
+static uint32_t trace_time_us;
+
+const usbh_trace_t *usbh_trace_get(void)
+{
+	return &trace;
+}
+
+void usbh_trace_clear(void)
+{
+	trace.head = 0;
+}
+
+void usbh_trace_clock_set(uint32_t (*clock_us)(void))
+{
+	trace_clock_us = clock_us;
+}
+
+void usbh_trace_time(uint32_t time_curr_us)
+{
+	trace_time_us = time_curr_us;
+}
+
+void usbh_trace_record(enum USBH_TRACE_EVENT event, uint8_t channel, uint8_t address, uint8_t endpoint, uint32_t arg)
+{
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	// channel events are recorded by the interrupt of the OTG core as well,
+	// it must not take the same slot while the poll fills it
+	uint32_t mask = cm_mask_interrupts(1);
+#endif
+	usbh_trace_entry_t *entry = &trace.entries[trace.head & (USBH_TRACE_ENTRIES - 1)];
+
+	entry->time_us = trace_clock_us ? trace_clock_us() : trace_time_us;
+	entry->event = event;
+	entry->channel = channel;
+	entry->address = address;
+	entry->endpoint = endpoint;
+	entry->arg = arg;
+	trace.head++;
+#ifdef USE_STM32F4_USBH_DRIVER_IRQ
+	cm_mask_interrupts(mask);
+#endif
+}
+
+#endif
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# This file is part of the libusbhost library
+# hosted at http://github.com/libusbhost/libusbhost
+#
+# Copyright (C) 2015 Amir Hammad <amir.hammad@hotmail.com>
+#
+#
+# libusbhost is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this library.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""Decode the dump of usbh_trace_t (include/usbh_trace.h) into a timeline.
+
+usage: usbh_trace_decode.py [--big-endian] trace.bin
+"""
+
+import struct
+import sys
+
+TRACE_MAGIC = 0x43525455
+
+# enum USBH_TRACE_EVENT
+EVENTS = {
+    1: "SUBMIT",
+    2: "CH_ALLOC",
+    3: "CH_FREE",
+    4: "ACK",
+    5: "NAK",
+    6: "XFRC",
+    7: "TXERR",
+    8: "BBERR",
+    9: "STALL",
+    10: "DTERR",
+    11: "FRMOR",
+    12: "CHH",
+    13: "CALLBACK",
+}
+
+# enum USBH_PACKET_CALLBACK_STATUS
+STATUSES = {
+    0: "OK",
+    1: "ERRSIZ",
+    2: "EAGAIN",
+    3: "EFATAL",
+    4: "ETIMEOUT",
+    5: "ENAK",
+}
+
+CHANNEL_NONE = 0xff
+
+
+def decode(data, endian):
+    header = struct.Struct(endian + "IHHI")
+    entry = struct.Struct(endian + "IBBBBI")
+
+    magic, entry_size, entry_count, head = header.unpack_from(data, 0)
+    if magic != TRACE_MAGIC:
+        raise ValueError("bad magic 0x%08x, wrong file or endianness" % magic)
+    if entry_size < entry.size:
+        raise ValueError("entry size %d is too small" % entry_size)
+    if len(data) < header.size + entry_size * entry_count:
+        raise ValueError("dump is truncated")
+
+    # oldest entry first, older ones have been overwritten
+    recorded = min(head, entry_count)
+    first = head - recorded
+    for seq in range(first, head):
+        offset = header.size + (seq % entry_count) * entry_size
+        yield (seq,) + entry.unpack_from(data, offset)
+    if head > entry_count:
+        sys.stderr.write("%d oldest events lost\n" % (head - entry_count))
+
+
+def describe(event, arg):
+    if event == 13:
+        status = arg >> 16
+        return "%s len=%d" % (STATUSES.get(status, str(status)), arg & 0xffff)
+    return "len=%d" % arg
+
+
+def main(argv):
+    args = argv[1:]
+    endian = "<"
+    if args and args[0] == "--big-endian":
+        endian = ">"
+        args = args[1:]
+    if len(args) != 1:
+        sys.stderr.write(__doc__)
+        return 1
+
+    with open(args[0], "rb") as f:
+        data = f.read()
+
+    time_first = None
+    time_prev = None
+    print("%8s %10s %8s  %-8s %3s %4s %5s  %s" %
+          ("seq", "time_us", "delta", "event", "ch", "addr", "ep", "detail"))
+    for seq, time_us, event, channel, address, endpoint, arg in decode(data, endian):
+        if time_first is None:
+            time_first = time_us
+            time_prev = time_us
+        # timestamps are 32 bit microseconds, wrapping around
+        delta = (time_us - time_prev) & 0xffffffff
+        time_prev = time_us
+        print("%8d %10d %8d  %-8s %3s %4d %5s  %s" % (
+            seq,
+            (time_us - time_first) & 0xffffffff,
+            delta,
+            EVENTS.get(event, "?%d" % event),
+            "-" if channel == CHANNEL_NONE else str(channel),
+            address,
+            "%d%s" % (endpoint & 0x7f, "in" if endpoint & 0x80 else "out"),
+            describe(event, arg)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))